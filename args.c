@@ -0,0 +1,428 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include "balls.h"
+
+/* Environment variables giving the default device of each stage. */
+#define CPU_DEVICE_ENV "BALLS_CPU_DEVICE"
+#define GPU_DEVICE_ENV "BALLS_GPU_DEVICE"
+#define CACHE_DIR_ENV "BALLS_CACHE_DIR" /* Default program cache. */
+
+static int paramOption(const char *arg, Params *p);
+static int imagePattern(const char *pattern, ImageFormat *format);
+static int parseResolution(const char *s, int *w, int *h);
+
+/*
+ * Parse the command line into opts. Options are of the form --name=value.
+ * The first argument that is not an option is the number of balls. Returns
+ * non-zero on error.
+ */
+int
+parseArgs(int argc, char *argv[], Options *opts) {
+	int i;
+	const char *val;
+
+	opts->nBalls = NBALLS_DEFAULT;
+	opts->broadPhase = BROAD_PARTITION;
+	opts->render = RENDER_FANS;
+	opts->vertexFormat = VERTEX_FLOAT;
+	opts->headless = 0;
+	opts->steps = STEPS_DEFAULT;
+	opts->substeps = 1;
+	opts->depth = 1;
+	opts->profile = NULL;
+	if ((opts->cpuDevice = getenv(CPU_DEVICE_ENV)) == NULL)
+		opts->cpuDevice = "cpu";
+	if ((opts->gpuDevice = getenv(GPU_DEVICE_ENV)) == NULL)
+		opts->gpuDevice = "gpu";
+	opts->singleDevice = 0;
+	opts->fused = 0;
+	opts->layout = LAYOUT_SPLIT;
+	opts->backend = BACKEND_OPENCL;
+	opts->threads = 0;
+	opts->procs = 0;
+	opts->simd = SIMD_AUTO;
+	opts->checkSimd = 0;
+	opts->load = NULL;
+	opts->snapshot = NULL;
+	opts->snapshotInterval = SNAPSHOT_INTERVAL_DEFAULT;
+	opts->seed = time(NULL);
+	if ((opts->cache = getenv(CACHE_DIR_ENV)) == NULL)
+		opts->cache = CACHE_DIR_DEFAULT;
+	defaultParams(&opts->params);
+	opts->diagInterval = 0;
+	opts->diagOverlap = 0;
+	opts->ccd = 0;
+	opts->trajectory = NULL;
+	opts->trajectoryVelocities = 0;
+	opts->trajectoryDelta = 0;
+	opts->offscreen = NULL;
+	opts->imageFormat = IMAGE_PPM;
+	opts->width = WIDTH;
+	opts->height = HEIGHT;
+	opts->frames = FRAMES_DEFAULT;
+	opts->fission = FISSION_NONE;
+	opts->fissionUnits = 0;
+
+	/* Config files first, so that the options override them wherever they are. */
+	for (i = 1; i < argc; i++)
+		if (strncmp(argv[i], "--", 2) == 0 && (val = optionValue(argv[i], "config")) != NULL && loadParams(&opts->params, val) != 0)
+			return 1;
+
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--", 2) != 0) {
+			if (parseCount(argv[i], &opts->nBalls) != 0)
+				return 1;
+		} else if ((val = optionValue(argv[i], "broadphase")) != NULL) {
+			if (strcmp(val, "partition") == 0)
+				opts->broadPhase = BROAD_PARTITION;
+			else if (strcmp(val, "grid") == 0)
+				opts->broadPhase = BROAD_GRID;
+			else if (strcmp(val, "sweep") == 0)
+				opts->broadPhase = BROAD_SWEEP;
+			else
+				return 1;
+		} else if ((val = optionValue(argv[i], "render")) != NULL) {
+			if (strcmp(val, "fans") == 0)
+				opts->render = RENDER_FANS;
+			else if (strcmp(val, "instanced") == 0)
+				opts->render = RENDER_INSTANCED;
+			else
+				return 1;
+		} else if ((val = optionValue(argv[i], "vertex-format")) != NULL) {
+			if (strcmp(val, "float") == 0)
+				opts->vertexFormat = VERTEX_FLOAT;
+			else if (strcmp(val, "short") == 0)
+				opts->vertexFormat = VERTEX_SHORT;
+			else
+				return 1;
+		} else if ((val = optionValue(argv[i], "headless")) != NULL) {
+			if (*val != '\0')
+				return 1;
+			opts->headless = 1;
+		} else if ((val = optionValue(argv[i], "steps")) != NULL) {
+			if (parseCount(val, &opts->steps) != 0)
+				return 1;
+		} else if ((val = optionValue(argv[i], "substeps")) != NULL) {
+			if (parseCount(val, &opts->substeps) != 0)
+				return 1;
+		} else if ((val = optionValue(argv[i], "depth")) != NULL) {
+			if (parseCount(val, &opts->depth) != 0)
+				return 1;
+		} else if ((val = optionValue(argv[i], "profile")) != NULL) {
+			opts->profile = (*val != '\0') ? val : TRACE_FILE_DEFAULT;
+		} else if ((val = optionValue(argv[i], "cpu-device")) != NULL) {
+			if (*val == '\0')
+				return 1;
+			opts->cpuDevice = val;
+		} else if ((val = optionValue(argv[i], "gpu-device")) != NULL) {
+			if (*val == '\0')
+				return 1;
+			opts->gpuDevice = val;
+		} else if ((val = optionValue(argv[i], "single-device")) != NULL) {
+			if (*val != '\0')
+				return 1;
+			opts->singleDevice = 1;
+		} else if ((val = optionValue(argv[i], "fused")) != NULL) {
+			if (*val != '\0')
+				return 1;
+			opts->fused = 1;
+		} else if ((val = optionValue(argv[i], "layout")) != NULL) {
+			if (strcmp(val, "split") == 0)
+				opts->layout = LAYOUT_SPLIT;
+			else if (strcmp(val, "packed") == 0)
+				opts->layout = LAYOUT_PACKED;
+			else
+				return 1;
+		} else if ((val = optionValue(argv[i], "backend")) != NULL) {
+			if (strcmp(val, "opencl") == 0)
+				opts->backend = BACKEND_OPENCL;
+			else if (strcmp(val, "native") == 0)
+				opts->backend = BACKEND_NATIVE;
+			else if (strcmp(val, "strips") == 0)
+				opts->backend = BACKEND_STRIPS;
+			else
+				return 1;
+		} else if ((val = optionValue(argv[i], "threads")) != NULL) {
+			if (parseCount(val, &opts->threads) != 0)
+				return 1;
+		} else if ((val = optionValue(argv[i], "procs")) != NULL) {
+			if (parseCount(val, &opts->procs) != 0)
+				return 1;
+		} else if ((val = optionValue(argv[i], "simd")) != NULL) {
+			if (strcmp(val, "auto") == 0)
+				opts->simd = SIMD_AUTO;
+			else if (strcmp(val, "avx2") == 0)
+				opts->simd = SIMD_AVX2;
+			else if (strcmp(val, "sse") == 0)
+				opts->simd = SIMD_SSE;
+			else if (strcmp(val, "scalar") == 0)
+				opts->simd = SIMD_SCALAR;
+			else
+				return 1;
+		} else if ((val = optionValue(argv[i], "check-simd")) != NULL) {
+			if (*val == '\0')
+				opts->checkSimd = CHECK_SIMD_DEFAULT;
+			else if (parseCount(val, &opts->checkSimd) != 0)
+				return 1;
+		} else if ((val = optionValue(argv[i], "load")) != NULL) {
+			if (*val == '\0')
+				return 1;
+			opts->load = val;
+		} else if ((val = optionValue(argv[i], "snapshot")) != NULL) {
+			if (*val == '\0')
+				return 1;
+			opts->snapshot = val;
+		} else if ((val = optionValue(argv[i], "snapshot-interval")) != NULL) {
+			if (parseCount(val, &opts->snapshotInterval) != 0)
+				return 1;
+		} else if ((val = optionValue(argv[i], "seed")) != NULL) {
+			if (parseSeed(val, &opts->seed) != 0)
+				return 1;
+		} else if ((val = optionValue(argv[i], "cache")) != NULL) {
+			if (*val == '\0')
+				return 1;
+			opts->cache = val;
+		} else if ((val = optionValue(argv[i], "no-cache")) != NULL) {
+			if (*val != '\0')
+				return 1;
+			opts->cache = NULL;
+		} else if ((val = optionValue(argv[i], "diagnostics")) != NULL) {
+			if (*val == '\0')
+				opts->diagInterval = DIAG_INTERVAL_DEFAULT;
+			else if (parseCount(val, &opts->diagInterval) != 0)
+				return 1;
+		} else if ((val = optionValue(argv[i], "diagnostics-overlap")) != NULL) {
+			if (*val != '\0')
+				return 1;
+			opts->diagOverlap = 1;
+		} else if ((val = optionValue(argv[i], "trajectory")) != NULL) {
+			if (*val == '\0')
+				return 1;
+			opts->trajectory = val;
+		} else if ((val = optionValue(argv[i], "trajectory-velocities")) != NULL) {
+			if (*val != '\0')
+				return 1;
+			opts->trajectoryVelocities = 1;
+		} else if ((val = optionValue(argv[i], "trajectory-delta")) != NULL) {
+			if (*val != '\0')
+				return 1;
+			opts->trajectoryDelta = 1;
+		} else if ((val = optionValue(argv[i], "offscreen")) != NULL) {
+			if (imagePattern(val, &opts->imageFormat) != 0)
+				return 1;
+			opts->offscreen = val;
+		} else if ((val = optionValue(argv[i], "resolution")) != NULL) {
+			if (parseResolution(val, &opts->width, &opts->height) != 0)
+				return 1;
+		} else if ((val = optionValue(argv[i], "frames")) != NULL) {
+			if (parseCount(val, &opts->frames) != 0)
+				return 1;
+		} else if ((val = optionValue(argv[i], "fission")) != NULL) {
+			if (strcmp(val, "numa") == 0) {
+				opts->fission = FISSION_NUMA;
+			} else {
+				if (parseCount(val, &opts->fissionUnits) != 0)
+					return 1;
+				opts->fission = FISSION_EQUAL;
+			}
+		} else if ((val = optionValue(argv[i], "ccd")) != NULL) {
+			if (*val != '\0')
+				return 1;
+			opts->ccd = 1;
+		} else if ((val = optionValue(argv[i], "config")) != NULL) {
+			continue; /* Loaded above. */
+		} else if (paramOption(argv[i], &opts->params) != 0) {
+			return 1;
+		}
+	}
+	if (checkParams(&opts->params) != 0)
+		return 1;
+
+	/* The grid and sweep kernels only know the split layout, and only exist in OpenCL. */
+	if (opts->layout == LAYOUT_PACKED && opts->broadPhase != BROAD_PARTITION)
+		return 1;
+	if (opts->backend != BACKEND_OPENCL && opts->broadPhase != BROAD_PARTITION)
+		return 1;
+	/* The diagnostics read the OpenCL buffers, which the host backends don't update. */
+	if (opts->backend != BACKEND_OPENCL && opts->diagInterval > 0)
+		return 1;
+	if (opts->diagOverlap && opts->diagInterval == 0)
+		return 1;
+	/*
+	 * Only the per-ball kernels and the partition's pair kernel can be split
+	 * across sub-devices, and the vertex stage can't share a sub-device.
+	 */
+	if (opts->fission != FISSION_NONE && (opts->backend != BACKEND_OPENCL || opts->broadPhase != BROAD_PARTITION || opts->fused || opts->singleDevice))
+		return 1;
+	if (opts->checkSimd > 0 && opts->backend != BACKEND_NATIVE)
+		return 1;
+	/* Offscreen frames are drawn by GL, which headless runs don't start. */
+	if (opts->offscreen != NULL && opts->headless)
+		return 1;
+	/* Only the partition's pair kernel sweeps the balls. */
+	if (opts->ccd && (opts->broadPhase != BROAD_PARTITION || opts->backend != BACKEND_OPENCL))
+		return 1;
+	return 0;
+}
+
+void
+usage(void) {
+	printf("usage: balls [options] [number of balls]\n");
+	printf("  --broadphase=partition|grid|sweep  collision broad phase (default partition)\n");
+	printf("  --render=fans|instanced            how the balls are drawn (default fans)\n");
+	printf("  --vertex-format=float|short        fan vertices as floats or 16-bit integers (default float)\n");
+	printf("  --headless                         run the physics only, without a window\n");
+	printf("  --steps=N                          number of steps to run when headless (default %d)\n", STEPS_DEFAULT);
+	printf("  --substeps=K                       physics steps per frame (default 1)\n");
+	printf("  --depth=N                          frames the CPU may run ahead of the display (default 1)\n");
+	printf("  --profile[=FILE]                   profile every command and write a Chrome trace (default %s)\n", TRACE_FILE_DEFAULT);
+	printf("  --cpu-device=DEV                   device of the physics stage (default $%s or cpu)\n", CPU_DEVICE_ENV);
+	printf("  --gpu-device=DEV                   device of the vertex stage (default $%s or gpu)\n", GPU_DEVICE_ENV);
+	printf("  --single-device                    run every kernel on the physics device\n");
+	printf("  --fused                            fewer, fused kernel launches per step\n");
+	printf("  --layout=split|packed              ball state layout; packed needs the partition (default split)\n");
+	printf("  --backend=opencl|native|strips     run the physics in OpenCL, in C threads or in one process per strip (default opencl)\n");
+	printf("  --threads=N                        threads of the native backend (default one per processor)\n");
+	printf("  --procs=N                          processes of the strips backend (default one per processor)\n");
+	printf("  --simd=auto|avx2|sse|scalar        vector instructions of the native backend (default auto)\n");
+	printf("  --check-simd[=N]                   check that the native kernels match the scalar ones over N steps (default %d)\n", CHECK_SIMD_DEFAULT);
+	printf("  --load=FILE                        start from a snapshot instead of a random scene\n");
+	printf("  --snapshot=FILE                    write snapshots of the simulation to FILE\n");
+	printf("  --snapshot-interval=N              physics steps between snapshots (default %d)\n", SNAPSHOT_INTERVAL_DEFAULT);
+	printf("  --seed=N                           seed of the random scene (default the time)\n");
+	printf("  --cache=DIR                        cache compiled programs in DIR (default $%s or %s)\n", CACHE_DIR_ENV, CACHE_DIR_DEFAULT);
+	printf("  --no-cache                         always build the programs from source\n");
+	printf("  --diagnostics[=N]                  print energy, momentum and speed every N frames (default %d)\n", DIAG_INTERVAL_DEFAULT);
+	printf("  --diagnostics-overlap              include the maximum overlap of the balls; takes O(n^2) time\n");
+	printf("  --trajectory=FILE                  stream the positions of every frame to FILE\n");
+	printf("  --trajectory-velocities            include the velocities in the trajectory\n");
+	printf("  --trajectory-delta                 delta-encode and compress the trajectory frames\n");
+	printf("  --offscreen=PATTERN                draw to images named by PATTERN, e.g. out/%%05d.png, in a hidden window\n");
+	printf("  --resolution=WxH                   size of the offscreen images (default %dx%d)\n", WIDTH, HEIGHT);
+	printf("  --frames=N                         frames to draw offscreen (default %d)\n", FRAMES_DEFAULT);
+	printf("  --fission=numa|N                   split the physics device by NUMA node or into N compute units each\n");
+	printf("  --ccd                              continuous collisions, for fewer substeps; needs the partition\n");
+	printf("  --config=FILE                      read simulation parameters from FILE\n");
+	printf("  --gravity=G --density=D --fps=N    simulation parameters, which override --config\n");
+	printf("  --rmin=R --rmax=R --vmax=V         (defaults %g, %g, %d, %g, %g, %g,\n", GRAVITY_DEFAULT, DENSITY_DEFAULT, FPS_DEFAULT, RMIN_DEFAULT, RMAX_DEFAULT, VMAX_INIT_DEFAULT);
+	printf("  --circle-points=N                  %d and -1,-1,1,1)\n", CIRCLE_POINTS_DEFAULT);
+	printf("  --bounds=X0,Y0,X1,Y1\n");
+	printf("  DEV is cpu, gpu, accelerator, or P:D for device D of platform P.\n");
+}
+
+/*
+ * If arg is "--name" or "--name=value", return a pointer to value (the empty
+ * string if there is none). Otherwise return NULL.
+ */
+const char *
+optionValue(const char *arg, const char *name) {
+	size_t n;
+
+	n = strlen(name);
+	if (strncmp(arg+2, name, n) != 0)
+		return NULL;
+	if (arg[2+n] == '\0')
+		return arg+2+n;
+	if (arg[2+n] == '=')
+		return arg+2+n+1;
+	return NULL;
+}
+
+/* Set the parameter of the option arg, --name=value. Returns non-zero on error. */
+static int
+paramOption(const char *arg, Params *p) {
+	char name[32];
+	const char *eq;
+
+	if ((eq = strchr(arg, '=')) == NULL || eq-arg-2 >= (int) sizeof(name))
+		return 1;
+	memcpy(name, arg+2, eq-arg-2);
+	name[eq-arg-2] = '\0';
+	return setParam(p, name, eq+1);
+}
+
+/*
+ * Check that pattern has exactly one integer conversion, for the frame
+ * number, and set *format from its extension: .raw, .ppm or .png. Returns
+ * non-zero on error.
+ */
+static int
+imagePattern(const char *pattern, ImageFormat *format) {
+	const char *s, *ext;
+	int n;
+
+	n = 0;
+	for (s = pattern; (s = strchr(s, '%')) != NULL; s++) {
+		if (s[1] == '%') {
+			s++;
+			continue;
+		}
+		for (s++; *s >= '0' && *s <= '9'; s++)
+			;
+		if (*s != 'd')
+			return 1;
+		n++;
+	}
+	if (n != 1 || (ext = strrchr(pattern, '.')) == NULL)
+		return 1;
+	if (strcmp(ext, ".raw") == 0)
+		*format = IMAGE_RAW;
+	else if (strcmp(ext, ".ppm") == 0)
+		*format = IMAGE_PPM;
+	else if (strcmp(ext, ".png") == 0)
+		*format = IMAGE_PNG;
+	else
+		return 1;
+	return 0;
+}
+
+/* Parse a positive integer. Returns non-zero on error. */
+int
+parseCount(const char *s, int *n) {
+	char *end;
+	long l;
+
+	errno = 0;
+	l = strtol(s, &end, 10);
+	if (end == s || *end != '\0' || errno == ERANGE || l < 1 || l > INT_MAX)
+		return 1;
+	*n = l;
+	return 0;
+}
+
+/* Parse a resolution, WxH, of positive integers. Returns non-zero on error. */
+static int
+parseResolution(const char *s, int *w, int *h) {
+	char buf[32], *x;
+
+	if (strlen(s) >= sizeof(buf))
+		return 1;
+	strcpy(buf, s);
+	if ((x = strchr(buf, 'x')) == NULL)
+		return 1;
+	*x = '\0';
+	return parseCount(buf, w) != 0 || parseCount(x+1, h) != 0;
+}
+
+/* Parse a seed: a whole non-negative number that fits. Returns non-zero on error. */
+int
+parseSeed(const char *s, unsigned long *seed) {
+	char *end;
+
+	/* strtoul() would accept a sign, and wrap a negative number around. */
+	if (!isdigit((unsigned char) *s))
+		return 1;
+	errno = 0;
+	*seed = strtoul(s, &end, 10);
+	if (*end != '\0' || errno == ERANGE)
+		return 1;
+	return 0;
+}
@@ -11,81 +11,181 @@
 #include "balls.h"
 #include "sysfatal.h"
 #include "gl.h"
+#include "profile.h"
+#include "pipeline.h"
+#include "cl.h"
 
 #define nelem(arr) (sizeof(arr) / sizeof(arr[0]))
 
-enum {
-	MS_PER_S = 1000,
-	FRAME_TIME_MS = MS_PER_S / FPS,
- };
+enum { MS_PER_S = 1000 };
+enum { MAX_LAG_FRAMES = 4 }; /* Frames of physics to catch up on before dropping time. */
 
-const Rect bounds = { {-1.0, -1.0}, {1.0, 1.0} };
+#define FRAME_TIME (1.0 / opts.params.fps) /* Seconds per frame. */
+
+Rect bounds;
 
 void setPositions(void);
 void setVelocities(void);
 void setRadii(void);
+void setState(void);
+void genBalls(void);
 void setCollisions(void);
 void configSharedData(void);
 void setKernelArgs(void);
 void animate(int v);
+cl_event simulate(int n);
+void simulateHost(int n);
+cl_event step(void);
+void runHeadless(void);
 void move(void);
 void collideBalls(void);
+void collideRounds(void);
 cl_event collideWalls(void);
-void genVertices(void);
+cl_event integrate(void);
+void genVertices(cl_event written);
 void display(void);
-void copyPositionsToGpu(cl_event cpuEvent);
 void reshape(int w, int h);
 void keyboard(unsigned char key, int x, int y);
-void freeCL(void);
 void frameCount(void);
 void drawString(const char *str);
 float *flatten(Vector *vs, int n);
 
+Options opts;
+int cpuCL; /* Running the physics with OpenCL on the CPU device. */
+int gpuCL; /* Generating vertices with OpenCL on the GPU. */
 int nBalls;
-cl_context cpuContext, gpuContext;
-cl_command_queue cpuQueue, gpuQueue;
-cl_kernel moveKernel, collideWallsKernel, collideBallsKernel, genVerticesKernel;
-GLuint vertexVAO, vertexVBO, colorVBO;
-cl_mem positionsCpuBuf, positionsGpuBuf, velocitiesCpuBuf, radiiCpuBuf, radiiGpuBuf, *collisionsCpuBufs, vertexGpuBuf;
-float *positionsHostBuf;
+GLuint vertexVAO, vertexVBO, radiusVBO, colorVBO;
+cl_mem radiiGpuBuf, vertexGpuBuf;
+float *positionsHostBuf, *velocitiesHostBuf, *radiiHostBuf, *colorsHostBuf;
+double stepTime; /* Seconds of simulated time per physics step. */
 Partition collisionPartition;
+size_t roundsSize; /* Work-group size of collideRounds, or 0 to launch collideBalls per cell instead. */
+
+extern ContextMode contextMode;
+extern cl_context cpuContext, gpuContext;
+extern cl_command_queue cpuQueue, gpuQueue;
+extern cl_kernel moveKernel, collideWallsKernel, collideBallsKernel, genVerticesKernel;
+extern cl_kernel integrateKernel, collideRoundsKernel, packStateKernel, initBallsKernel;
+extern cl_mem positionsCpuBuf, velocitiesCpuBuf, radiiCpuBuf;
+extern cl_mem stateCpuBuf, propsCpuBuf;
 
 int
 main(int argc, char *argv[]) {
-	nBalls = NBALLS_DEFAULT;
-	if (argc > 1) {
-		if (sscanf(argv[1], "%d", &nBalls) != 1 || nBalls < 1) {
-			printf("usage: balls [number of balls]\n");
-			return 1;
-		}
-	}
-
-	initGL(argc, argv);
-
-	initCL();
+	double start;
 
+	start = wallClock();
+	if (parseArgs(argc, argv, &opts) != 0) {
+		usage();
+		return 1;
+	}
+	nBalls = opts.nBalls;
+	bounds = opts.params.bounds;
+	cpuCL = opts.backend == BACKEND_OPENCL;
+	gpuCL = !opts.headless && opts.render == RENDER_FANS;
+	stepTime = FRAME_TIME / opts.substeps;
+	if (opts.profile != NULL)
+		profileInit(opts.profile);
+	if (opts.load != NULL)
+		loadSnapshot(opts.load);
+	else
+		printf("Seed: %lu\n", opts.seed);
+	seedRand(opts.seed);
+
+	if (!opts.headless)
+		initGL(argc, argv);
+	if (opts.offscreen != NULL)
+		initOffscreen();
+
+	/* The host backends only need OpenCL to draw fans. */
+	if (cpuCL || gpuCL)
+		initCL();
+
+	if (opts.load == NULL)
+		genBalls();
+	setRadii();
 	setPositions();
 	setVelocities();
-	setRadii();
-	setCollisions();
-
-	genBuffers(&vertexVAO, &vertexVBO, &colorVBO, nBalls);
-
-	configSharedData();
+	if (cpuCL && opts.layout == LAYOUT_PACKED)
+		setState();
+	switch (opts.broadPhase) {
+	case BROAD_PARTITION:
+		setCollisions();
+		break;
+	case BROAD_GRID:
+		initGrid();
+		break;
+	case BROAD_SWEEP:
+		initSweep();
+		break;
+	}
+	if (opts.fission != FISSION_NONE)
+		initFission();
+	if (opts.backend == BACKEND_NATIVE)
+		initNative();
+	else if (opts.backend == BACKEND_STRIPS)
+		initStrips();
+	if (opts.checkSimd > 0)
+		checkNative(opts.checkSimd);
+	initSnapshots();
+	initDiagnostics();
+	initTrajectory();
+	printf("Startup: %.3f s\n", wallClock() - start);
+
+	if (opts.headless) {
+		setKernelArgs();
+		runHeadless();
+	} else {
+		if (opts.render == RENDER_INSTANCED) {
+			genInstanceBuffers(&vertexVAO, &vertexVBO, &radiusVBO, &colorVBO, nBalls, positionsHostBuf, radiiHostBuf, colorsHostBuf);
+		} else {
+			genBuffers(&vertexVAO, &vertexVBO, &colorVBO, nBalls, colorsHostBuf);
+			configSharedData();
+		}
+		initPipeline();
 
-	setKernelArgs();
+		setKernelArgs();
 
-	glutDisplayFunc(display);
-	glutReshapeFunc(reshape);
-	glutKeyboardFunc(keyboard);
-	glutTimerFunc(0, animate, 0);
+		/* Offscreen frames are only drawn by animate(), once each. */
+		glutDisplayFunc((opts.offscreen != NULL) ? offscreenDisplay : display);
+		glutReshapeFunc(reshape);
+		glutKeyboardFunc(keyboard);
+		glutTimerFunc(0, animate, 0);
 
-	glutMainLoop();
+		glutMainLoop();
+	}
 
-	freeCL();
-	freeGL(vertexVAO, vertexVBO, colorVBO);
-	freePartition(collisionPartition);
-	free(positionsHostBuf);
+	freeDiagnostics();
+	profileFinish();
+	finishSnapshots();
+	finishTrajectory();
+	if (opts.broadPhase == BROAD_GRID)
+		freeGrid();
+	else if (opts.broadPhase == BROAD_SWEEP)
+		freeSweep();
+	if (!opts.headless)
+		freePipeline();
+	if (opts.fission != FISSION_NONE)
+		freeFission();
+	if (gpuCL) {
+		clReleaseMemObject(radiiGpuBuf);
+		clReleaseMemObject(vertexGpuBuf);
+	}
+	if (cpuCL || gpuCL)
+		freeCL();
+	if (!opts.headless)
+		freeGL(vertexVAO, vertexVBO, radiusVBO, colorVBO);
+	if (opts.backend == BACKEND_NATIVE)
+		freeNative();
+	else if (opts.backend == BACKEND_STRIPS)
+		freeStrips();
+	if (opts.load != NULL) {
+		unloadSnapshot();
+	} else {
+		free(positionsHostBuf);
+		free(velocitiesHostBuf);
+		free(radiiHostBuf);
+		free(colorsHostBuf);
+	}
 
 	return 0;
 }
@@ -95,83 +195,160 @@ setPositions(void) {
 	Vector *positions;
 	int err;
 
-	/* Generate initial ball positions. */
-	positions = noOverlapPositions(nBalls, bounds, RMAX);
-	positionsHostBuf = flatten(positions, nBalls);
-	free(positions);
+	/* Generate initial ball positions, unless they were loaded. */
+	if (opts.load == NULL) {
+		positions = noOverlapPositions(nBalls, bounds, radiiHostBuf);
+		positionsHostBuf = flatten(positions, nBalls);
+		free(positions);
+	}
+	if (!cpuCL)
+		return;
 
 	/* Create CPU buffer. */
 	positionsCpuBuf = clCreateBuffer(cpuContext, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, nBalls*2*sizeof(float), positionsHostBuf, &err);
 	if (err < 0)
 		sysfatal("Failed to allocate CPU position buffer.\n");
-
-	/* Create GPU buffer. */
-	positionsGpuBuf = clCreateBuffer(gpuContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, nBalls*2*sizeof(float), positionsHostBuf, &err);
-	if (err < 0)
-		sysfatal("Failed to allocate GPU position buffer.\n");
 }
 
 void
 setVelocities(void) {
-	float *velocitiesHostBuf;
-	int i, err;
-
-	/* Generate initial ball velocities. */
-	if ((velocitiesHostBuf = malloc(nBalls*2*sizeof(float))) == NULL)
-		sysfatal("Failed to allocate velocity array.\n");
-	for (i = 0; i < nBalls; i++) {
-		velocitiesHostBuf[2*i] = randFloat(-VMAX_INIT, VMAX_INIT);
-		velocitiesHostBuf[2*i+1] = randFloat(-VMAX_INIT, VMAX_INIT);
-	}
+	int err;
+
+	if (!cpuCL)
+		return;
 
 	/* Create device-side buffer. */
 	velocitiesCpuBuf = clCreateBuffer(cpuContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, nBalls*2*sizeof(float), velocitiesHostBuf, &err);
 	if (err < 0)
 		sysfatal("Failed to allocate velocity buffer.\n");
-
-	free(velocitiesHostBuf);
 }
 
 void
 setRadii(void) {
-	float *radiiHostBuf;
-	int i, err;
-
-	/* Generate radii. */
-	if ((radiiHostBuf = malloc(nBalls*sizeof(float))) == NULL)
-		sysfatal("Failed to allocate radii array.\n");
-	for (i = 0; i < nBalls; i++)
-		radiiHostBuf[i] = randFloat(RMIN, RMAX);
+	int err;
 
 	/* Create CPU buffer. */
-	radiiCpuBuf = clCreateBuffer(cpuContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, nBalls*sizeof(float), radiiHostBuf, &err);
-	if (err <0)
-		sysfatal("Failed to allocate radii CPU buffer.\n");
+	if (cpuCL) {
+		radiiCpuBuf = clCreateBuffer(cpuContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, nBalls*sizeof(float), radiiHostBuf, &err);
+		if (err <0)
+			sysfatal("Failed to allocate radii CPU buffer.\n");
+	}
+
+	/* Create GPU buffer, unless the CPU one is in the same context. */
+	if (gpuCL && contextMode != CONTEXT_SEPARATE) {
+		radiiGpuBuf = radiiCpuBuf;
+		clRetainMemObject(radiiGpuBuf);
+	} else if (gpuCL) {
+		radiiGpuBuf = clCreateBuffer(gpuContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, nBalls*sizeof(float), radiiHostBuf, &err);
+		if (err <0)
+			sysfatal("Failed to allocate radii GPU buffer.\n");
+	}
+}
+
+/*
+ * Generate the random radii, velocities and RGB colors of the balls from
+ * opts.seed, all at once on the CPU device, into the host buffers. The host
+ * backends draw the same numbers on the host instead.
+ */
+void
+genBalls(void) {
+	cl_mem radii, velocities, colors;
+	cl_uint seedLo, seedHi;
+	int err;
+
+	radiiHostBuf = malloc(nBalls*sizeof(float));
+	velocitiesHostBuf = malloc(nBalls*2*sizeof(float));
+	colorsHostBuf = malloc(nBalls*3*sizeof(float));
+	if (radiiHostBuf == NULL || velocitiesHostBuf == NULL || colorsHostBuf == NULL)
+		sysfatal("Failed to allocate ball arrays.\n");
+	if (!cpuCL) {
+		randBalls(opts.seed, &opts.params, nBalls, radiiHostBuf, velocitiesHostBuf, colorsHostBuf);
+		return;
+	}
+
+	radii = clCreateBuffer(cpuContext, CL_MEM_WRITE_ONLY, nBalls*sizeof(float), NULL, &err);
+	if (err < 0)
+		sysfatal("Failed to allocate radii buffer.\n");
+	velocities = clCreateBuffer(cpuContext, CL_MEM_WRITE_ONLY, nBalls*2*sizeof(float), NULL, &err);
+	if (err < 0)
+		sysfatal("Failed to allocate velocity buffer.\n");
+	colors = clCreateBuffer(cpuContext, CL_MEM_WRITE_ONLY, nBalls*3*sizeof(float), NULL, &err);
+	if (err < 0)
+		sysfatal("Failed to allocate color buffer.\n");
+
+	seedLo = opts.seed & 0xFFFFFFFF;
+	seedHi = (opts.seed >> 16) >> 16;
+	err = clSetKernelArg(initBallsKernel, 0, sizeof(radii), &radii);
+	err |= clSetKernelArg(initBallsKernel, 1, sizeof(velocities), &velocities);
+	err |= clSetKernelArg(initBallsKernel, 2, sizeof(colors), &colors);
+	err |= clSetKernelArg(initBallsKernel, 3, sizeof(seedLo), &seedLo);
+	err |= clSetKernelArg(initBallsKernel, 4, sizeof(seedHi), &seedHi);
+	if (err < 0)
+		sysfatal("Failed to set arguments of initBalls kernel.\n");
+	runCpuKernel(initBallsKernel, nBalls, "initBalls");
+
+	err = clEnqueueReadBuffer(cpuQueue, radii, CL_FALSE, 0, nBalls*sizeof(float), radiiHostBuf, 0, NULL, NULL);
+	err |= clEnqueueReadBuffer(cpuQueue, velocities, CL_FALSE, 0, nBalls*2*sizeof(float), velocitiesHostBuf, 0, NULL, NULL);
+	err |= clEnqueueReadBuffer(cpuQueue, colors, CL_TRUE, 0, nBalls*3*sizeof(float), colorsHostBuf, 0, NULL, NULL);
+	if (err < 0)
+		sysfatal("Failed to read initial ball state.\n");
+
+	clReleaseMemObject(radii);
+	clReleaseMemObject(velocities);
+	clReleaseMemObject(colors);
+}
+
+/* Pack the positions, velocities and radii into the packed state buffers. */
+void
+setState(void) {
+	int err;
 
-	/* Create GPU buffer. */
-	radiiGpuBuf = clCreateBuffer(gpuContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, nBalls*sizeof(float), radiiHostBuf, &err);
-	if (err <0)
-		sysfatal("Failed to allocate radii GPU buffer.\n");
+	stateCpuBuf = cpuBuffer(nBalls*4*sizeof(float));
+	propsCpuBuf = cpuBuffer(nBalls*2*sizeof(float));
 
-	free(radiiHostBuf);
+	err = clSetKernelArg(packStateKernel, 0, sizeof(positionsCpuBuf), &positionsCpuBuf);
+	err |= clSetKernelArg(packStateKernel, 1, sizeof(velocitiesCpuBuf), &velocitiesCpuBuf);
+	err |= clSetKernelArg(packStateKernel, 2, sizeof(radiiCpuBuf), &radiiCpuBuf);
+	err |= clSetKernelArg(packStateKernel, 3, sizeof(stateCpuBuf), &stateCpuBuf);
+	err |= clSetKernelArg(packStateKernel, 4, sizeof(propsCpuBuf), &propsCpuBuf);
+	if (err < 0)
+		sysfatal("Failed to set argument of packState kernel.\n");
+	runCpuKernel(packStateKernel, nBalls, "packState");
 }
 
 void
 setCollisions(void) {
-	int i, err;
+	cl_uint nSlots, first;
+	size_t max;
+	int err;
 
 	collisionPartition = partitionCollisions(nBalls);
-	printf("Collision partition:\n");
+	printf("Collision partition: ");
 	printPartition(collisionPartition);
 
-	/* Allocate array of buffers. */
-	if ((collisionsCpuBufs = malloc(collisionPartition.size*sizeof(cl_mem))) == NULL)
-		sysfatal("Failed to allocate collision buffers.\n");
-	for (i = 0; i < collisionPartition.size; i++) {
-		/* Create device-side buffer. */
-		collisionsCpuBufs[i] = clCreateBuffer(cpuContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, collisionPartition.cells[i].size*2*sizeof(size_t), collisionPartition.cells[i].ballIndices, &err);
-		if (err < 0)
-			sysfatal("Failed to allocate collision buffer.\n");
+	if (!cpuCL)
+		return;
+
+	nSlots = collisionPartition.nSlots;
+	first = collisionPartition.first;
+	err = clSetKernelArg(collideBallsKernel, 4, sizeof(nSlots), &nSlots);
+	err |= clSetKernelArg(collideRoundsKernel, 3, sizeof(nSlots), &nSlots);
+	err |= clSetKernelArg(collideRoundsKernel, 4, sizeof(first), &first);
+	if (err < 0)
+		sysfatal("Failed to set argument of collision kernels.\n");
+
+	/* One work-group, each work-item taking every roundsSize-th pair of a cell. */
+	max = cpuWorkGroupSize(collideRoundsKernel);
+	roundsSize = (collisionPartition.cellSize < max) ? collisionPartition.cellSize : max;
+
+	/*
+	 * CPU runtimes run a work-group on one thread, so there collideRounds
+	 * only pays while the launches it saves cost more than sharing out each
+	 * cell's pairs over every core.
+	 */
+	if (opts.fused && cpuDeviceType() == CL_DEVICE_TYPE_CPU && collisionPartition.cellSize > ROUNDS_CPU_PAIRS) {
+		roundsSize = 0;
+		printf("Fused collisions: one launch per cell\n");
 	}
 }
 
@@ -189,76 +366,227 @@ void
 setKernelArgs(void) {
 	int err;
 
-	err = clSetKernelArg(moveKernel, 0, sizeof(positionsCpuBuf), &positionsCpuBuf);
-	err |= clSetKernelArg(moveKernel, 1, sizeof(velocitiesCpuBuf), &velocitiesCpuBuf);
-
-	err |= clSetKernelArg(collideWallsKernel, 0, sizeof(positionsCpuBuf), &positionsCpuBuf);
-	err |= clSetKernelArg(collideWallsKernel, 1, sizeof(velocitiesCpuBuf), &velocitiesCpuBuf);
-	err |= clSetKernelArg(collideWallsKernel, 2, sizeof(radiiCpuBuf), &radiiCpuBuf);
-
-	err |= clSetKernelArg(collideBallsKernel, 1, sizeof(positionsCpuBuf), &positionsCpuBuf);
-	err |= clSetKernelArg(collideBallsKernel, 2, sizeof(velocitiesCpuBuf), &velocitiesCpuBuf);
-	err |= clSetKernelArg(collideBallsKernel, 3, sizeof(radiiCpuBuf), &radiiCpuBuf);
+	err = 0;
+	if (cpuCL) {
+		err |= setBallArgs(moveKernel);
+		err |= setBallArgs(collideWallsKernel);
+		err |= setBallArgs(integrateKernel);
+		err |= setBallArgs(collideBallsKernel);
+		err |= setBallArgs(collideRoundsKernel);
+	}
 
-	err |= clSetKernelArg(genVerticesKernel, 0, sizeof(positionsGpuBuf), &positionsGpuBuf);
-	err |= clSetKernelArg(genVerticesKernel, 1, sizeof(radiiCpuBuf), &radiiGpuBuf);
-	err |= clSetKernelArg(genVerticesKernel, 2, sizeof(vertexGpuBuf), &vertexGpuBuf);
+	if (gpuCL) {
+		err |= clSetKernelArg(genVerticesKernel, 1, sizeof(radiiCpuBuf), &radiiGpuBuf);
+		err |= clSetKernelArg(genVerticesKernel, 2, sizeof(vertexGpuBuf), &vertexGpuBuf);
+	}
 
 	if (err < 0)
 		sysfatal("Failed to set kernel arguments.\n");
 }
 
+/*
+ * Draw a frame and advance the physics. The physics runs in fixed steps of
+ * stepTime, so each frame runs as many steps as fit in the wall time since the
+ * previous frame (normally opts.substeps). The steps are enqueued back to back
+ * with no host synchronization in between.
+ */
 void
 animate(int v) {
-	cl_event cpuEvent;
-	clock_t tstart, elapsed;
+	static double lastFrame = 0, lag = 0;
+	static int frames = 0;
+	cl_event cpuEvent, written;
+	double tstart, elapsed;
+	int nSteps;
 	unsigned int nextFrame;
 
-	tstart = clock();
+	tstart = wallClock();
+	if (lastFrame == 0) /* First frame. */
+		lastFrame = tstart - FRAME_TIME;
+	lag += tstart - lastFrame;
+	lastFrame = tstart;
+	nSteps = lag / stepTime;
+	if (nSteps > MAX_LAG_FRAMES*opts.substeps) {
+		/* Too far behind to catch up; slow the simulation down instead. */
+		nSteps = MAX_LAG_FRAMES*opts.substeps;
+		lag = 0;
+	} else {
+		lag -= nSteps * stepTime;
+	}
+	if (opts.offscreen != NULL) {
+		/* Every image is one frame of simulated time, however long it takes to draw. */
+		nSteps = opts.substeps;
+	}
 
 	/* Start computing next frame on CPU. */
-	move();
-	collideBalls();
-	cpuEvent = collideWalls();
+	if (opts.backend != BACKEND_OPENCL) {
+		/* Synchronous; the positions are in positionsHostBuf when it returns. */
+		if (nSteps > 0) {
+			simulateHost(nSteps);
+			pushHostFrame();
+		}
+	} else if ((cpuEvent = simulate(nSteps)) != NULL) {
+		pushFrame(cpuEvent);
+	}
+	snapshotSteps(nSteps);
+	diagnoseFrame(nSteps);
+	trajectoryFrame(nSteps);
 
-	/* Display current frame with GPU. */
-	genVertices();
+	/* Display the oldest frame in flight with GPU. */
+	if (popFrame(&written) && gpuCL)
+		genVertices(written);
 	display();
-
-	/* Copy next frame's positions from CPU to GPU. */
-	copyPositionsToGpu(cpuEvent);
+	profileCollect();
+
+	if (opts.offscreen != NULL) {
+		/* The images are written before the window, and the GL context, go. */
+		if (++frames == opts.frames) {
+			finishOffscreen();
+			glutDestroyWindow(glutGetWindow());
+		} else {
+			glutTimerFunc(0, animate, 0);
+		}
+		return;
+	}
 
 	/* Display next frame. */
-	elapsed = (clock() - tstart) / (CLOCKS_PER_SEC / MS_PER_S);
-	nextFrame = (elapsed > FRAME_TIME_MS) ? 0 : FRAME_TIME_MS-elapsed;
+	elapsed = wallClock() - tstart;
+	nextFrame = (elapsed > FRAME_TIME) ? 0 : (FRAME_TIME-elapsed) * MS_PER_S;
 	glutTimerFunc(nextFrame, animate, 0);
 }
 
+/*
+ * Enqueue n physics steps on the CPU. Returns an event that completes when the
+ * last one is finished, or NULL if n is 0.
+ */
+cl_event
+simulate(int n) {
+	cl_event event;
+
+	event = NULL;
+	while (n-- > 0) {
+		if (event != NULL)
+			clReleaseEvent(event);
+		event = step();
+	}
+	return event;
+}
+
+/*
+ * Enqueue one physics step on the CPU. Returns an event that completes when
+ * the step is finished. When fused, the step is the collisions followed by
+ * integrate(), which is move() and collideWalls() in one kernel, after
+ * putting balls the collisions pushed out back inside. So it is with CCD,
+ * which finds the contacts before the move.
+ */
+cl_event
+step(void) {
+	if (opts.fission != FISSION_NONE)
+		return stepFission();
+	if (!opts.fused && !opts.ccd)
+		move();
+	switch (opts.broadPhase) {
+	case BROAD_PARTITION:
+		if (opts.fused && roundsSize > 0)
+			collideRounds();
+		else
+			collideBalls();
+		break;
+	case BROAD_GRID:
+		collideGrid();
+		break;
+	case BROAD_SWEEP:
+		collideSweep();
+		break;
+	}
+	return (opts.fused || opts.ccd) ? integrate() : collideWalls();
+}
+
+/* Run n physics steps on the native or strips backend, leaving the state in the host buffers. */
+void
+simulateHost(int n) {
+	if (opts.backend == BACKEND_STRIPS)
+		simulateStrips(n);
+	else
+		simulateNative(n);
+}
+
+/*
+ * Run opts.steps physics steps as fast as possible and report the throughput.
+ * Each step advances the simulation by stepTime.
+ */
+void
+runHeadless(void) {
+	double tstart, elapsed;
+	int i, n, chunk;
+
+	printf("Running %d steps headless\n", opts.steps);
+	tstart = wallClock();
+	if (opts.backend != BACKEND_OPENCL) {
+		/* In chunks, so that snapshots are taken on time and each step of a trajectory is a frame. */
+		chunk = (opts.snapshot != NULL) ? opts.snapshotInterval : opts.steps;
+		if (opts.trajectory != NULL)
+			chunk = 1;
+		for (i = 0; i < opts.steps; i += n) {
+			n = (opts.steps-i < chunk) ? opts.steps-i : chunk;
+			simulateHost(n);
+			snapshotSteps(n);
+			trajectoryFrame(n);
+		}
+	} else {
+		for (i = 0; i < opts.steps; i++) {
+			clReleaseEvent(step());
+			snapshotSteps(1);
+			diagnoseFrame(1);
+			trajectoryFrame(1);
+			profileCollect();
+		}
+		clFinish(cpuQueue);
+	}
+	elapsed = wallClock() - tstart;
+
+	printf("%d steps in %.3f s (%.1f steps/s, %.3f s simulated)\n", opts.steps, elapsed, opts.steps/elapsed, opts.steps*stepTime);
+}
+
 void
 move(void) {
 	size_t size;
 	int err;
 
 	size = nBalls;
-	err = clEnqueueNDRangeKernel(cpuQueue, moveKernel, 1, NULL, &size, NULL, 0, NULL, NULL);
+	err = clEnqueueNDRangeKernel(cpuQueue, moveKernel, 1, NULL, &size, NULL, 0, NULL, profileEvent("move", STAGE_CPU));
 	if (err < 0)
 		sysfatal("Couldn't enqueue kernel.\n");
 }
 
 void
 collideBalls(void) {
-	int i, err;
+	cl_uint cell;
+	int err;
 
-	for (i = 0; i < collisionPartition.size; i++) {
-		err = clSetKernelArg(collideBallsKernel, 0, sizeof(collisionsCpuBufs[i]), collisionsCpuBufs+i);
+	if (collisionPartition.cellSize == 0)
+		return;
+	for (cell = 0; cell < collisionPartition.size; cell++) {
+		err = clSetKernelArg(collideBallsKernel, 3, sizeof(cell), &cell);
 		if (err < 0)
 			sysfatal("Failed to set argument of collideBalls kernel.\n");
-		err = clEnqueueNDRangeKernel(cpuQueue, collideBallsKernel, 1, NULL, &collisionPartition.cells[i].size, NULL, 0, NULL, NULL);
+		err = clEnqueueNDRangeKernel(cpuQueue, collideBallsKernel, 1, &collisionPartition.first, &collisionPartition.cellSize, NULL, 0, NULL, profileEvent("collideBalls", STAGE_CPU));
 		if (err < 0)
 			sysfatal("Couldn't enqueue kernel.\n");
 	}
 }
 
+/* Collide every cell of the partition in one launch of a single work-group. */
+void
+collideRounds(void) {
+	int err;
+
+	if (collisionPartition.cellSize == 0)
+		return;
+	err = clEnqueueNDRangeKernel(cpuQueue, collideRoundsKernel, 1, NULL, &roundsSize, &roundsSize, 0, NULL, profileEvent("collideRounds", STAGE_CPU));
+	if (err < 0)
+		sysfatal("Couldn't enqueue kernel.\n");
+}
+
 cl_event
 collideWalls(void) {
 	size_t size;
@@ -269,66 +597,85 @@ collideWalls(void) {
 	err = clEnqueueNDRangeKernel(cpuQueue, collideWallsKernel, 1, NULL, &size, NULL, 0, NULL, &event);
 	if (err < 0)
 		sysfatal("Couldn't enqueue kernel.\n");
+	profileRetain("collideWalls", STAGE_CPU, event);
+	return event;
+}
+
+cl_event
+integrate(void) {
+	size_t size;
+	cl_event event;
+	int err;
+
+	size = nBalls;
+	err = clEnqueueNDRangeKernel(cpuQueue, integrateKernel, 1, NULL, &size, NULL, 0, NULL, &event);
+	if (err < 0)
+		sysfatal("Couldn't enqueue kernel.\n");
+	profileRetain("integrate", STAGE_CPU, event);
 	return event;
 }
 
+/*
+ * Generate the vertices once the positions have been written to the GPU. If
+ * written is NULL, the positions are already there.
+ */
 void
-genVertices(void) {
+genVertices(cl_event written) {
 	int err;
 	size_t localSize, globalSize;
 	cl_event kernelEvent;
 
 	glFinish();
 
-	err = clEnqueueAcquireGLObjects(gpuQueue, 1, &vertexGpuBuf, 0, NULL, NULL);
+	err = clEnqueueAcquireGLObjects(gpuQueue, 1, &vertexGpuBuf, 0, NULL, profileEvent("acquireGL", STAGE_GPU));
 	if (err < 0)
 		sysfatal("Couldn't acquire the GL objects.\n");
 
-	localSize = CIRCLE_POINTS;
+	localSize = opts.params.circlePoints;
 	globalSize = nBalls * localSize;
-	err = clEnqueueNDRangeKernel(gpuQueue, genVerticesKernel, 1, NULL, &globalSize, &localSize, 0, NULL, &kernelEvent);
+	err = clEnqueueNDRangeKernel(gpuQueue, genVerticesKernel, 1, NULL, &globalSize, &localSize, (written != NULL), (written != NULL) ? &written : NULL, &kernelEvent);
 	if (err < 0)
 		sysfatal("Couldn't enqueue kernel.\n");
+	profileRetain("genVertices", STAGE_GPU, kernelEvent);
 
 	err = clWaitForEvents(1, &kernelEvent);
 	if (err < 0)
 		sysfatal("Couldn't enqueue the kernel.\n");
 
-	clEnqueueReleaseGLObjects(gpuQueue, 1, &vertexGpuBuf, 0, NULL, NULL);
+	clEnqueueReleaseGLObjects(gpuQueue, 1, &vertexGpuBuf, 0, NULL, profileEvent("releaseGL", STAGE_GPU));
 	clFinish(gpuQueue);
 	clReleaseEvent(kernelEvent);
+	if (written != NULL)
+		clReleaseEvent(written);
 }
 
 void
 display(void) {
 	int i;
 
+	if (opts.offscreen != NULL)
+		beginOffscreenFrame();
 	glClear(GL_COLOR_BUFFER_BIT |GL_DEPTH_BUFFER_BIT);
 
 	glBindVertexArray(vertexVAO);
-	for (i = 0; i < nBalls; i++)
-		glDrawArrays(GL_TRIANGLE_FAN, i*CIRCLE_POINTS, CIRCLE_POINTS);
+	if (opts.render == RENDER_INSTANCED) {
+		glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, nBalls);
+	} else {
+		for (i = 0; i < nBalls; i++)
+			glDrawArrays(GL_TRIANGLE_FAN, i*opts.params.circlePoints, opts.params.circlePoints);
+	}
 	glBindVertexArray(0);
 
+	/* No frame rate in the images, so that runs can be compared. */
+	if (opts.offscreen != NULL) {
+		endOffscreenFrame();
+		return;
+	}
 	frameCount();
 
 	glutSwapBuffers();
 }
 
-/* Wait for the CPU to finish computing the new positions and then copy them to the GPU. */
-void
-copyPositionsToGpu(cl_event cpuEvent) {
-	int err;
-
-	err = clWaitForEvents(1, &cpuEvent);
-	if (err < 0)
-		sysfatal("Error waiting for CPU kernel to finish.\n");
-	clReleaseEvent(cpuEvent);
-	err = clEnqueueWriteBuffer(gpuQueue, positionsGpuBuf, CL_TRUE, 0, nBalls*2*sizeof(float), positionsHostBuf, 0, NULL, NULL);
-	if (err < 0)
-		sysfatal("Failed to copy positions from host to GPU.\n");
-}
-
 void
 reshape(int w, int h) {
 	glViewport(0, 0, (GLsizei) w, (GLsizei) h);
@@ -340,47 +687,24 @@ keyboard(unsigned char key, int x, int y) {
 		glutDestroyWindow(glutGetWindow());
 }
 
-void
-freeCL(void) {
-	size_t i;
-
-	clReleaseMemObject(positionsCpuBuf);
-	clReleaseMemObject(positionsGpuBuf);
-	clReleaseMemObject(velocitiesCpuBuf);
-	clReleaseMemObject(radiiCpuBuf);
-	clReleaseMemObject(radiiGpuBuf);
-	for (i = 0; i < collisionPartition.size; i++)
-		clReleaseMemObject(collisionsCpuBufs[i]);
-	free(collisionsCpuBufs);
-	clReleaseMemObject(vertexGpuBuf);
-
-	clReleaseKernel(moveKernel);
-	clReleaseKernel(collideWallsKernel);
-	clReleaseKernel(collideBallsKernel);
-	clReleaseKernel(genVerticesKernel);
-
-	clReleaseCommandQueue(cpuQueue);
-	clReleaseCommandQueue(gpuQueue);
-	clReleaseContext(cpuContext);
-	clReleaseContext(gpuContext);
-}
-
 void
 frameCount(void) {
 	static int fps = 0;
 	static int nFrames = 0;
 	static time_t t0 = 0;
-	static char str[16];
+	static double latency = 0;
+	static char str[48];
 	time_t t1;
 
 	t1 = time(NULL);
 	if (t1 > t0) {
 		fps = nFrames;
+		latency = frameLatency();
 		nFrames = 0;
 		t0 = t1;
 	}
 
-	snprintf(str, nelem(str), "%d FPS", fps);
+	snprintf(str, nelem(str), "%d FPS, %.1f ms latency", fps, latency*MS_PER_S);
 	drawString(str);
 
 	nFrames++;
@@ -1,95 +1,222 @@
 #include "config.h"
-
-#define G 9.81f
-#define DENSITY 1500.0f
-
+#include "philox.h"
+
+/*
+ * The simulation parameters GRAVITY, DENSITY, RMIN, RMAX, VMAX_INIT and
+ * BOUNDS_{MIN,MAX}_{X,Y}, the step time STEP_TIME and the change of
+ * velocity per step GRAVITY_STEP are defined by the build options (see
+ * paramDefines()), so the compiler can fold them like literals.
+ */
+
+/*
+ * Layout of the ball state used by the physics kernels. By default the
+ * positions, velocities and radii are separate arrays and the masses are
+ * computed from the radii whenever they are needed. With PACKED_STATE, the
+ * position and velocity of a ball are one float4 and its radius and inverse
+ * mass (computed once by packState) one float2, so a ball is read with two
+ * loads. positions is then only written, for the GPU stage, by the last
+ * kernel of each step.
+ *
+ * Kernels take the state as BALL_PARAMS and pass it on as BALL_ARGS.
+ */
+#ifdef PACKED_STATE
+#define BALL_PARAMS __global float4 *state, __global float2 *props, __global float2 *positions
+#define BALL_ARGS state, props, positions
+#define LOAD_BALL(i, p, v, r) do { float4 s_ = state[i]; (p) = s_.xy; (v) = s_.zw; (r) = props[i].x; } while (0)
+#define INV_MASS(i, r) (props[i].y)
+#define STORE_BALL(i, p, v) (state[i] = (float4) ((p), (v)))
+#define PUBLISH(i, p) (positions[i] = (p))
+#else
+#define BALL_PARAMS __global float2 *positions, __global float2 *velocities, __global float *radii
+#define BALL_ARGS positions, velocities, radii
+#define LOAD_BALL(i, p, v, r) ((p) = positions[i], (v) = velocities[i], (r) = radii[i])
+#define INV_MASS(i, r) (1.0f / mass(r))
+#define STORE_BALL(i, p, v) (positions[i] = (p), velocities[i] = (v))
+#define PUBLISH(i, p)
+#endif
+
+/*
+ * Format of the vertices written by genVertices. With SHORT_VERTICES, they
+ * are 16-bit normalised integers with the box mapped to [-1, 1].
+ */
+#ifdef SHORT_VERTICES
+typedef short2 Vertex;
+#define VERTEX(p) convert_short2_sat_rte(((p) - (float2) (BOUNDS_MIN_X, BOUNDS_MIN_Y)) \
+	/ (float2) (BOUNDS_MAX_X - BOUNDS_MIN_X, BOUNDS_MAX_Y - BOUNDS_MIN_Y) * 65534.0f - 32767.0f)
+#else
+typedef float2 Vertex;
+#define VERTEX(p) (p)
+#endif
+
+int gridCell(float2 p, float2 origin, float2 cellSize, int2 dims);
+uint floatKey(float f);
+void addCandidate(__global int *candidates, __global int *candidateCounts, __global uint *dropped, uint capacity, int i, int j);
+void bounce(float2 *p, float2 *v, float r);
+void contain(float2 *p, float2 *v, float r);
+void sweepWalls(float2 *p, float2 *v, float r);
+float wallTime(float p, float u, float lo, float hi);
+float impactTime(float2 dp, float2 dv, float rs);
+float8 combineDiag(float8 a, float8 b);
+float8 reduceDiag(__local float8 *scratch, float8 x);
+void collidePair(BALL_PARAMS, uint cell, uint k, uint nSlots);
+void collideWith(float2 *p1, float2 *v1, float r1, float2 p2, float2 v2, float r2);
 int isCollision(float2 p1, float r1, float2 p2, float r2);
 void setPosition(float2 *p1, float r1, float2 *p2, float r2);
 void setVelocity(float2 p1, float2 *v1, float r1, float2 p2, float2 *v2, float r2);
+void applyImpulse(float2 p1, float2 *v1, float im1, float2 p2, float2 *v2, float im2, float dist);
 float2 unitNorm(float2 v);
 float fdot(float2 a, float2 b);
 float len(float2 v);
 float mass(float radius);
 float volume(float radius);
 
+/*
+ * Draw the random radius, velocity and color of each ball from the Philox
+ * stream keyed by (seedLo, seedHi). Each ball's numbers depend only on its
+ * index, so the result is the same however the work-items are scheduled.
+ */
 __kernel void
-move(__global float2 *positions, __global float2 *velocities) {
+initBalls(
+	__global float *radii,
+	__global float2 *velocities,
+	__global float *colors,
+	uint seedLo,
+	uint seedHi
+) {
+	/* No fused multiply-adds, so that every device gets the same floats. */
+	#pragma OPENCL FP_CONTRACT OFF
 	size_t id;
-	float2 v;
+	PhiloxKey key;
+	Philox4 a, b;
 
 	id = get_global_id(0);
-	v = velocities[id];
-	v.y -= G / FPS;
-	positions[id] += v / FPS;
-	velocities[id] = v;
+	key.k[0] = seedLo;
+	key.k[1] = seedHi;
+	a = philox(id, PHILOX_STREAM_BALLS, 0, key);
+	b = philox(id, PHILOX_STREAM_BALLS, 1, key);
+	radii[id] = RMIN + philoxFloat(a.v[0]) * (RMAX - RMIN);
+	velocities[id] = (float2) (
+		-VMAX_INIT + philoxFloat(a.v[1]) * (2*VMAX_INIT),
+		-VMAX_INIT + philoxFloat(a.v[2]) * (2*VMAX_INIT));
+	colors[3*id] = philoxFloat(b.v[0]);
+	colors[3*id+1] = philoxFloat(b.v[1]);
+	colors[3*id+2] = philoxFloat(b.v[2]);
 }
 
+/* Build the packed state of each ball from the separate arrays. */
 __kernel void
-collideWalls(__global float2 *positions, __global float2 *velocities, __global float *radii) {
+packState(
+	__global float2 *positions,
+	__global float2 *velocities,
+	__global float *radii,
+	__global float4 *state,
+	__global float2 *props
+) {
 	size_t id;
-	float2 p, v, min, max;
 	float r;
 
 	id = get_global_id(0);
-
-	p = positions[id];
-	v = velocities[id];
 	r = radii[id];
+	state[id] = (float4) (positions[id], velocities[id]);
+	props[id] = (float2) (r, 1.0f / mass(r));
+}
 
-	/* Set bounds. */
-	min = -1.0f + r;
-	max = 1.0f - r;
+/*
+ * Copy src to dst. Run by each sub-device of a split CPU device over its own
+ * slice of the balls, so that it is the first to touch those pages of dst.
+ */
+__kernel void
+copyFloats(__global const float *src, __global float *dst) {
+	size_t i;
 
-	/* Check for collision with bounds. */
-	if (p.x <= min.x || p.x >= max.x) {
-		p.x = clamp(p.x, min.x, max.x);
-		v.x = -v.x;
-	}
-	if (p.y <= min.y || p.y >= max.y) {
-		p.y = clamp(p.y, min.y, max.y);
-		v.y = -v.y;
-	}
+	i = get_global_id(0);
+	dst[i] = src[i];
+}
 
-	/* Write back. */
-	positions[id] = p;
-	velocities[id] = v;
+/* Advance each ball by one step. */
+__kernel void
+move(BALL_PARAMS) {
+	size_t id;
+	float2 p, v;
+	float r;
+
+	id = get_global_id(0);
+	LOAD_BALL(id, p, v, r);
+	v.y -= GRAVITY_STEP;
+	p += v * STEP_TIME;
+	STORE_BALL(id, p, v);
 }
 
 __kernel void
-collideBalls(
-	__global size_t *ballIndices,
-	__global float2 *positions,
-	__global float2 *velocities,
-	__global float *radii
-) {
-	size_t id, i1, i2;
-	float2 p1, p2, v1, v2;
-	float r1, r2;
+collideWalls(BALL_PARAMS) {
+	size_t id;
+	float2 p, v;
+	float r;
 
 	id = get_global_id(0);
-	i1 = ballIndices[2*id];
-	i2 = ballIndices[2*id+1];
+	LOAD_BALL(id, p, v, r);
+	bounce(&p, &v, r);
+	STORE_BALL(id, p, v);
+	PUBLISH(id, p);
+}
 
-	p1 = positions[i1];
-	p2 = positions[i2];
-	v1 = velocities[i1];
-	v2 = velocities[i2];
-	r1 = radii[i1];
-	r2 = radii[i2];
+/*
+ * move followed by collideWalls, reading and writing each ball once, run
+ * after the collisions of a step. So the order of updates differs from the
+ * unfused step of move, collisions, walls: the walls now come after the
+ * move rather than after the collisions. A ball that a collision pushed
+ * past a wall is therefore put back inside first, as collideWalls would
+ * have, so the move starts from inside the box. With CCD, a ball that would
+ * cross a wall during the move is then bounced off it at the time it touches.
+ */
+__kernel void
+integrate(BALL_PARAMS) {
+	size_t id;
+	float2 p, v;
+	float r;
 
-	if (!isCollision(p1, r1, p2, r2))
-		return;
-	setPosition(&p1, r1, &p2, r2);
-	setVelocity(p1, &v1, r1, p2, &v2, r2);
+	id = get_global_id(0);
+	LOAD_BALL(id, p, v, r);
+	contain(&p, &v, r);
+#ifdef CCD
+	sweepWalls(&p, &v, r);
+#endif
+	v.y -= GRAVITY_STEP;
+	p += v * STEP_TIME;
+	bounce(&p, &v, r);
+	STORE_BALL(id, p, v);
+	PUBLISH(id, p);
+}
 
-	positions[i1] = p1;
-	positions[i2] = p2;
-	velocities[i1] = v1;
-	velocities[i2] = v2;
+/*
+ * Collide the pairs of balls in one cell of the round-robin partition (see
+ * partition.c).
+ */
+__kernel void
+collideBalls(BALL_PARAMS, uint cell, uint nSlots) {
+	collidePair(BALL_ARGS, cell, get_global_id(0), nSlots);
 }
 
+/*
+ * Collide every cell of the round-robin partition in one launch. Cells must
+ * run one after the other, and work-groups can't wait for each other, so this
+ * must be run as a single work-group: its work-items share out the pairs of
+ * each cell and meet at a barrier before the next. That puts it on one
+ * compute unit, so it is only used for small cells (see setCollisions()).
+ */
 __kernel void
-genVertices(__global float2 *positions, __global float *radii, __global float2 *vertices) {
+collideRounds(BALL_PARAMS, uint nSlots, uint first) {
+	uint cell, k;
+
+	for (cell = 0; cell < nSlots-1; cell++) {
+		for (k = first + get_local_id(0); k < nSlots/2; k += get_local_size(0))
+			collidePair(BALL_ARGS, cell, k, nSlots);
+		barrier(CLK_GLOBAL_MEM_FENCE);
+	}
+}
+
+__kernel void
+genVertices(__global float2 *positions, __global float *radii, __global Vertex *vertices) {
 	size_t ball, nsegs;
 	float2 center;
 	float r, theta;
@@ -101,10 +228,547 @@ genVertices(__global float2 *positions, __global float *radii, __global float2 *
 	nsegs = get_local_size(0)-2; /* Number of edge segments. */
 	theta = 2.0f * M_PI_F * get_local_id(0) / nsegs;
 
-	vertices[get_global_id(0)].x = center.x + r * cos(theta);
-	vertices[get_global_id(0)].y = center.y + r * sin(theta);
+	/* Vertex 0 is the centre of the fan. */
+	if (get_local_id(0) == 0)
+		vertices[get_global_id(0)] = VERTEX(center);
+	else
+		vertices[get_global_id(0)] = VERTEX(center + r * (float2) (cos(theta), sin(theta)));
+}
+
+/* Empty every cell of the grid. */
+__kernel void
+gridClear(__global int *cellCounts) {
+	cellCounts[get_global_id(0)] = 0;
+}
+
+/* Find the cell that each ball is in and count the balls in each cell. */
+__kernel void
+gridCount(
+	__global float2 *positions,
+	__global int *ballCells,
+	__global int *cellCounts,
+	float2 origin,
+	float2 cellSize,
+	int2 dims
+) {
+	size_t id;
+	int cell;
+
+	id = get_global_id(0);
+	cell = gridCell(positions[id], origin, cellSize, dims);
+	ballCells[id] = cell;
+	atomic_inc(&cellCounts[cell]);
+}
+
+/*
+ * Exclusive prefix sum of the cell counts. Run by a single work-item. The
+ * counts are reset so that gridScatter() can reuse them as fill cursors.
+ */
+__kernel void
+gridScan(__global int *cellCounts, __global int *cellStarts, int nCells) {
+	int c, sum;
+
+	sum = 0;
+	for (c = 0; c < nCells; c++) {
+		cellStarts[c] = sum;
+		sum += cellCounts[c];
+		cellCounts[c] = 0;
+	}
+	cellStarts[nCells] = sum;
+}
+
+/* Place each ball's index into its cell's slice of cellBalls. */
+__kernel void
+gridScatter(
+	__global int *ballCells,
+	__global int *cellStarts,
+	__global int *cellCounts,
+	__global int *cellBalls
+) {
+	size_t id;
+	int cell;
+
+	id = get_global_id(0);
+	cell = ballCells[id];
+	cellBalls[cellStarts[cell] + atomic_inc(&cellCounts[cell])] = id;
+}
+
+/*
+ * Collide each ball with the balls in its own and the neighbouring cells.
+ * Every ball only updates its own state, so the results are written to
+ * separate buffers to keep the neighbours' old state intact.
+ */
+__kernel void
+collideGrid(
+	__global float2 *positions,
+	__global float2 *velocities,
+	__global float *radii,
+	__global int *ballCells,
+	__global int *cellStarts,
+	__global int *cellBalls,
+	__global float2 *newPositions,
+	__global float2 *newVelocities,
+	int2 dims
+) {
+	int id, cx, cy, x, y, c, k, j;
+	float2 p1, v1;
+	float r1;
+
+	id = get_global_id(0);
+	p1 = positions[id];
+	v1 = velocities[id];
+	r1 = radii[id];
+	cx = ballCells[id] % dims.x;
+	cy = ballCells[id] / dims.x;
+
+	for (y = max(cy-1, 0); y <= min(cy+1, dims.y-1); y++) {
+		for (x = max(cx-1, 0); x <= min(cx+1, dims.x-1); x++) {
+			c = y*dims.x + x;
+			for (k = cellStarts[c]; k < cellStarts[c+1]; k++) {
+				j = cellBalls[k];
+				if (j != id)
+					collideWith(&p1, &v1, r1, positions[j], velocities[j], radii[j]);
+			}
+		}
+	}
+
+	newPositions[id] = p1;
+	newVelocities[id] = v1;
+}
+
+/*
+ * Set up the radix sort of the sweep: each ball's key is the left edge of its
+ * bounding box. Also empties the candidate lists.
+ */
+__kernel void
+sweepKeys(
+	__global float2 *positions,
+	__global float *radii,
+	__global uint *keys,
+	__global int *balls,
+	__global int *candidateCounts
+) {
+	size_t id;
+
+	id = get_global_id(0);
+	keys[id] = floatKey(positions[id].x - radii[id]);
+	balls[id] = id;
+	candidateCounts[id] = 0;
+}
+
+/*
+ * Count the digits of one block of keys. counts is laid out digit-major:
+ * counts[d*nBlocks + b] is the number of keys in block b with digit d.
+ */
+__kernel void
+radixCount(__global uint *keys, __global uint *counts, uint shift, uint blockSize, uint n) {
+	uint b, nBlocks, d, i, end;
+
+	b = get_global_id(0);
+	nBlocks = get_global_size(0);
+	for (d = 0; d < RADIX; d++)
+		counts[d*nBlocks + b] = 0;
+	end = min((b+1)*blockSize, n);
+	for (i = b*blockSize; i < end; i++)
+		counts[((keys[i] >> shift) & (RADIX-1))*nBlocks + b]++;
+}
+
+/* Exclusive prefix sum of the digit counts, in place. Run by a single work-item. */
+__kernel void
+radixScan(__global uint *counts, uint n) {
+	uint i, sum, c;
+
+	sum = 0;
+	for (i = 0; i < n; i++) {
+		c = counts[i];
+		counts[i] = sum;
+		sum += c;
+	}
+}
+
+/* Move one block of keys, in order, to the positions given by the scanned counts. */
+__kernel void
+radixScatter(
+	__global uint *keys,
+	__global int *balls,
+	__global uint *outKeys,
+	__global int *outBalls,
+	__global uint *offsets,
+	uint shift,
+	uint blockSize,
+	uint n
+) {
+	uint b, nBlocks, i, end, dst;
+	__global uint *off;
+
+	b = get_global_id(0);
+	nBlocks = get_global_size(0);
+	end = min((b+1)*blockSize, n);
+	for (i = b*blockSize; i < end; i++) {
+		off = &offsets[((keys[i] >> shift) & (RADIX-1))*nBlocks + b];
+		dst = (*off)++;
+		outKeys[dst] = keys[i];
+		outBalls[dst] = balls[i];
+	}
+}
+
+/*
+ * Sweep one ball against the balls after it in x order, until their left
+ * edges pass its right edge. Pairs whose bounding boxes overlap are added to
+ * the candidate lists of both balls.
+ */
+__kernel void
+sweepPairs(
+	__global float2 *positions,
+	__global float *radii,
+	__global int *sortedBalls,
+	__global int *candidates,
+	__global int *candidateCounts,
+	__global uint *dropped,
+	uint capacity,
+	uint n
+) {
+	uint s, t;
+	int i, j;
+	float2 p1, p2;
+	float r1, r2, right;
+
+	s = get_global_id(0);
+	i = sortedBalls[s];
+	p1 = positions[i];
+	r1 = radii[i];
+	right = p1.x + r1;
+
+	for (t = s+1; t < n; t++) {
+		j = sortedBalls[t];
+		p2 = positions[j];
+		r2 = radii[j];
+		if (p2.x - r2 > right)
+			break;
+		if (fabs(p2.y - p1.y) > r1 + r2)
+			continue;
+		addCandidate(candidates, candidateCounts, dropped, capacity, i, j);
+		addCandidate(candidates, candidateCounts, dropped, capacity, j, i);
+	}
+}
+
+/*
+ * Collide each ball with its candidates. Like collideGrid(), the results are
+ * written to separate buffers.
+ */
+__kernel void
+collideCandidates(
+	__global float2 *positions,
+	__global float2 *velocities,
+	__global float *radii,
+	__global int *candidates,
+	__global int *candidateCounts,
+	__global float2 *newPositions,
+	__global float2 *newVelocities,
+	uint capacity
+) {
+	int id, k, n, j;
+	float2 p1, v1;
+	float r1;
+
+	id = get_global_id(0);
+	p1 = positions[id];
+	v1 = velocities[id];
+	r1 = radii[id];
+
+	n = min(candidateCounts[id], (int) capacity);
+	for (k = 0; k < n; k++) {
+		j = candidates[id*capacity + k];
+		collideWith(&p1, &v1, r1, positions[j], velocities[j], radii[j]);
+	}
+
+	newPositions[id] = p1;
+	newVelocities[id] = v1;
+}
+
+/*
+ * Diagnostics of balls get_global_id(0) < n, reduced over the work-group
+ * (DIAG_GROUP work-items) into partials[get_group_id(0)]. A diagnostic is a
+ * float8 of kinetic energy, potential energy, momentum x and y, maximum
+ * speed, and maximum overlap of a pair of balls (see combineDiag()). The
+ * overlap is only measured if overlaps is set: it scans every other ball,
+ * so it costs as much as a step of the partition broad phase.
+ */
+__kernel void
+diagnose(BALL_PARAMS, uint n, __global float8 *partials, uint overlaps) {
+	__local float8 scratch[DIAG_GROUP];
+	size_t id;
+	uint j;
+	float2 p, v, q, w;
+	float r, s, m, overlap;
+	float8 d;
+
+	id = get_global_id(0);
+	d = (float8) (0.0f);
+	if (id < n) {
+		LOAD_BALL(id, p, v, r);
+		m = 1.0f / INV_MASS(id, r);
+		overlap = 0.0f;
+		for (j = 0; overlaps && j < n; j++) {
+			if (j == id)
+				continue;
+			LOAD_BALL(j, q, w, s);
+			overlap = max(overlap, r + s - len(q - p));
+		}
+		d.s0 = 0.5f * m * fdot(v, v);
+		d.s1 = m * GRAVITY * (p.y - BOUNDS_MIN_Y);
+		d.s23 = m * v;
+		d.s4 = len(v);
+		d.s5 = overlap;
+	}
+	d = reduceDiag(scratch, d);
+	if (get_local_id(0) == 0)
+		partials[get_group_id(0)] = d;
+}
+
+/*
+ * Reduce the nPartials diagnostics in partials into ring[slot]. Run as a
+ * single work-group of DIAG_GROUP work-items.
+ */
+__kernel void
+diagReduce(__global float8 *partials, uint nPartials, __global float8 *ring, uint slot) {
+	__local float8 scratch[DIAG_GROUP];
+	uint i;
+	float8 d;
+
+	d = (float8) (0.0f);
+	for (i = get_local_id(0); i < nPartials; i += DIAG_GROUP)
+		d = combineDiag(d, partials[i]);
+	d = reduceDiag(scratch, d);
+	if (get_local_id(0) == 0)
+		ring[slot] = d;
+}
+
+/* Keep a ball of radius r inside the bounds, reflecting it off the walls. */
+void
+bounce(float2 *p, float2 *v, float r) {
+	float2 min, max;
+
+	/* Set bounds. */
+	min = (float2) (BOUNDS_MIN_X, BOUNDS_MIN_Y) + r;
+	max = (float2) (BOUNDS_MAX_X, BOUNDS_MAX_Y) - r;
+
+	/* Check for collision with bounds. */
+	if (p->x <= min.x || p->x >= max.x) {
+		p->x = clamp(p->x, min.x, max.x);
+		v->x = -v->x;
+	}
+	if (p->y <= min.y || p->y >= max.y) {
+		p->y = clamp(p->y, min.y, max.y);
+		v->y = -v->y;
+	}
+}
+
+/*
+ * Put a ball of radius r that is beyond a wall back on it, turning it
+ * around if it is still heading out. Unlike bounce(), a ball resting on a
+ * wall keeps its velocity, so it can follow bounce() without undoing it.
+ */
+void
+contain(float2 *p, float2 *v, float r) {
+	float2 min, max;
+
+	min = (float2) (BOUNDS_MIN_X, BOUNDS_MIN_Y) + r;
+	max = (float2) (BOUNDS_MAX_X, BOUNDS_MAX_Y) - r;
+	if (p->x < min.x) {
+		p->x = min.x;
+		v->x = fabs(v->x);
+	} else if (p->x > max.x) {
+		p->x = max.x;
+		v->x = -fabs(v->x);
+	}
+	if (p->y < min.y) {
+		p->y = min.y;
+		v->y = fabs(v->y);
+	} else if (p->y > max.y) {
+		p->y = max.y;
+		v->y = -fabs(v->y);
+	}
+}
+
+/*
+ * Continuous collision detection (CCD). Contacts are found before the move
+ * of a step, from the velocities over the step, rather than after it from
+ * overlaps, so balls can't pass through each other or the walls between
+ * steps. A ball whose velocity changes at time t into the step has its
+ * start position shifted back by the change times t, so that the move puts
+ * it where it would be had it changed course at t.
+ */
+
+/* Bounce a ball of radius r off any wall it would reach during the move. */
+void
+sweepWalls(float2 *p, float2 *v, float r) {
+	float2 u;
+	float t;
+
+	/* Velocity over the step, as move() will apply it. */
+	u = (float2) (v->x, v->y - GRAVITY_STEP);
+	t = wallTime(p->x, u.x, BOUNDS_MIN_X + r, BOUNDS_MAX_X - r);
+	if (t >= 0) {
+		p->x += 2*u.x*t;
+		v->x -= 2*u.x;
+	}
+	t = wallTime(p->y, u.y, BOUNDS_MIN_Y + r, BOUNDS_MAX_Y - r);
+	if (t >= 0) {
+		p->y += 2*u.y*t;
+		v->y -= 2*u.y;
+	}
+}
+
+/*
+ * Return the time within the step at which a coordinate p in [lo, hi],
+ * moving at u, reaches lo or hi, or -1 if it doesn't.
+ */
+float
+wallTime(float p, float u, float lo, float hi) {
+	float t;
+
+	if (u < 0 && p > lo)
+		t = (lo - p) / u;
+	else if (u > 0 && p < hi)
+		t = (hi - p) / u;
+	else
+		return -1;
+	return (t <= STEP_TIME) ? t : -1;
+}
+
+/*
+ * Return the time within the step at which two balls, not overlapping, at
+ * relative position dp and moving at relative velocity dv, first touch, or
+ * -1 if they don't. rs is the sum of their radii.
+ */
+float
+impactTime(float2 dp, float2 dv, float rs) {
+	float a, b, c, disc, t;
+
+	a = fdot(dv, dv);
+	b = fdot(dp, dv);
+	c = fdot(dp, dp) - rs*rs;
+	if (b >= 0) /* Not approaching. */
+		return -1;
+	disc = b*b - a*c;
+	if (disc < 0)
+		return -1;
+	t = (-b - sqrt(disc)) / a;
+	return (t <= STEP_TIME) ? t : -1;
+}
+
+/* Combine two diagnostics: the sums add, the maxima take the larger. */
+float8
+combineDiag(float8 a, float8 b) {
+	return (float8) (a.s0123 + b.s0123, max(a.s45, b.s45), 0.0f, 0.0f);
+}
 
-	vertices[ball*get_local_size(0)] = center;
+/*
+ * Combine the x of every work-item of a DIAG_GROUP work-group by a tree
+ * reduction in scratch, and return the result in work-item 0.
+ */
+float8
+reduceDiag(__local float8 *scratch, float8 x) {
+	size_t id, k;
+
+	id = get_local_id(0);
+	scratch[id] = x;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (k = DIAG_GROUP/2; k > 0; k /= 2) {
+		if (id < k)
+			scratch[id] = combineDiag(scratch[id], scratch[id+k]);
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	return scratch[0];
+}
+
+/* Collide pair k of a cell. Slot nSlots-1 is fixed and the others rotate every cell. */
+void
+collidePair(BALL_PARAMS, uint cell, uint k, uint nSlots) {
+	uint n, i1, i2;
+	float2 p1, p2, v1, v2, u1, u2;
+	float r1, r2, t;
+
+	n = nSlots - 1;
+	if (k == 0) {
+		i1 = cell;
+		i2 = n;
+	} else {
+		i1 = (cell + k) % n;
+		i2 = (cell + n - k) % n;
+	}
+
+	LOAD_BALL(i1, p1, v1, r1);
+	LOAD_BALL(i2, p2, v2, r2);
+
+	if (isCollision(p1, r1, p2, r2)) {
+		setPosition(&p1, r1, &p2, r2);
+		applyImpulse(p1, &v1, INV_MASS(i1, r1), p2, &v2, INV_MASS(i2, r2), r1+r2);
+	} else {
+#ifdef CCD
+		/* Gravity moves both balls alike, so their relative motion is linear. */
+		if ((t = impactTime(p2 - p1, v2 - v1, r1+r2)) < 0)
+			return;
+		u1 = v1;
+		u2 = v2;
+		applyImpulse(p1 + v1*t, &v1, INV_MASS(i1, r1), p2 + v2*t, &v2, INV_MASS(i2, r2), r1+r2);
+		p1 -= (v1 - u1) * t;
+		p2 -= (v2 - u2) * t;
+#else
+		return;
+#endif
+	}
+
+	STORE_BALL(i1, p1, v1);
+	STORE_BALL(i2, p2, v2);
+}
+
+/* Return the index of the grid cell containing p. */
+int
+gridCell(float2 p, float2 origin, float2 cellSize, int2 dims) {
+	int x, y;
+
+	x = clamp((int) floor((p.x - origin.x) / cellSize.x), 0, dims.x-1);
+	y = clamp((int) floor((p.y - origin.y) / cellSize.y), 0, dims.y-1);
+	return y*dims.x + x;
+}
+
+/* Map a float to a uint with the same ordering. */
+uint
+floatKey(float f) {
+	uint u;
+
+	u = as_uint(f);
+	return (u & 0x80000000) ? ~u : u | 0x80000000;
+}
+
+/*
+ * Add j to i's candidate list of capacity entries. Candidates that don't fit
+ * are dropped and counted in *dropped.
+ */
+void
+addCandidate(__global int *candidates, __global int *candidateCounts, __global uint *dropped, uint capacity, int i, int j) {
+	int k;
+
+	k = atomic_inc(&candidateCounts[i]);
+	if (k < (int) capacity)
+		candidates[i*capacity + k] = j;
+	else
+		atomic_inc(dropped);
+}
+
+/*
+ * Collide ball 1 with ball 2 if they overlap, updating only ball 1. Gives
+ * ball 1 the same result as resolving the pair with setPosition() and
+ * setVelocity().
+ */
+void
+collideWith(float2 *p1, float2 *v1, float r1, float2 p2, float2 v2, float r2) {
+	if (!isCollision(*p1, r1, p2, r2))
+		return;
+	setPosition(p1, r1, &p2, r2);
+	setVelocity(*p1, v1, r1, p2, &v2, r2);
 }
 
 /* Return true if the two balls are colliding. */
@@ -132,18 +796,23 @@ setPosition(float2 *p1, float r1, float2 *p2, float r2) {
 /* Set the velocities of two balls after collision. */
 void
 setVelocity(float2 p1, float2 *v1, float r1, float2 p2, float2 *v2, float r2) {
-	float m1, m2;
-	float2 dp, dv, j;
+	applyImpulse(p1, v1, 1.0f/mass(r1), p2, v2, 1.0f/mass(r2), r1+r2);
+}
 
-	m1 = mass(r1);
-	m2 = mass(r2);
+/*
+ * Set the velocities of two balls with inverse masses im1 and im2 after
+ * collision, their centres being dist apart.
+ */
+void
+applyImpulse(float2 p1, float2 *v1, float im1, float2 p2, float2 *v2, float im2, float dist) {
+	float2 dp, dv, j;
 
 	dp = p2 - p1;
 	dv = *v2 - *v1;
-	j = dp * 2.0f * m1 * m2 * fdot(dv, dp) / ((r1+r2)*(r1+r2) * (m1+m2));
+	j = dp * 2.0f * fdot(dv, dp) / (dist*dist * (im1+im2));
 
-	*v1 = *v1 + j/m1;
-	*v2 = *v2 - j/m2;
+	*v1 = *v1 + j*im1;
+	*v2 = *v2 - j*im2;
 }
 
 float2
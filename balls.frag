@@ -1,9 +1,13 @@
-#version 130
+#version 140
 
 in vec3 new_color;
+in vec2 local;
 out vec4 out_color;
 
 void
 main(void) {
+	/* Signed distance from the edge of the circle; cut the corners off impostor quads. */
+	if (length(local) - 1.0 > 0.0)
+		discard;
 	out_color = vec4(new_color, 1.0);
 }
@@ -6,30 +6,191 @@ typedef struct {
 	Vector min, max;
 } Rect;
 
+/* Simulation parameters, from config files and options (see params.c). */
+typedef struct {
+	float gravity; /* Downward acceleration. */
+	float density; /* Mass per unit volume of a ball. */
+	int fps; /* Frames per second. */
+	float rMin, rMax; /* Range of the radii. */
+	float vMaxInit; /* Maximum initial speed along each axis. */
+	int circlePoints; /* Number of vertices per circle. */
+	Rect bounds; /* Walls of the box. */
+} Params;
+
+/* Algorithm used to find pairs of colliding balls. */
+typedef enum {
+	BROAD_PARTITION, /* Test every pair, one partition cell at a time. */
+	BROAD_GRID, /* Test balls in neighbouring cells of a uniform grid. */
+	BROAD_SWEEP, /* Sort along x and test balls with overlapping intervals. */
+} BroadPhase;
+
+/* How the balls are drawn. */
+typedef enum {
+	RENDER_FANS, /* One triangle fan per ball, generated by an OpenCL kernel. */
+	RENDER_INSTANCED, /* One instanced quad per ball, cut to a circle by the fragment shader. */
+} Render;
+
+/* Format of the fan vertices in the vertex buffer. */
+typedef enum {
+	VERTEX_FLOAT, /* 32-bit floats in box coordinates. */
+	VERTEX_SHORT, /* 16-bit normalised integers, the box mapped to [-1, 1]. */
+} VertexFormat;
+
+/* How the physics kernels store the state of the balls (see balls.cl). */
+typedef enum {
+	LAYOUT_SPLIT, /* Separate position, velocity and radius arrays. */
+	LAYOUT_PACKED, /* A float4 of position and velocity and a float2 of radius and inverse mass. */
+} Layout;
+
+/* What runs the physics. */
+typedef enum {
+	BACKEND_OPENCL, /* The kernels in balls.cl, on the OpenCL CPU device. */
+	BACKEND_NATIVE, /* The C code in native.c, on a pool of threads. */
+	BACKEND_STRIPS, /* The C code in strips.c, one process per vertical strip of the box. */
+} Backend;
+
+/* Vector instructions used by the native backend. */
+typedef enum {
+	SIMD_AUTO, /* The best the CPU supports. */
+	SIMD_AVX2,
+	SIMD_SSE,
+	SIMD_SCALAR,
+} Simd;
+
+/* File format of offscreen images. */
+typedef enum {
+	IMAGE_RAW, /* RGBA bytes, top row first, without a header. */
+	IMAGE_PPM, /* Binary PPM. */
+	IMAGE_PNG, /* 8-bit RGB PNG. */
+} ImageFormat;
+
+/* How the CPU device is split into sub-devices (see fission.c). */
+typedef enum {
+	FISSION_NONE, /* Run the physics on the whole device. */
+	FISSION_NUMA, /* One sub-device per NUMA node. */
+	FISSION_EQUAL, /* Sub-devices of opts.fissionUnits compute units each. */
+} Fission;
+
+/* How the CPU and GPU stages share OpenCL contexts. */
+typedef enum {
+	CONTEXT_SEPARATE, /* Different platforms; positions are copied through the host. */
+	CONTEXT_SHARED, /* One context with both devices; positions are copied on the device. */
+	CONTEXT_SINGLE, /* Both stages on one device and queue; nothing is copied. */
+} ContextMode;
+
+/* Options given on the command line. */
+typedef struct {
+	int nBalls;
+	BroadPhase broadPhase;
+	Render render;
+	VertexFormat vertexFormat;
+	int headless; /* Run the physics only, without a window. */
+	int steps; /* Number of steps to run when headless. */
+	int substeps; /* Physics steps per frame. */
+	int depth; /* Frames the CPU may run ahead of the frame being drawn. */
+	const char *profile; /* Chrome trace file, or NULL to disable profiling. */
+	const char *cpuDevice; /* Device of the CPU stage: "cpu", "gpu", "accelerator" or "P:D". */
+	const char *gpuDevice; /* Device of the GPU stage, in the same form. */
+	int singleDevice; /* Run the GPU stage on the CPU stage's device. */
+	int fused; /* Fuse move with collideWalls and launch the partition cells at once. */
+	Layout layout;
+	Backend backend;
+	int threads; /* Threads of the native backend; 0 for one per processor. */
+	int procs; /* Worker processes of the strips backend; 0 for one per processor. */
+	Simd simd;
+	int checkSimd; /* Steps over which to compare the native kernels with the scalar ones; 0 for none. */
+	const char *load; /* Snapshot to start from, or NULL for a random scene. */
+	const char *snapshot; /* Snapshot file to write, or NULL. */
+	int snapshotInterval; /* Physics steps between snapshots. */
+	unsigned long seed; /* Key of the random number generator. */
+	const char *cache; /* Directory of compiled program binaries, or NULL. */
+	Params params;
+	int diagInterval; /* Frames between diagnostic samples; 0 for none. */
+	int diagOverlap; /* Include the maximum overlap in the diagnostics, which takes O(n^2) time. */
+	int ccd; /* Continuous collision detection. */
+	const char *trajectory; /* Trajectory file to write, or NULL. */
+	int trajectoryVelocities; /* Write the velocities to the trajectory too. */
+	int trajectoryDelta; /* Delta-encode and compress the trajectory. */
+	const char *offscreen; /* printf pattern of the offscreen image files, or NULL to draw in the window. */
+	ImageFormat imageFormat; /* Of the offscreen images, from the pattern's extension. */
+	int width, height; /* Of the offscreen images. */
+	int frames; /* Number of frames to render offscreen. */
+	Fission fission;
+	int fissionUnits; /* Compute units per sub-device, if FISSION_EQUAL. */
+} Options;
+
 /*
  * A partition of the set of all possible collisions between pairs of balls.
  * Collisions within a cell of the partition can run concurrently.  Cells must
- * run sequentially.
+ * run sequentially.  The pairs of each cell are computed on the fly with
+ * partitionPair().
 */
 typedef struct {
-	struct cell {
-		size_t (*ballIndices)[2]; /* Array of pairs of ball indices. */
-		size_t size; /* Length of ballIndices. */
-	} *cells; /* Array of cells. */
-	size_t size; /* Length of cell array. */
+	size_t nSlots; /* Number of balls rounded up to an even number. */
+	size_t size; /* Number of cells. */
+	size_t first; /* Index of the first real pair in each cell. */
+	size_t cellSize; /* Number of real pairs in each cell. */
 } Partition;
 
+void defaultParams(Params *p);
+int setParam(Params *p, const char *name, const char *value);
+int loadParams(Params *p, const char *filename);
+int checkParams(const Params *p);
+void paramDefines(const Params *p, double dt, char *buf, size_t size);
+float ballMass(const Params *p, float r);
+
+int parseArgs(int argc, char *argv[], Options *opts);
+void usage(void);
+const char *optionValue(const char *arg, const char *name);
+int parseCount(const char *s, int *n);
+int parseSeed(const char *s, unsigned long *seed);
+
+double wallClock(void);
+
 int readFile(const char *filename, char **contents, size_t *size);
 
 void initCL(void);
 
+void initGrid(void);
+void collideGrid(void);
+void freeGrid(void);
+
+void loadSnapshot(const char *filename);
+void unloadSnapshot(void);
+void initSnapshots(void);
+void snapshotSteps(int n);
+void finishSnapshots(void);
+
+void initDiagnostics(void);
+void diagnoseFrame(int n);
+void freeDiagnostics(void);
+
+void initTrajectory(void);
+void trajectoryFrame(int n);
+void finishTrajectory(void);
+
+void initNative(void);
+void simulateNative(int n);
+void checkNative(int n);
+void freeNative(void);
+
+void initStrips(void);
+void simulateStrips(int n);
+void freeStrips(void);
+
+void initSweep(void);
+void collideSweep(void);
+void freeSweep(void);
+
 Partition partitionCollisions(size_t nBalls);
-void freePartition(Partition part);
+void partitionPair(Partition part, size_t cell, size_t k, size_t pair[2]);
 void printPartition(Partition part);
 
 int isCollision(Vector p1, float r1, Vector p2, float r2);
 Rect insetRect(Rect r, float n);
-Vector *noOverlapPositions(int n, Rect bounds, float radius);
+Vector *noOverlapPositions(int n, Rect bounds, const float *radii);
 
+void seedRand(unsigned long seed);
 float randFloat(float lo, float hi);
 Vector randPtInRect(Rect r);
+void randBalls(unsigned long seed, const Params *p, int n, float *radii, float *velocities, float *colors);
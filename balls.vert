@@ -1,12 +1,34 @@
-#version 130
+#version 140
 
-in  vec2 in_coords;
-in vec3 in_color;
+uniform bool instanced; /* Drawing one quad per ball instead of triangle fans. */
+uniform vec4 bounds; /* Walls of the box: min.x, min.y, max.x, max.y. */
+uniform int circlePoints; /* Vertices per fan, if not instanced. */
+uniform samplerBuffer colors; /* RGBA color of each ball. */
+
+in vec2 in_coords; /* Vertex position, or ball centre if instanced. */
+in float in_radius; /* Ball radius if instanced. */
 out vec3 new_color;
+out vec2 local; /* Position relative to the ball centre, in radii. */
+
+/* Map a point in the box to clip space. */
+vec4
+clip(vec2 p) {
+	return vec4((p - bounds.xy) / (bounds.zw - bounds.xy) * 2.0 - 1.0, 1.0, 1.0);
+}
 
 void
 main(void) {
-	new_color = in_color;
+	vec2 corner;
 
-	gl_Position = vec4(in_coords, 1.0, 1.0);
+	if (instanced) {
+		new_color = texelFetch(colors, gl_InstanceID).rgb;
+		/* Vertices 0-3 of a triangle strip covering the ball. */
+		corner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+		local = corner;
+		gl_Position = clip(in_coords + corner*in_radius);
+	} else {
+		new_color = texelFetch(colors, gl_VertexID / circlePoints).rgb;
+		local = vec2(0.0);
+		gl_Position = clip(in_coords);
+	}
 }
@@ -0,0 +1,626 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <CL/cl.h>
+
+#include "balls.h"
+#include "sysfatal.h"
+#include "cl.h"
+
+/*
+ * Microbenchmarks of the hot paths: the host's scene set-up, every kernel
+ * of balls.cl on the OpenCL CPU device, and the copy of a frame's positions
+ * through the host. Each runs on a seeded scene of each ball count in a
+ * box sized so that the balls always cover FILL of it. The results are
+ * written as CSV or JSON, and can be compared with the CSV of an earlier run
+ * (the baseline) to catch regressions.
+ *
+ * A run of a benchmark calls it, waiting for the device each time, until
+ * MIN_RUN_TIME has passed, and counts the mean time per call. The min,
+ * median and mean are taken over reps runs, after one run to warm up. The
+ * program is built again for each ball count, since the box is a build
+ * option of the kernels.
+ */
+
+#define FILL 0.25f /* Fraction of the box covered by the balls. */
+#define MIN_RUN_TIME 0.01 /* Seconds. */
+#define THRESHOLD_DEFAULT 10.0 /* Slowdown over the baseline, in percent, that is a regression. */
+#define FILE_DEFAULT "bench"
+
+enum { MAX_SIZES = 16 };
+enum { REPS_DEFAULT = 5 };
+enum { SEED_DEFAULT = 1 };
+enum { QUADRATIC_MAX = 10000 }; /* Most balls to run the O(n^2) benchmarks with. */
+enum { NAME_LEN = 32 };
+
+typedef enum {
+	FORMAT_CSV,
+	FORMAT_JSON,
+} Format;
+
+typedef struct {
+	const char *name;
+	void (*run)(void);
+	int quadratic; /* Takes O(n^2) time in the number of balls. */
+} Bench;
+
+typedef struct {
+	char name[NAME_LEN];
+	int n; /* Number of balls. */
+	int reps;
+	double min, median, mean; /* Time per call in us. */
+} Result;
+
+static int parseBenchArgs(int argc, char *argv[]);
+static void benchUsage(void);
+static void setup(int n);
+static void teardown(void);
+static void resetScene(void);
+static void measure(const Bench *b, Result *res);
+static int cmpDouble(const void *a, const void *b);
+static void writeResults(const char *filename);
+static int compare(const char *filename);
+static void benchPartition(void);
+static void benchPositions(void);
+static void benchCopyFrame(void);
+static void benchInitBalls(void);
+static void benchPackState(void);
+static void benchMove(void);
+static void benchCollideWalls(void);
+static void benchIntegrate(void);
+static void benchCollideBalls(void);
+static void benchCollideRounds(void);
+static void benchGenVertices(void);
+static void benchDiagnose(void);
+static void benchDiagnoseOverlap(void);
+static void benchDiagReduce(void);
+static void benchGrid(void);
+static void benchSweep(void);
+
+/* The program state that cl.c, grid.c and sweep.c read, as balls.c has it. */
+Options opts;
+int cpuCL, gpuCL;
+int nBalls;
+Rect bounds;
+double stepTime;
+float *radiiHostBuf;
+
+extern cl_context cpuContext;
+extern cl_command_queue cpuQueue, gpuQueue;
+extern cl_kernel moveKernel, collideWallsKernel, collideBallsKernel, genVerticesKernel;
+extern cl_kernel integrateKernel, collideRoundsKernel, packStateKernel, initBallsKernel;
+extern cl_kernel diagnoseKernel, diagReduceKernel;
+extern cl_mem positionsCpuBuf, velocitiesCpuBuf, radiiCpuBuf;
+
+/*
+ * The grid and sweep broad phases are timed as a whole, as they are run:
+ * their kernels only make sense in sequence.
+ */
+static const Bench benches[] = {
+	{ "partitionCollisions", benchPartition, 0 },
+	{ "noOverlapPositions", benchPositions, 0 },
+	{ "copyFrame", benchCopyFrame, 0 },
+	{ "initBalls", benchInitBalls, 0 },
+	{ "packState", benchPackState, 0 },
+	{ "move", benchMove, 0 },
+	{ "collideWalls", benchCollideWalls, 0 },
+	{ "integrate", benchIntegrate, 0 },
+	{ "collideBalls", benchCollideBalls, 0 },
+	{ "collideRounds", benchCollideRounds, 1 },
+	{ "genVertices", benchGenVertices, 0 },
+	{ "diagnose", benchDiagnose, 0 },
+	{ "diagnoseOverlap", benchDiagnoseOverlap, 1 },
+	{ "diagReduce", benchDiagReduce, 0 },
+	{ "collideGrid", benchGrid, 0 },
+	{ "collideSweep", benchSweep, 0 },
+};
+
+static int sizes[MAX_SIZES] = { 100, 1000, 10000, 100000, 1000000 };
+static int nSizes = 5;
+static int reps = REPS_DEFAULT;
+static Format format = FORMAT_CSV;
+static const char *output; /* Results file, or NULL for FILE_DEFAULT. */
+static const char *baseline; /* CSV results to compare with, or NULL. */
+static double threshold = THRESHOLD_DEFAULT;
+
+static Result *results;
+static int nResults;
+
+static float *frameHostBuf;
+static cl_mem colorsBuf, frameGpuBuf, stateBuf, propsBuf, vertexBuf, partialsBuf, ringBuf;
+static cl_mem startPositionsBuf, startVelocitiesBuf; /* The scene as setup() made it. */
+static Partition partition;
+static size_t roundsSize; /* Work-group size of collideRounds. */
+static size_t diagSize; /* Global size of diagnose: nBalls rounded up to DIAG_GROUP. */
+
+int
+main(int argc, char *argv[]) {
+	char filename[256];
+	int i, j, regressions;
+	Result *res;
+
+	if (parseBenchArgs(argc, argv) != 0) {
+		benchUsage();
+		return 1;
+	}
+	if ((results = malloc(nSizes * (sizeof(benches)/sizeof(benches[0])) * sizeof(Result))) == NULL)
+		sysfatal("Failed to allocate results.\n");
+
+	for (i = 0; i < nSizes; i++) {
+		setup(sizes[i]);
+		for (j = 0; j < (int) (sizeof(benches)/sizeof(benches[0])); j++) {
+			if (benches[j].quadratic && sizes[i] > QUADRATIC_MAX)
+				continue;
+			res = &results[nResults++];
+			measure(&benches[j], res);
+			printf("%-20s %8d balls %14.3f us\n", res->name, res->n, res->median);
+			fflush(stdout);
+		}
+		teardown();
+	}
+
+	if (output == NULL) {
+		snprintf(filename, sizeof(filename), "%s.%s", FILE_DEFAULT, (format == FORMAT_JSON) ? "json" : "csv");
+		output = filename;
+	}
+	writeResults(output);
+	printf("Wrote %d results to %s\n", nResults, output);
+
+	regressions = 0;
+	if (baseline != NULL)
+		regressions = compare(baseline);
+	free(results);
+	return regressions > 0;
+}
+
+/* Parse the command line. Returns non-zero on error. */
+static int
+parseBenchArgs(int argc, char *argv[]) {
+	const char *val;
+	char *end;
+	int i;
+
+	opts.headless = 1;
+	opts.singleDevice = 1; /* genVertices runs on the CPU device too. */
+	opts.cpuDevice = "cpu";
+	opts.cache = CACHE_DIR_DEFAULT;
+	opts.seed = SEED_DEFAULT;
+	defaultParams(&opts.params);
+	cpuCL = gpuCL = 1;
+
+	for (i = 1; i < argc; i++) {
+		if ((val = optionValue(argv[i], "sizes")) != NULL) {
+			for (nSizes = 0; *val != '\0'; nSizes++) {
+				if (nSizes == MAX_SIZES)
+					return 1;
+				sizes[nSizes] = strtol(val, &end, 10);
+				if (end == val || sizes[nSizes] < 1 || (*end != ',' && *end != '\0'))
+					return 1;
+				val = (*end == ',') ? end+1 : end;
+			}
+			if (nSizes == 0)
+				return 1;
+		} else if ((val = optionValue(argv[i], "reps")) != NULL) {
+			if (parseCount(val, &reps) != 0)
+				return 1;
+		} else if ((val = optionValue(argv[i], "format")) != NULL) {
+			if (strcmp(val, "csv") == 0)
+				format = FORMAT_CSV;
+			else if (strcmp(val, "json") == 0)
+				format = FORMAT_JSON;
+			else
+				return 1;
+		} else if ((val = optionValue(argv[i], "output")) != NULL) {
+			if (*val == '\0')
+				return 1;
+			output = val;
+		} else if ((val = optionValue(argv[i], "baseline")) != NULL) {
+			if (*val == '\0')
+				return 1;
+			baseline = val;
+		} else if ((val = optionValue(argv[i], "threshold")) != NULL) {
+			threshold = strtod(val, &end);
+			if (end == val || *end != '\0' || threshold < 0)
+				return 1;
+		} else if ((val = optionValue(argv[i], "seed")) != NULL) {
+			if (parseSeed(val, &opts.seed) != 0)
+				return 1;
+		} else if ((val = optionValue(argv[i], "cpu-device")) != NULL) {
+			if (*val == '\0')
+				return 1;
+			opts.cpuDevice = val;
+		} else if ((val = optionValue(argv[i], "cache")) != NULL) {
+			if (*val == '\0')
+				return 1;
+			opts.cache = val;
+		} else if ((val = optionValue(argv[i], "no-cache")) != NULL) {
+			if (*val != '\0')
+				return 1;
+			opts.cache = NULL;
+		} else {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void
+benchUsage(void) {
+	printf("usage: bench [options]\n");
+	printf("  --sizes=N,N,...      ball counts (default 100,1000,10000,100000,1000000)\n");
+	printf("  --reps=N             timed runs of each benchmark (default %d)\n", REPS_DEFAULT);
+	printf("  --format=csv|json    format of the results (default csv)\n");
+	printf("  --output=FILE        results file (default %s.csv or %s.json)\n", FILE_DEFAULT, FILE_DEFAULT);
+	printf("  --baseline=FILE      compare the median times with the CSV results of an earlier run\n");
+	printf("  --threshold=PCT      slowdown that counts as a regression (default %g)\n", THRESHOLD_DEFAULT);
+	printf("  --seed=N             seed of the scenes (default %d)\n", SEED_DEFAULT);
+	printf("  --cpu-device=DEV     device to run the kernels on (default cpu)\n");
+	printf("  --cache=DIR          cache compiled programs in DIR (default %s)\n", CACHE_DIR_DEFAULT);
+	printf("  --no-cache           always build the programs from source\n");
+	printf("Exits with status 1 if any benchmark regressed.\n");
+}
+
+/* Build the programs and the scene for n balls and set the kernel arguments. */
+static void
+setup(int n) {
+	Vector *positions;
+	float rMin, rMax, side;
+	cl_uint seedLo, seedHi, nSlots, first, cell, nPartials, slot, un;
+	int err;
+
+	nBalls = n;
+	rMin = opts.params.rMin;
+	rMax = opts.params.rMax;
+	side = sqrtf(n * PI * (rMin*rMin + rMin*rMax + rMax*rMax) / 3 / FILL);
+	if (side < 2)
+		side = 2;
+	opts.params.bounds.min.x = opts.params.bounds.min.y = -side/2;
+	opts.params.bounds.max.x = opts.params.bounds.max.y = side/2;
+	bounds = opts.params.bounds;
+	stepTime = 1.0 / opts.params.fps;
+	seedRand(opts.seed);
+
+	initCL();
+
+	radiiCpuBuf = cpuBuffer(n*sizeof(float));
+	velocitiesCpuBuf = cpuBuffer(n*2*sizeof(float));
+	colorsBuf = cpuBuffer(n*3*sizeof(float));
+	seedLo = opts.seed & 0xFFFFFFFF;
+	seedHi = (opts.seed >> 16) >> 16;
+	err = clSetKernelArg(initBallsKernel, 0, sizeof(radiiCpuBuf), &radiiCpuBuf);
+	err |= clSetKernelArg(initBallsKernel, 1, sizeof(velocitiesCpuBuf), &velocitiesCpuBuf);
+	err |= clSetKernelArg(initBallsKernel, 2, sizeof(colorsBuf), &colorsBuf);
+	err |= clSetKernelArg(initBallsKernel, 3, sizeof(seedLo), &seedLo);
+	err |= clSetKernelArg(initBallsKernel, 4, sizeof(seedHi), &seedHi);
+	if (err < 0)
+		sysfatal("Failed to set arguments of initBalls kernel.\n");
+	benchInitBalls();
+
+	if ((radiiHostBuf = malloc(n*sizeof(float))) == NULL || (frameHostBuf = malloc(n*2*sizeof(float))) == NULL)
+		sysfatal("Failed to allocate host buffers.\n");
+	if (clEnqueueReadBuffer(cpuQueue, radiiCpuBuf, CL_TRUE, 0, n*sizeof(float), radiiHostBuf, 0, NULL, NULL) < 0)
+		sysfatal("Failed to read radii.\n");
+	positions = noOverlapPositions(n, bounds, radiiHostBuf);
+	positionsCpuBuf = clCreateBuffer(cpuContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, n*2*sizeof(float), positions, &err);
+	if (err < 0)
+		sysfatal("Failed to allocate CPU position buffer.\n");
+	free(positions);
+	startPositionsBuf = cpuBuffer(n*2*sizeof(float));
+	startVelocitiesBuf = cpuBuffer(n*2*sizeof(float));
+	err = clEnqueueCopyBuffer(cpuQueue, positionsCpuBuf, startPositionsBuf, 0, 0, n*2*sizeof(float), 0, NULL, NULL);
+	err |= clEnqueueCopyBuffer(cpuQueue, velocitiesCpuBuf, startVelocitiesBuf, 0, 0, n*2*sizeof(float), 0, NULL, NULL);
+	if (err < 0)
+		sysfatal("Failed to copy the starting scene.\n");
+
+	frameGpuBuf = cpuBuffer(n*2*sizeof(float));
+	stateBuf = cpuBuffer(n*4*sizeof(float));
+	propsBuf = cpuBuffer(n*2*sizeof(float));
+	vertexBuf = cpuBuffer((size_t) n*opts.params.circlePoints*2*sizeof(float));
+	nPartials = (n + DIAG_GROUP-1) / DIAG_GROUP;
+	diagSize = (size_t) nPartials * DIAG_GROUP;
+	partialsBuf = cpuBuffer(nPartials*8*sizeof(float));
+	ringBuf = cpuBuffer(DIAG_RING*8*sizeof(float));
+
+	partition = partitionCollisions(n);
+	nSlots = partition.nSlots;
+	first = partition.first;
+	cell = 0;
+	slot = 0;
+	un = n;
+	roundsSize = cpuWorkGroupSize(collideRoundsKernel);
+	if (partition.cellSize < roundsSize)
+		roundsSize = partition.cellSize;
+
+	err = setBallArgs(moveKernel);
+	err |= setBallArgs(collideWallsKernel);
+	err |= setBallArgs(integrateKernel);
+	err |= setBallArgs(collideBallsKernel);
+	err |= clSetKernelArg(collideBallsKernel, 3, sizeof(cell), &cell);
+	err |= clSetKernelArg(collideBallsKernel, 4, sizeof(nSlots), &nSlots);
+	err |= setBallArgs(collideRoundsKernel);
+	err |= clSetKernelArg(collideRoundsKernel, 3, sizeof(nSlots), &nSlots);
+	err |= clSetKernelArg(collideRoundsKernel, 4, sizeof(first), &first);
+	err |= clSetKernelArg(packStateKernel, 0, sizeof(positionsCpuBuf), &positionsCpuBuf);
+	err |= clSetKernelArg(packStateKernel, 1, sizeof(velocitiesCpuBuf), &velocitiesCpuBuf);
+	err |= clSetKernelArg(packStateKernel, 2, sizeof(radiiCpuBuf), &radiiCpuBuf);
+	err |= clSetKernelArg(packStateKernel, 3, sizeof(stateBuf), &stateBuf);
+	err |= clSetKernelArg(packStateKernel, 4, sizeof(propsBuf), &propsBuf);
+	err |= clSetKernelArg(genVerticesKernel, 0, sizeof(positionsCpuBuf), &positionsCpuBuf);
+	err |= clSetKernelArg(genVerticesKernel, 1, sizeof(radiiCpuBuf), &radiiCpuBuf);
+	err |= clSetKernelArg(genVerticesKernel, 2, sizeof(vertexBuf), &vertexBuf);
+	err |= setBallArgs(diagnoseKernel);
+	err |= clSetKernelArg(diagnoseKernel, 3, sizeof(un), &un);
+	err |= clSetKernelArg(diagnoseKernel, 4, sizeof(partialsBuf), &partialsBuf);
+	err |= clSetKernelArg(diagReduceKernel, 0, sizeof(partialsBuf), &partialsBuf);
+	err |= clSetKernelArg(diagReduceKernel, 1, sizeof(nPartials), &nPartials);
+	err |= clSetKernelArg(diagReduceKernel, 2, sizeof(ringBuf), &ringBuf);
+	err |= clSetKernelArg(diagReduceKernel, 3, sizeof(slot), &slot);
+	if (err < 0)
+		sysfatal("Failed to set kernel arguments.\n");
+
+	initGrid();
+	initSweep();
+	clFinish(cpuQueue);
+}
+
+/* Free everything that setup() made. */
+static void
+teardown(void) {
+	freeGrid();
+	freeSweep();
+	free(radiiHostBuf);
+	free(frameHostBuf);
+
+	clReleaseMemObject(startPositionsBuf);
+	clReleaseMemObject(startVelocitiesBuf);
+	clReleaseMemObject(colorsBuf);
+	clReleaseMemObject(frameGpuBuf);
+	clReleaseMemObject(stateBuf);
+	clReleaseMemObject(propsBuf);
+	clReleaseMemObject(vertexBuf);
+	clReleaseMemObject(partialsBuf);
+	clReleaseMemObject(ringBuf);
+
+	freeCL();
+}
+
+/* Time benchmark b with the current scene. */
+static void
+measure(const Bench *b, Result *res) {
+	double *times, start, elapsed, sum;
+	long calls;
+	int i;
+
+	if ((times = malloc(reps*sizeof(double))) == NULL)
+		sysfatal("Failed to allocate times.\n");
+	resetScene();
+	b->run();
+	clFinish(cpuQueue);
+	sum = 0;
+	for (i = 0; i < reps; i++) {
+		resetScene();
+		calls = 0;
+		start = wallClock();
+		do {
+			b->run();
+			clFinish(cpuQueue);
+			calls++;
+		} while ((elapsed = wallClock() - start) < MIN_RUN_TIME);
+		times[i] = elapsed / calls * 1e6;
+		sum += times[i];
+	}
+	qsort(times, reps, sizeof(double), cmpDouble);
+
+	snprintf(res->name, sizeof(res->name), "%s", b->name);
+	res->n = nBalls;
+	res->reps = reps;
+	res->min = times[0];
+	res->median = (reps % 2) ? times[reps/2] : (times[reps/2-1] + times[reps/2]) / 2;
+	res->mean = sum / reps;
+	free(times);
+}
+
+/*
+ * Put the balls back where setup() left them, so that every run starts from
+ * the same scene however far the earlier ones moved it.
+ */
+static void
+resetScene(void) {
+	int err;
+
+	err = clEnqueueCopyBuffer(cpuQueue, startPositionsBuf, positionsCpuBuf, 0, 0, nBalls*2*sizeof(float), 0, NULL, NULL);
+	err |= clEnqueueCopyBuffer(cpuQueue, startVelocitiesBuf, velocitiesCpuBuf, 0, 0, nBalls*2*sizeof(float), 0, NULL, NULL);
+	if (err < 0)
+		sysfatal("Failed to reset the scene.\n");
+	clFinish(cpuQueue);
+}
+
+static int
+cmpDouble(const void *a, const void *b) {
+	double x, y;
+
+	x = *(const double *) a;
+	y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static void
+writeResults(const char *filename) {
+	FILE *f;
+	Result *r;
+	int i;
+
+	if ((f = fopen(filename, "w")) == NULL)
+		sysfatal("Failed to open results file '%s'\n", filename);
+	if (format == FORMAT_JSON)
+		fprintf(f, "[\n");
+	else
+		fprintf(f, "benchmark,balls,reps,min_us,median_us,mean_us\n");
+	for (i = 0; i < nResults; i++) {
+		r = &results[i];
+		if (format == FORMAT_JSON)
+			fprintf(f, "{\"benchmark\":\"%s\",\"balls\":%d,\"reps\":%d,\"min_us\":%.3f,\"median_us\":%.3f,\"mean_us\":%.3f}%s\n",
+				r->name, r->n, r->reps, r->min, r->median, r->mean, (i+1 < nResults) ? "," : "");
+		else
+			fprintf(f, "%s,%d,%d,%.3f,%.3f,%.3f\n", r->name, r->n, r->reps, r->min, r->median, r->mean);
+	}
+	if (format == FORMAT_JSON)
+		fprintf(f, "]\n");
+	if (fclose(f) != 0)
+		sysfatal("Failed to write results file '%s'\n", filename);
+}
+
+/*
+ * Print the change of the median time of each benchmark since the CSV
+ * results in filename. Returns the number of regressions.
+ */
+static int
+compare(const char *filename) {
+	FILE *f;
+	char line[256], name[NAME_LEN];
+	int n, r, i, regressions;
+	double min, median, mean, change;
+
+	if ((f = fopen(filename, "r")) == NULL)
+		sysfatal("Failed to open baseline '%s'\n", filename);
+	printf("%-20s %8s %14s %14s %9s\n", "benchmark", "balls", "baseline (us)", "now (us)", "change");
+	regressions = 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "%31[^,],%d,%d,%lf,%lf,%lf", name, &n, &r, &min, &median, &mean) != 6)
+			continue; /* The header. */
+		for (i = 0; i < nResults; i++)
+			if (results[i].n == n && strcmp(results[i].name, name) == 0)
+				break;
+		if (i == nResults || median <= 0)
+			continue;
+		change = (results[i].median - median) / median * 100;
+		printf("%-20s %8d %14.3f %14.3f %+8.1f%%%s\n", name, n, median, results[i].median, change,
+			(change > threshold) ? "  REGRESSION" : "");
+		if (change > threshold)
+			regressions++;
+	}
+	fclose(f);
+	printf("%d regressions over %g%%\n", regressions, threshold);
+	return regressions;
+}
+
+static void
+benchPartition(void) {
+	partition = partitionCollisions(nBalls);
+}
+
+static void
+benchPositions(void) {
+	free(noOverlapPositions(nBalls, bounds, radiiHostBuf));
+}
+
+/* The frame copy of pipeline.c when the stages are in separate contexts. */
+static void
+benchCopyFrame(void) {
+	int err;
+
+	err = clEnqueueReadBuffer(cpuQueue, positionsCpuBuf, CL_TRUE, 0, nBalls*2*sizeof(float), frameHostBuf, 0, NULL, NULL);
+	err |= clEnqueueWriteBuffer(gpuQueue, frameGpuBuf, CL_FALSE, 0, nBalls*2*sizeof(float), frameHostBuf, 0, NULL, NULL);
+	if (err < 0)
+		sysfatal("Failed to copy frame.\n");
+}
+
+static void
+benchInitBalls(void) {
+	runCpuKernel(initBallsKernel, nBalls, "initBalls");
+}
+
+static void
+benchPackState(void) {
+	runCpuKernel(packStateKernel, nBalls, "packState");
+}
+
+static void
+benchMove(void) {
+	runCpuKernel(moveKernel, nBalls, "move");
+}
+
+static void
+benchCollideWalls(void) {
+	runCpuKernel(collideWallsKernel, nBalls, "collideWalls");
+}
+
+static void
+benchIntegrate(void) {
+	runCpuKernel(integrateKernel, nBalls, "integrate");
+}
+
+/* One cell of the partition, as collideBalls() in balls.c launches it. */
+static void
+benchCollideBalls(void) {
+	if (partition.cellSize == 0)
+		return;
+	if (clEnqueueNDRangeKernel(cpuQueue, collideBallsKernel, 1, &partition.first, &partition.cellSize, NULL, 0, NULL, NULL) < 0)
+		sysfatal("Couldn't enqueue kernel.\n");
+}
+
+static void
+benchCollideRounds(void) {
+	if (partition.cellSize == 0)
+		return;
+	if (clEnqueueNDRangeKernel(cpuQueue, collideRoundsKernel, 1, NULL, &roundsSize, &roundsSize, 0, NULL, NULL) < 0)
+		sysfatal("Couldn't enqueue kernel.\n");
+}
+
+static void
+benchGenVertices(void) {
+	size_t localSize, globalSize;
+
+	localSize = opts.params.circlePoints;
+	globalSize = nBalls * localSize;
+	if (clEnqueueNDRangeKernel(gpuQueue, genVerticesKernel, 1, NULL, &globalSize, &localSize, 0, NULL, NULL) < 0)
+		sysfatal("Couldn't enqueue kernel.\n");
+}
+
+static void
+benchDiagnoseOverlap(void) {
+	size_t localSize;
+	cl_uint overlaps;
+
+	overlaps = 1;
+	localSize = DIAG_GROUP;
+	if (clSetKernelArg(diagnoseKernel, 5, sizeof(overlaps), &overlaps) < 0)
+		sysfatal("Failed to set argument of diagnose kernel.\n");
+	if (clEnqueueNDRangeKernel(cpuQueue, diagnoseKernel, 1, NULL, &diagSize, &localSize, 0, NULL, NULL) < 0)
+		sysfatal("Couldn't enqueue kernel.\n");
+}
+
+static void
+benchDiagnose(void) {
+	size_t localSize;
+	cl_uint overlaps;
+
+	overlaps = 0;
+	localSize = DIAG_GROUP;
+	if (clSetKernelArg(diagnoseKernel, 5, sizeof(overlaps), &overlaps) < 0)
+		sysfatal("Failed to set argument of diagnose kernel.\n");
+	if (clEnqueueNDRangeKernel(cpuQueue, diagnoseKernel, 1, NULL, &diagSize, &localSize, 0, NULL, NULL) < 0)
+		sysfatal("Couldn't enqueue kernel.\n");
+}
+
+static void
+benchDiagReduce(void) {
+	size_t localSize;
+
+	localSize = DIAG_GROUP;
+	if (clEnqueueNDRangeKernel(cpuQueue, diagReduceKernel, 1, NULL, &localSize, &localSize, 0, NULL, NULL) < 0)
+		sysfatal("Couldn't enqueue kernel.\n");
+}
+
+static void
+benchGrid(void) {
+	collideGrid();
+}
+
+static void
+benchSweep(void) {
+	collideSweep();
+}
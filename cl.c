@@ -2,6 +2,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <CL/cl_gl.h>
 #ifndef WINDOWS
 #include <GL/glx.h>
@@ -9,6 +10,8 @@
 
 #include "balls.h"
 #include "sysfatal.h"
+#include "profile.h"
+#include "cl.h"
 
 #ifdef WINDOWS
 #define contextProperties(platform) { \
@@ -26,32 +29,86 @@
 }
 #endif
 
+/* Properties for a context that does not share objects with OpenGL. */
+#define headlessContextProperties(platform) { \
+	CL_CONTEXT_PLATFORM, (cl_context_properties) (platform), \
+	0 \
+}
+
 #define PROG_FILE "balls.cl"
 #define MOVE_KERNEL_FUNC "move"
 #define COLLIDE_WALLS_KERNEL_FUNC "collideWalls"
 #define COLLIDE_BALLS_KERNEL_FUNC "collideBalls"
+#define INTEGRATE_KERNEL_FUNC "integrate"
+#define PACK_STATE_KERNEL_FUNC "packState"
+#define COPY_FLOATS_KERNEL_FUNC "copyFloats"
+#define INIT_BALLS_KERNEL_FUNC "initBalls"
+#define DIAGNOSE_KERNEL_FUNC "diagnose"
+#define DIAG_REDUCE_KERNEL_FUNC "diagReduce"
+#define COLLIDE_ROUNDS_KERNEL_FUNC "collideRounds"
 #define GEN_VERTICES_KERNEL_FUNC "genVertices"
+#define GRID_CLEAR_KERNEL_FUNC "gridClear"
+#define GRID_COUNT_KERNEL_FUNC "gridCount"
+#define GRID_SCAN_KERNEL_FUNC "gridScan"
+#define GRID_SCATTER_KERNEL_FUNC "gridScatter"
+#define COLLIDE_GRID_KERNEL_FUNC "collideGrid"
+#define SWEEP_KEYS_KERNEL_FUNC "sweepKeys"
+#define RADIX_COUNT_KERNEL_FUNC "radixCount"
+#define RADIX_SCAN_KERNEL_FUNC "radixScan"
+#define RADIX_SCATTER_KERNEL_FUNC "radixScatter"
+#define SWEEP_PAIRS_KERNEL_FUNC "sweepPairs"
+#define COLLIDE_CANDIDATES_KERNEL_FUNC "collideCandidates"
 
 static int getDevicePlatform(cl_platform_id platforms[], int nPlatforms, cl_device_type devType, cl_device_id *device);
+static int findDevice(const char *spec, cl_platform_id platforms[], int nPlatforms, cl_platform_id *platform, cl_device_id *device);
 static void printPlatform(cl_platform_id platform);
 static void printDevice(cl_device_id device);
-static void printBuildLog(cl_program prog, cl_device_id device);
 static cl_kernel createKernel(cl_program prog, const char *kernelFunc);
+static cl_device_id *splitDevice(cl_device_id device, cl_uint *n);
+
+extern Options opts;
+extern double stepTime;
+extern int cpuCL, gpuCL;
+
+/* The OpenCL objects of the stages, made by initCL() and freed by freeCL(). */
+ContextMode contextMode;
+cl_context cpuContext, gpuContext;
+cl_command_queue cpuQueue, gpuQueue;
+cl_kernel moveKernel, collideWallsKernel, collideBallsKernel, genVerticesKernel;
+cl_kernel integrateKernel, collideRoundsKernel, packStateKernel, initBallsKernel;
+cl_kernel diagnoseKernel, diagReduceKernel, copyFloatsKernel;
+cl_kernel gridClearKernel, gridCountKernel, gridScanKernel, gridScatterKernel, collideGridKernel;
+cl_kernel sweepKeysKernel, radixCountKernel, radixScanKernel, radixScatterKernel;
+cl_kernel sweepPairsKernel, collideCandidatesKernel;
+cl_mem positionsCpuBuf, velocitiesCpuBuf, radiiCpuBuf;
+cl_mem stateCpuBuf, propsCpuBuf; /* Packed ball state, if opts.layout is LAYOUT_PACKED. */
 
-extern cl_context cpuContext, gpuContext;
-extern cl_command_queue cpuQueue, gpuQueue;
-extern cl_kernel moveKernel, collideWallsKernel, collideBallsKernel, genVerticesKernel;
-
+/*
+ * Set up the CPU (physics) and GPU (vertex) stages on the devices chosen by
+ * opts. If both devices are on the same platform, they share one context so
+ * that positions can be copied between them on the device, and if they are
+ * the same device they also share a queue and nothing is copied at all.
+ * Either stage is left out unless cpuCL or gpuCL is set.
+ */
 void
 initCL(void) {
 	cl_uint nPlatforms;
 	cl_platform_id *platforms, cpuPlatform, gpuPlatform;
-	size_t i;
-	cl_device_id cpuDevice, gpuDevice;
+	cl_device_id *devices, *cpuDevices, cpuDevice, gpuDevice;
+	cl_uint i, nCpuDevices;
+	int nDevices;
 	cl_int err;
 	cl_program cpuProg, gpuProg;
 	char *progBuf;
 	size_t progSize;
+	char defines[512], options[600];
+	cl_command_queue_properties queueProperties;
+	static const char *modeNames[] = { "separate", "shared", "single device" };
+
+	cpuPlatform = gpuPlatform = NULL;
+	cpuDevice = gpuDevice = NULL;
+	cpuProg = gpuProg = NULL;
+	cpuContext = NULL;
 
 	/* Get platforms. */
 	if (clGetPlatformIDs(0, NULL, &nPlatforms) < 0)
@@ -61,83 +118,224 @@ initCL(void) {
 	if (clGetPlatformIDs(nPlatforms, platforms, NULL) < 0)
 		sysfatal("Can't get OpenCL platforms.\n");
 
-	/* Get CPU device. */
-	i = getDevicePlatform(platforms, nPlatforms, CL_DEVICE_TYPE_CPU, &cpuDevice);
-	if (i < 0)
-		sysfatal("No CPU device available.\n");
-	cpuPlatform = platforms[i];
-	printf("CPU platform: ");
-	printPlatform(cpuPlatform);
-	printf("CPU device: ");
-	printDevice(cpuDevice);
-
-	/* Get GPU device. */
-	i = getDevicePlatform(platforms, nPlatforms, CL_DEVICE_TYPE_GPU, &gpuDevice);
-	if (i < 0)
-		sysfatal("No GPU device available.\n");
-	gpuPlatform = platforms[i];
-	printf("GPU platform: ");
-	printPlatform(gpuPlatform);
-	printf("GPU device: ");
-	printDevice(gpuDevice);
-
-	/* Configure properties for OpenGL interoperability. */
-	cl_context_properties cpuProperties[] = contextProperties(cpuPlatform);
-	cl_context_properties gpuProperties[] = contextProperties(gpuPlatform);
+	/* Get CPU stage device. */
+	if (cpuCL) {
+		if (findDevice(opts.cpuDevice, platforms, nPlatforms, &cpuPlatform, &cpuDevice) != 0)
+			sysfatal("No device '%s' available for the CPU stage.\n", opts.cpuDevice);
+		printf("CPU platform: ");
+		printPlatform(cpuPlatform);
+		printf("CPU device: ");
+		printDevice(cpuDevice);
+	}
 
-	/* Create contexts. */
-	cpuContext = clCreateContext(cpuProperties, 1, &cpuDevice, NULL, NULL, &err);
-	if (err < 0)
-		sysfatal("Failed to create CPU context.\n");
-	gpuContext = clCreateContext(gpuProperties, 1, &gpuDevice, NULL, NULL, &err);
-	if (err < 0)
-		sysfatal("Failed to create GPU context.\n");
+	/* Get GPU stage device. */
+	contextMode = CONTEXT_SEPARATE;
+	if (gpuCL) {
+		if (opts.singleDevice && cpuCL) {
+			gpuPlatform = cpuPlatform;
+			gpuDevice = cpuDevice;
+		} else if (findDevice(opts.gpuDevice, platforms, nPlatforms, &gpuPlatform, &gpuDevice) != 0) {
+			sysfatal("No device '%s' available for the GPU stage.\n", opts.gpuDevice);
+		}
+		printf("GPU platform: ");
+		printPlatform(gpuPlatform);
+		printf("GPU device: ");
+		printDevice(gpuDevice);
+
+		if (gpuDevice == cpuDevice)
+			contextMode = CONTEXT_SINGLE;
+		else if (gpuPlatform == cpuPlatform)
+			contextMode = CONTEXT_SHARED;
+		printf("Contexts: %s\n", modeNames[contextMode]);
+	}
 
 	free(platforms);
 
-	/* Create program from file. */
+	/* The CPU stage runs on the sub-devices, if split, and cpuQueue on the first. */
+	cpuDevices = &cpuDevice;
+	nCpuDevices = 1;
+	if (opts.fission != FISSION_NONE) {
+		cpuDevices = splitDevice(cpuDevice, &nCpuDevices);
+		cpuDevice = cpuDevices[0];
+	}
+
+	/* Create contexts. */
+	if (cpuCL) {
+		if ((devices = malloc((nCpuDevices+1)*sizeof(cl_device_id))) == NULL)
+			sysfatal("Failed to allocate device array.\n");
+		memcpy(devices, cpuDevices, nCpuDevices*sizeof(cl_device_id));
+		devices[nCpuDevices] = gpuDevice;
+		nDevices = nCpuDevices + (contextMode == CONTEXT_SHARED);
+		if (opts.headless) {
+			/* There is no GL context to share with. */
+			cl_context_properties cpuProperties[] = headlessContextProperties(cpuPlatform);
+			cpuContext = clCreateContext(cpuProperties, nCpuDevices, devices, NULL, NULL, &err);
+		} else {
+			/* Configure properties for OpenGL interoperability. */
+			cl_context_properties cpuProperties[] = contextProperties(cpuPlatform);
+			cpuContext = clCreateContext(cpuProperties, nDevices, devices, NULL, NULL, &err);
+		}
+		if (err < 0)
+			sysfatal("Failed to create CPU context.\n");
+		free(devices);
+	}
+	if (gpuCL && contextMode == CONTEXT_SEPARATE) {
+		cl_context_properties gpuProperties[] = contextProperties(gpuPlatform);
+		gpuContext = clCreateContext(gpuProperties, 1, &gpuDevice, NULL, NULL, &err);
+		if (err < 0)
+			sysfatal("Failed to create GPU context.\n");
+	} else if (gpuCL) {
+		gpuContext = cpuContext;
+		clRetainContext(gpuContext);
+	}
+
+	/* Create and build programs from file, or from cached binaries. */
 	err = readFile(PROG_FILE, &progBuf, &progSize);
 	if (err != 0)
 		sysfatal("Failed to read %s\n", PROG_FILE);
-	cpuProg = clCreateProgramWithSource(cpuContext, 1, (const char **) &progBuf, &progSize, &err);
-	if (err < 0)
-		sysfatal("Failed to create CPU program.\n");
-	gpuProg = clCreateProgramWithSource(gpuContext, 1, (const char **) &progBuf, &progSize, &err);
-	if (err < 0)
-		sysfatal("Failed to create GPU program.\n");
+	paramDefines(&opts.params, stepTime, defines, sizeof(defines));
+	snprintf(options, sizeof(options), "-I./%s%s%s %s",
+		(opts.layout == LAYOUT_PACKED) ? " -DPACKED_STATE" : "",
+		(opts.vertexFormat == VERTEX_SHORT) ? " -DSHORT_VERTICES" : "",
+		opts.ccd ? " -DCCD" : "",
+		defines);
+	buildPrograms(cpuContext, (gpuCL && contextMode == CONTEXT_SEPARATE) ? gpuContext : NULL, progBuf, progSize, options, &cpuProg, &gpuProg);
+	if (gpuCL && contextMode != CONTEXT_SEPARATE) {
+		/* Already built for every device in the context. */
+		gpuProg = cpuProg;
+		clRetainProgram(gpuProg);
+	}
 	free(progBuf);
 
-	/* Build program. */
-	err = clBuildProgram(cpuProg, 0, NULL, "-I./", NULL, NULL);
-	if (err < 0) {
-		fprintf(stderr, "Failed to build CPU program.\n");
-		printBuildLog(cpuProg, cpuDevice);
-		exit(1);
+	/* Create command queues. */
+	queueProperties = (opts.profile != NULL) ? CL_QUEUE_PROFILING_ENABLE : 0;
+	if (cpuCL) {
+		cpuQueue = clCreateCommandQueue(cpuContext, cpuDevice, queueProperties, &err);
+		if (err < 0)
+			sysfatal("Failed to create CPU command queue.\n");
 	}
-	err = clBuildProgram(gpuProg, 0, NULL, "-I./", NULL, NULL);
-	if (err < 0) {
-		/* Print build log. */
-		fprintf(stderr, "Failed to build GPU program.\n");
-		printBuildLog(gpuProg, gpuDevice);
-		exit(1);
+	if (cpuDevices != &cpuDevice) {
+		/* The context holds on to them. */
+		for (i = 0; i < nCpuDevices; i++)
+			clReleaseDevice(cpuDevices[i]);
+		free(cpuDevices);
+	}
+	if (gpuCL && contextMode == CONTEXT_SINGLE) {
+		/* One in-order queue, so vertices are always generated after the physics. */
+		gpuQueue = cpuQueue;
+		clRetainCommandQueue(gpuQueue);
+	} else if (gpuCL) {
+		gpuQueue = clCreateCommandQueue(gpuContext, gpuDevice, queueProperties, &err);
+		if (err < 0)
+			sysfatal("Failed to create GPU command queue.\n");
 	}
-
-	/* Create command queues. */
-	cpuQueue = clCreateCommandQueue(cpuContext, cpuDevice, 0, &err);
-	if (err < 0)
-		sysfatal("Failed to create CPU command queue.\n");
-	gpuQueue = clCreateCommandQueue(gpuContext, gpuDevice, 0, &err);
-	if (err < 0)
-		sysfatal("Failed to create GPU command queue.\n");
 
 	/* Create kernels. */
-	moveKernel = createKernel(cpuProg, MOVE_KERNEL_FUNC);
-	collideWallsKernel = createKernel(cpuProg, COLLIDE_WALLS_KERNEL_FUNC);
-	collideBallsKernel = createKernel(cpuProg, COLLIDE_BALLS_KERNEL_FUNC);
-	genVerticesKernel = createKernel(gpuProg, GEN_VERTICES_KERNEL_FUNC);
+	if (cpuCL) {
+		moveKernel = createKernel(cpuProg, MOVE_KERNEL_FUNC);
+		collideWallsKernel = createKernel(cpuProg, COLLIDE_WALLS_KERNEL_FUNC);
+		collideBallsKernel = createKernel(cpuProg, COLLIDE_BALLS_KERNEL_FUNC);
+		integrateKernel = createKernel(cpuProg, INTEGRATE_KERNEL_FUNC);
+		collideRoundsKernel = createKernel(cpuProg, COLLIDE_ROUNDS_KERNEL_FUNC);
+		packStateKernel = createKernel(cpuProg, PACK_STATE_KERNEL_FUNC);
+		copyFloatsKernel = createKernel(cpuProg, COPY_FLOATS_KERNEL_FUNC);
+		initBallsKernel = createKernel(cpuProg, INIT_BALLS_KERNEL_FUNC);
+		diagnoseKernel = createKernel(cpuProg, DIAGNOSE_KERNEL_FUNC);
+		diagReduceKernel = createKernel(cpuProg, DIAG_REDUCE_KERNEL_FUNC);
+		gridClearKernel = createKernel(cpuProg, GRID_CLEAR_KERNEL_FUNC);
+		gridCountKernel = createKernel(cpuProg, GRID_COUNT_KERNEL_FUNC);
+		gridScanKernel = createKernel(cpuProg, GRID_SCAN_KERNEL_FUNC);
+		gridScatterKernel = createKernel(cpuProg, GRID_SCATTER_KERNEL_FUNC);
+		collideGridKernel = createKernel(cpuProg, COLLIDE_GRID_KERNEL_FUNC);
+		sweepKeysKernel = createKernel(cpuProg, SWEEP_KEYS_KERNEL_FUNC);
+		radixCountKernel = createKernel(cpuProg, RADIX_COUNT_KERNEL_FUNC);
+		radixScanKernel = createKernel(cpuProg, RADIX_SCAN_KERNEL_FUNC);
+		radixScatterKernel = createKernel(cpuProg, RADIX_SCATTER_KERNEL_FUNC);
+		sweepPairsKernel = createKernel(cpuProg, SWEEP_PAIRS_KERNEL_FUNC);
+		collideCandidatesKernel = createKernel(cpuProg, COLLIDE_CANDIDATES_KERNEL_FUNC);
+		clReleaseProgram(cpuProg);
+	}
+	if (gpuCL) {
+		genVerticesKernel = createKernel(gpuProg, GEN_VERTICES_KERNEL_FUNC);
+		clReleaseProgram(gpuProg);
+	}
+}
+
+/* Free what initCL() made, and the CPU stage's ball buffers. */
+void
+freeCL(void) {
+	if (cpuCL) {
+		clReleaseMemObject(positionsCpuBuf);
+		clReleaseMemObject(velocitiesCpuBuf);
+		clReleaseMemObject(radiiCpuBuf);
+		if (opts.layout == LAYOUT_PACKED) {
+			clReleaseMemObject(stateCpuBuf);
+			clReleaseMemObject(propsCpuBuf);
+		}
+
+		clReleaseKernel(moveKernel);
+		clReleaseKernel(collideWallsKernel);
+		clReleaseKernel(collideBallsKernel);
+		clReleaseKernel(integrateKernel);
+		clReleaseKernel(collideRoundsKernel);
+		clReleaseKernel(packStateKernel);
+		clReleaseKernel(copyFloatsKernel);
+		clReleaseKernel(initBallsKernel);
+		clReleaseKernel(diagnoseKernel);
+		clReleaseKernel(diagReduceKernel);
+		clReleaseKernel(gridClearKernel);
+		clReleaseKernel(gridCountKernel);
+		clReleaseKernel(gridScanKernel);
+		clReleaseKernel(gridScatterKernel);
+		clReleaseKernel(collideGridKernel);
+		clReleaseKernel(sweepKeysKernel);
+		clReleaseKernel(radixCountKernel);
+		clReleaseKernel(radixScanKernel);
+		clReleaseKernel(radixScatterKernel);
+		clReleaseKernel(sweepPairsKernel);
+		clReleaseKernel(collideCandidatesKernel);
+
+		clReleaseCommandQueue(cpuQueue);
+		clReleaseContext(cpuContext);
+	}
+
+	if (!gpuCL)
+		return;
+	clReleaseKernel(genVerticesKernel);
+	clReleaseCommandQueue(gpuQueue);
+	clReleaseContext(gpuContext);
+}
+
+/*
+ * Split device into sub-devices as opts.fission asks: one per NUMA node, or
+ * of opts.fissionUnits compute units each. Sets *n to their number.
+ */
+static cl_device_id *
+splitDevice(cl_device_id device, cl_uint *n) {
+	cl_device_partition_property numa[] = {
+		CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0
+	};
+	cl_device_partition_property equal[] = {
+		CL_DEVICE_PARTITION_EQUALLY, opts.fissionUnits, 0
+	};
+	cl_device_partition_property *props;
+	cl_device_id *devices;
+	int err;
 
-	clReleaseProgram(cpuProg);
-	clReleaseProgram(gpuProg);
+	props = (opts.fission == FISSION_NUMA) ? numa : equal;
+	err = clCreateSubDevices(device, props, 0, NULL, n);
+	if (err < 0)
+		sysfatal("Can't split the CPU device (error %d); it needs OpenCL 1.2 and support for the partition.\n", err);
+	if ((devices = malloc(*n * sizeof(cl_device_id))) == NULL)
+		sysfatal("Failed to allocate sub-device array.\n");
+	if (clCreateSubDevices(device, props, *n, devices, NULL) < 0)
+		sysfatal("Can't split the CPU device.\n");
+	printf("CPU device split into %u sub-devices", *n);
+	if (opts.fission == FISSION_NUMA)
+		printf(" by NUMA node\n");
+	else
+		printf(" of %d compute units\n", opts.fissionUnits);
+	return devices;
 }
 
 /*
@@ -158,6 +356,49 @@ getDevicePlatform(cl_platform_id platforms[], int nPlatforms, cl_device_type dev
 	return -1;
 }
 
+/*
+ * Find the device named by spec: "cpu", "gpu" or "accelerator" for the first
+ * device of that type on any platform, or "P:D" for device D of platform P,
+ * counting from 0. Sets *platform and *device. Returns non-zero if there is
+ * no such device.
+ */
+static int
+findDevice(const char *spec, cl_platform_id platforms[], int nPlatforms, cl_platform_id *platform, cl_device_id *device) {
+	int p, d, i;
+	char c;
+	cl_uint nDevices;
+	cl_device_id *devices;
+	cl_device_type type;
+
+	if (sscanf(spec, "%d:%d%c", &p, &d, &c) == 2) {
+		if (p < 0 || p >= nPlatforms || d < 0)
+			return 1;
+		if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 0, NULL, &nDevices) < 0 || (cl_uint) d >= nDevices)
+			return 1;
+		if ((devices = malloc(nDevices*sizeof(cl_device_id))) == NULL)
+			sysfatal("Failed to allocate device array.\n");
+		if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, nDevices, devices, NULL) < 0)
+			sysfatal("Can't get OpenCL devices.\n");
+		*platform = platforms[p];
+		*device = devices[d];
+		free(devices);
+		return 0;
+	}
+
+	if (strcmp(spec, "cpu") == 0)
+		type = CL_DEVICE_TYPE_CPU;
+	else if (strcmp(spec, "gpu") == 0)
+		type = CL_DEVICE_TYPE_GPU;
+	else if (strcmp(spec, "accelerator") == 0)
+		type = CL_DEVICE_TYPE_ACCELERATOR;
+	else
+		return 1;
+	if ((i = getDevicePlatform(platforms, nPlatforms, type, device)) < 0)
+		return 1;
+	*platform = platforms[i];
+	return 0;
+}
+
 static void
 printPlatform(cl_platform_id platform) {
 	int err;
@@ -225,20 +466,6 @@ printDevice(cl_device_id device) {
 	printf("(%savailable)\n", (!available) ? "un" : "");
 }
 
-static void
-printBuildLog(cl_program prog, cl_device_id device) {
-	size_t size;
-	char *log;
-
-	clGetProgramBuildInfo(prog, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &size);
-	if ((log = malloc(size + 1)) == NULL)
-		sysfatal("Failed to allocate program build log buffer.\n");
-	log[size] = '\0';
-	clGetProgramBuildInfo(prog, device, CL_PROGRAM_BUILD_LOG, size+1, log, NULL);
-	fprintf(stderr, "%s\n", log);
-	free(log);
-}
-
 static cl_kernel
 createKernel(cl_program prog, const char *kernelFunc) {
 	cl_kernel kernel;
@@ -249,3 +476,71 @@ createKernel(cl_program prog, const char *kernelFunc) {
 		sysfatal("Failed to create kernel '%s': %d\n", kernelFunc, err);
 	return kernel;
 }
+
+/* Allocate a read-write buffer on the CPU device. */
+cl_mem
+cpuBuffer(size_t size) {
+	cl_mem buf;
+	int err;
+
+	buf = clCreateBuffer(cpuContext, CL_MEM_READ_WRITE, size, NULL, &err);
+	if (err < 0)
+		sysfatal("Failed to allocate CPU buffer.\n");
+	return buf;
+}
+
+/* Return the largest work-group that kernel can be run with on the CPU device. */
+size_t
+cpuWorkGroupSize(cl_kernel kernel) {
+	cl_device_id device;
+	size_t size;
+
+	if (clGetCommandQueueInfo(cpuQueue, CL_QUEUE_DEVICE, sizeof(device), &device, NULL) < 0)
+		sysfatal("Failed to get CPU device of queue.\n");
+	if (clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size), &size, NULL) < 0)
+		sysfatal("Failed to get work-group size of kernel.\n");
+	return size;
+}
+
+/* Return the type of the CPU stage's device. */
+cl_device_type
+cpuDeviceType(void) {
+	cl_device_id device;
+	cl_device_type type;
+
+	if (clGetCommandQueueInfo(cpuQueue, CL_QUEUE_DEVICE, sizeof(device), &device, NULL) < 0)
+		sysfatal("Failed to get CPU device of queue.\n");
+	if (clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, NULL) < 0)
+		sysfatal("Failed to get type of CPU device.\n");
+	return type;
+}
+
+/* Enqueue a one-dimensional kernel of the given size on the CPU queue. */
+void
+runCpuKernel(cl_kernel kernel, size_t size, const char *name) {
+	int err;
+
+	err = clEnqueueNDRangeKernel(cpuQueue, kernel, 1, NULL, &size, NULL, 0, NULL, profileEvent(name, STAGE_CPU));
+	if (err < 0)
+		sysfatal("Couldn't enqueue kernel '%s'.\n", name);
+}
+
+/*
+ * Set the first three arguments of a physics kernel to the ball state, in the
+ * layout given by opts.layout (BALL_PARAMS in balls.cl).
+ */
+int
+setBallArgs(cl_kernel kernel) {
+	int err;
+
+	if (opts.layout == LAYOUT_PACKED) {
+		err = clSetKernelArg(kernel, 0, sizeof(stateCpuBuf), &stateCpuBuf);
+		err |= clSetKernelArg(kernel, 1, sizeof(propsCpuBuf), &propsCpuBuf);
+		err |= clSetKernelArg(kernel, 2, sizeof(positionsCpuBuf), &positionsCpuBuf);
+	} else {
+		err = clSetKernelArg(kernel, 0, sizeof(positionsCpuBuf), &positionsCpuBuf);
+		err |= clSetKernelArg(kernel, 1, sizeof(velocitiesCpuBuf), &velocitiesCpuBuf);
+		err |= clSetKernelArg(kernel, 2, sizeof(radiiCpuBuf), &radiiCpuBuf);
+	}
+	return err;
+}
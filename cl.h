@@ -0,0 +1,12 @@
+void buildPrograms(cl_context cpuContext, cl_context gpuContext, const char *src, size_t size, const char *options, cl_program *cpuProg, cl_program *gpuProg);
+cl_mem cpuBuffer(size_t size);
+int setBallArgs(cl_kernel kernel);
+void freeCL(void);
+size_t cpuWorkGroupSize(cl_kernel kernel);
+cl_device_type cpuDeviceType(void);
+void runCpuKernel(cl_kernel kernel, size_t size, const char *name);
+
+void initFission(void);
+cl_event stepFission(void);
+void finishFission(void);
+void freeFission(void);
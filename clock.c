@@ -0,0 +1,14 @@
+#include <time.h>
+
+#include "balls.h"
+#include "sysfatal.h"
+
+/* Return the time in seconds from an arbitrary starting point, unaffected by changes to the system clock. */
+double
+wallClock(void) {
+	struct timespec t;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &t) != 0)
+		sysfatal("Failed to read the clock.\n");
+	return t.tv_sec + t.tv_nsec/1e9;
+}
@@ -1,14 +1,21 @@
 /* #define WINDOWS 1 */
 
-#define CL_TARGET_OPENCL_VERSION 110
+#define CL_TARGET_OPENCL_VERSION 120
 
 #define WINDOW_TITLE "Balls"
+#define TRACE_FILE_DEFAULT "trace.json" /* Output of --profile. */
+#define CACHE_DIR_DEFAULT ".balls-cache" /* Directory of compiled program binaries. */
 
-#define RMIN 0.05 /* Minimum radius. */
-#define RMAX 0.15 /* Maximum radius. */
-#define VMAX_INIT 5.0 /* Maximum initial velocity. */
+#define PI 3.14159265358979f
 
-enum { FPS = 60 }; /* Frames per second. */
+/* Defaults of the simulation parameters (see params.c). */
+#define RMIN_DEFAULT 0.05f /* Minimum radius. */
+#define RMAX_DEFAULT 0.15f /* Maximum radius. */
+#define VMAX_INIT_DEFAULT 5.0f /* Maximum initial velocity. */
+#define GRAVITY_DEFAULT 9.81f /* Downward acceleration. */
+#define DENSITY_DEFAULT 1500.0f /* Mass per unit volume of a ball. */
+
+enum { FPS_DEFAULT = 60 }; /* Frames per second. */
 enum window {
 	WIDTH = 640,
 	HEIGHT = 640,
@@ -16,4 +23,25 @@ enum window {
 enum { KEY_QUIT = 'q' };
 
 enum { NBALLS_DEFAULT = 3 };
-enum { CIRCLE_POINTS = 32 }; /* Number of vertices per circle. */
+enum { STEPS_DEFAULT = 1000 }; /* Number of physics steps in headless mode. */
+enum { SNAPSHOT_INTERVAL_DEFAULT = 3600 }; /* Physics steps between snapshots. */
+enum { DIAG_INTERVAL_DEFAULT = 60 }; /* Frames between diagnostic samples. */
+enum { CHECK_SIMD_DEFAULT = 1000 }; /* Steps over which --check-simd compares the native kernels. */
+enum { CIRCLE_POINTS_DEFAULT = 32 }; /* Number of vertices per circle. */
+enum { CIRCLE_POINTS_MAX = 256 }; /* Work-group size of genVertices must allow this many. */
+
+/* Radix sort of the sweep broad phase. */
+enum {
+	RADIX_BITS = 8, /* Bits sorted per pass. */
+	RADIX = 1 << RADIX_BITS,
+	RADIX_PASSES = 32 / RADIX_BITS,
+};
+enum { DIAG_GROUP = 64 }; /* Work-group size of the diagnostics; a power of two. */
+enum { DIAG_RING = 64 }; /* Diagnostics that can be in flight. */
+enum { TRAJ_RING = 8 }; /* Trajectory frames waiting to be written before frames are dropped. */
+enum { FRAMES_DEFAULT = 600 }; /* Number of frames rendered offscreen. */
+enum { OFFSCREEN_PBOS = 3 }; /* Pixel buffers read back into in turn; a frame is mapped this many frames minus one later. */
+enum { IMAGE_QUEUE = 4 }; /* Offscreen images waiting to be written before the display waits. */
+enum { TRAJ_CHUNK = 64 }; /* Trajectory frames per chunk; each chunk starts with a key frame. */
+enum { ROUNDS_CPU_PAIRS = 512 }; /* Largest cell that --fused collides in one work-group on a CPU device. */
+enum { SWEEP_CANDIDATES = 32, SWEEP_CANDIDATES_MAX = 1024 }; /* Bounds of the potential colliders kept per ball in the sweep. */
@@ -0,0 +1,149 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <CL/cl.h>
+
+#include "balls.h"
+#include "sysfatal.h"
+#include "profile.h"
+#include "cl.h"
+
+/*
+ * Diagnostics of the simulation, computed by reduction kernels on the CPU
+ * device: total kinetic and potential energy, momentum, maximum speed and,
+ * with opts.diagOverlap, maximum overlap of a pair of balls. Every opts.diagInterval frames the
+ * kernels are enqueued behind the step, the result lands in a slot of a ring
+ * of DIAG_RING samples on the device, and a non-blocking read copies that
+ * slot to the host. Samples are printed once their reads have completed, so
+ * the host only waits if the ring fills up.
+ */
+
+typedef struct {
+	cl_float d[8]; /* As combineDiag() in balls.cl. */
+} Diag;
+
+static void report(int i);
+
+extern Options opts;
+extern int nBalls;
+extern double stepTime;
+extern cl_command_queue cpuQueue;
+extern cl_kernel diagnoseKernel, diagReduceKernel;
+
+static cl_mem partialsBuf; /* Diagnostic of each work-group of diagnose. */
+static cl_mem ringBuf; /* DIAG_RING samples. */
+static Diag ring[DIAG_RING]; /* Host copies of the samples. */
+static cl_event reads[DIAG_RING]; /* Read of each slot, or NULL once reported. */
+static unsigned long sampleSteps[DIAG_RING]; /* Step count of each sample. */
+static size_t globalSize; /* Of diagnose: nBalls rounded up to DIAG_GROUP. */
+static cl_uint nPartials;
+static int nSamples; /* Samples taken. */
+static int nReported; /* Samples printed; the oldest unreported is nReported % DIAG_RING. */
+static int frames; /* Frames since the last sample. */
+static unsigned long steps; /* Steps simulated. */
+static double energy0; /* Total energy of the first sample. */
+
+void
+initDiagnostics(void) {
+	cl_uint n, overlaps;
+	int err;
+
+	if (opts.diagInterval == 0)
+		return;
+
+	nPartials = (nBalls + DIAG_GROUP-1) / DIAG_GROUP;
+	globalSize = (size_t) nPartials * DIAG_GROUP;
+	partialsBuf = cpuBuffer(nPartials*sizeof(Diag));
+	ringBuf = cpuBuffer(DIAG_RING*sizeof(Diag));
+
+	n = nBalls;
+	overlaps = opts.diagOverlap;
+	err = setBallArgs(diagnoseKernel);
+	err |= clSetKernelArg(diagnoseKernel, 3, sizeof(n), &n);
+	err |= clSetKernelArg(diagnoseKernel, 4, sizeof(partialsBuf), &partialsBuf);
+	err |= clSetKernelArg(diagnoseKernel, 5, sizeof(overlaps), &overlaps);
+	err |= clSetKernelArg(diagReduceKernel, 0, sizeof(partialsBuf), &partialsBuf);
+	err |= clSetKernelArg(diagReduceKernel, 1, sizeof(nPartials), &nPartials);
+	err |= clSetKernelArg(diagReduceKernel, 2, sizeof(ringBuf), &ringBuf);
+	if (err < 0)
+		sysfatal("Failed to set arguments of diagnostic kernels.\n");
+}
+
+/*
+ * Count a frame of n steps, which must have been enqueued already, and take
+ * a sample if one is due. Print the samples that have arrived.
+ */
+void
+diagnoseFrame(int n) {
+	cl_uint slot;
+	size_t localSize;
+	cl_int status;
+	int err;
+
+	if (opts.diagInterval == 0)
+		return;
+	steps += n;
+
+	if (++frames >= opts.diagInterval) {
+		frames = 0;
+		slot = nSamples % DIAG_RING;
+		if (nSamples - nReported == DIAG_RING) /* Full; wait for the oldest. */
+			report(nReported++);
+
+		localSize = DIAG_GROUP;
+		err = clEnqueueNDRangeKernel(cpuQueue, diagnoseKernel, 1, NULL, &globalSize, &localSize, 0, NULL, profileEvent("diagnose", STAGE_CPU));
+		err |= clSetKernelArg(diagReduceKernel, 3, sizeof(slot), &slot);
+		err |= clEnqueueNDRangeKernel(cpuQueue, diagReduceKernel, 1, NULL, &localSize, &localSize, 0, NULL, profileEvent("diagReduce", STAGE_CPU));
+		err |= clEnqueueReadBuffer(cpuQueue, ringBuf, CL_FALSE, slot*sizeof(Diag), sizeof(Diag), &ring[slot], 0, NULL, &reads[slot]);
+		if (err < 0)
+			sysfatal("Failed to enqueue diagnostics.\n");
+		clFlush(cpuQueue);
+		sampleSteps[slot] = steps;
+		nSamples++;
+	}
+
+	/* Print the samples that are in, oldest first. */
+	while (nReported < nSamples) {
+		err = clGetEventInfo(reads[nReported % DIAG_RING], CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+		if (err < 0 || status != CL_COMPLETE)
+			break;
+		report(nReported++);
+	}
+}
+
+/* Print the samples still in flight and free the buffers. */
+void
+freeDiagnostics(void) {
+	if (opts.diagInterval == 0)
+		return;
+	while (nReported < nSamples)
+		report(nReported++);
+	clReleaseMemObject(partialsBuf);
+	clReleaseMemObject(ringBuf);
+}
+
+/* Wait for sample i and print it. */
+static void
+report(int i) {
+	Diag *d;
+	double energy, drift;
+	int slot;
+
+	slot = i % DIAG_RING;
+	if (clWaitForEvents(1, &reads[slot]) < 0)
+		sysfatal("Error reading diagnostics.\n");
+	clReleaseEvent(reads[slot]);
+	reads[slot] = NULL;
+
+	d = &ring[slot];
+	energy = (double) d->d[0] + d->d[1];
+	if (i == 0)
+		energy0 = energy;
+	drift = (energy0 != 0) ? (energy - energy0) / energy0 * 100 : 0;
+	printf("t=%.3f s: energy %.6g (kinetic %.6g, potential %.6g, %+.3f%%), momentum (%.4g, %.4g), max speed %.4g",
+		sampleSteps[slot]*stepTime, energy, d->d[0], d->d[1], drift, d->d[2], d->d[3], d->d[4]);
+	if (opts.diagOverlap)
+		printf(", max overlap %.4g", d->d[5]);
+	printf("\n");
+}
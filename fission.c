@@ -0,0 +1,292 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <CL/cl.h>
+
+#include "balls.h"
+#include "sysfatal.h"
+#include "profile.h"
+#include "cl.h"
+
+/*
+ * The physics stage on a CPU device split into sub-devices (see
+ * splitDevice() in cl.c), typically one per NUMA node. Each sub-device has
+ * its own queue and a contiguous slice of the balls, in proportion to its
+ * compute units, and runs move, collideWalls and integrate on that slice
+ * only. Each cell of the collision partition is shared out the same way by
+ * pairs. A phase of a step waits for the one before it on every sub-device;
+ * the step starts after everything already on cpuQueue and ends with a
+ * barrier there, so the rest of the program can keep using cpuQueue as if
+ * it ran the whole step.
+ *
+ * The ball buffers are reallocated and filled by a kernel on each
+ * sub-device for its own slice. As long as the runtime leaves new buffers
+ * untouched, the kernel's first touch puts each slice's pages on that
+ * sub-device's node.
+ */
+
+typedef struct {
+	cl_command_queue queue;
+	size_t lo, hi; /* Balls of the slice. */
+	size_t pairLo, pairHi; /* Pairs of each partition cell, from collisionPartition.first. */
+	unsigned long kernels; /* Finished kernels. */
+	double busy; /* Seconds they took. */
+} SubDevice;
+
+static cl_device_id *cpuSubDevices(cl_uint *n);
+static void placeBuffer(cl_mem *buf, size_t floatsPerBall);
+static void phase(cl_kernel kernel, const char *name, int byPairs);
+static void CL_CALLBACK addBusy(cl_event event, cl_int status, void *data);
+
+extern Options opts;
+extern int nBalls;
+extern Partition collisionPartition;
+extern cl_context cpuContext;
+extern cl_command_queue cpuQueue;
+extern cl_kernel moveKernel, collideWallsKernel, collideBallsKernel, integrateKernel, copyFloatsKernel;
+extern cl_mem positionsCpuBuf, velocitiesCpuBuf, radiiCpuBuf, stateCpuBuf, propsCpuBuf;
+
+static SubDevice *subs;
+static cl_uint nSubs;
+static cl_event *waits, *dones; /* Last command of the previous and current phase on each sub-device. */
+static cl_uint nWaits;
+static unsigned long steps;
+static pthread_mutex_t busyLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Create a queue on each sub-device of the CPU context, share out the balls
+ * and pairs, and move the ball buffers onto the sub-devices' nodes.
+ */
+void
+initFission(void) {
+	cl_device_id *devices;
+	cl_uint i, units, total;
+	size_t pairs;
+	int err;
+
+	devices = cpuSubDevices(&nSubs);
+	subs = calloc(nSubs, sizeof(SubDevice));
+	waits = malloc(nSubs*sizeof(cl_event));
+	dones = malloc(nSubs*sizeof(cl_event));
+	if (subs == NULL || waits == NULL || dones == NULL)
+		sysfatal("Failed to allocate sub-devices.\n");
+
+	total = 0;
+	for (i = 0; i < nSubs; i++) {
+		if (clGetDeviceInfo(devices[i], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, NULL) < 0)
+			sysfatal("Failed to get compute units of sub-device.\n");
+		total += units;
+		subs[i].hi = total; /* Compute units so far, scaled to balls below. */
+		subs[i].queue = clCreateCommandQueue(cpuContext, devices[i], CL_QUEUE_PROFILING_ENABLE, &err);
+		if (err < 0)
+			sysfatal("Failed to create queue of sub-device %u.\n", i);
+	}
+	pairs = collisionPartition.cellSize;
+	for (i = 0; i < nSubs; i++) {
+		subs[i].lo = (i > 0) ? subs[i-1].hi : 0;
+		subs[i].pairLo = (i > 0) ? subs[i-1].pairHi : 0;
+		units = subs[i].hi;
+		subs[i].hi = (size_t) nBalls * units / total;
+		subs[i].pairHi = pairs * units / total;
+		printf("Sub-device %u: balls %lu to %lu\n", i, (unsigned long) subs[i].lo, (unsigned long) subs[i].hi);
+	}
+	free(devices);
+
+	if (opts.layout == LAYOUT_PACKED) {
+		placeBuffer(&stateCpuBuf, 4);
+		placeBuffer(&propsCpuBuf, 2);
+	} else {
+		placeBuffer(&velocitiesCpuBuf, 2);
+		placeBuffer(&radiiCpuBuf, 1);
+	}
+	placeBuffer(&positionsCpuBuf, 2);
+	atexit(finishFission);
+}
+
+/*
+ * Enqueue one physics step across the sub-devices, as step() does on
+ * cpuQueue. Returns an event on cpuQueue that completes when it is finished.
+ */
+cl_event
+stepFission(void) {
+	cl_event event;
+	cl_uint cell, i;
+	int err;
+
+	if (clEnqueueMarkerWithWaitList(cpuQueue, 0, NULL, &waits[0]) < 0)
+		sysfatal("Failed to enqueue marker.\n");
+	nWaits = 1;
+
+	if (!opts.ccd)
+		phase(moveKernel, "move", 0);
+	for (cell = 0; collisionPartition.cellSize > 0 && cell < collisionPartition.size; cell++) {
+		if (clSetKernelArg(collideBallsKernel, 3, sizeof(cell), &cell) < 0)
+			sysfatal("Failed to set argument of collideBalls kernel.\n");
+		phase(collideBallsKernel, "collideBalls", 1);
+	}
+	if (opts.ccd)
+		phase(integrateKernel, "integrate", 0);
+	else
+		phase(collideWallsKernel, "collideWalls", 0);
+
+	err = clEnqueueBarrierWithWaitList(cpuQueue, nWaits, waits, &event);
+	if (err < 0)
+		sysfatal("Failed to enqueue barrier.\n");
+	for (i = 0; i < nWaits; i++)
+		clReleaseEvent(waits[i]);
+	for (i = 0; i < nSubs; i++)
+		clFlush(subs[i].queue);
+	steps++;
+	return event;
+}
+
+/* Wait for the sub-devices and print how busy each was. Also called at exit. */
+void
+finishFission(void) {
+	cl_uint i;
+
+	if (subs == NULL || steps == 0)
+		return;
+	for (i = 0; i < nSubs; i++)
+		clFinish(subs[i].queue);
+	pthread_mutex_lock(&busyLock);
+	for (i = 0; i < nSubs; i++)
+		printf("Sub-device %u: %lu balls, %lu pairs per cell, %lu kernels, %.3f s busy, %.1f us per step\n",
+			i, (unsigned long) (subs[i].hi - subs[i].lo), (unsigned long) (subs[i].pairHi - subs[i].pairLo),
+			subs[i].kernels, subs[i].busy, subs[i].busy / steps * 1e6);
+	pthread_mutex_unlock(&busyLock);
+	steps = 0;
+}
+
+void
+freeFission(void) {
+	cl_uint i;
+
+	finishFission();
+	for (i = 0; i < nSubs; i++)
+		clReleaseCommandQueue(subs[i].queue);
+	free(subs);
+	subs = NULL;
+	free(waits);
+	free(dones);
+}
+
+/* Return the sub-devices in the CPU context, in the order they were split. */
+static cl_device_id *
+cpuSubDevices(cl_uint *n) {
+	cl_device_id *devices, parent;
+	cl_uint i, nDevices;
+
+	if (clGetContextInfo(cpuContext, CL_CONTEXT_NUM_DEVICES, sizeof(nDevices), &nDevices, NULL) < 0)
+		sysfatal("Failed to get devices of CPU context.\n");
+	if ((devices = malloc(nDevices*sizeof(cl_device_id))) == NULL)
+		sysfatal("Failed to allocate device array.\n");
+	if (clGetContextInfo(cpuContext, CL_CONTEXT_DEVICES, nDevices*sizeof(cl_device_id), devices, NULL) < 0)
+		sysfatal("Failed to get devices of CPU context.\n");
+	/* The GPU stage's device may share the context, but it isn't a sub-device. */
+	*n = 0;
+	for (i = 0; i < nDevices; i++) {
+		if (clGetDeviceInfo(devices[i], CL_DEVICE_PARENT_DEVICE, sizeof(parent), &parent, NULL) < 0)
+			sysfatal("Failed to get parent of device.\n");
+		if (parent != NULL)
+			devices[(*n)++] = devices[i];
+	}
+	if (*n == 0)
+		sysfatal("The CPU context has no sub-devices.\n");
+	return devices;
+}
+
+/*
+ * Replace *buf, holding floatsPerBall floats for each ball, with a new
+ * buffer whose slices are first written by their own sub-devices.
+ */
+static void
+placeBuffer(cl_mem *buf, size_t floatsPerBall) {
+	cl_mem placed;
+	size_t offset, size;
+	cl_uint i;
+	int err;
+
+	placed = cpuBuffer(nBalls*floatsPerBall*sizeof(float));
+	err = clSetKernelArg(copyFloatsKernel, 0, sizeof(*buf), buf);
+	err |= clSetKernelArg(copyFloatsKernel, 1, sizeof(placed), &placed);
+	if (err < 0)
+		sysfatal("Failed to set arguments of copyFloats kernel.\n");
+	/* The source may still be being written on cpuQueue. */
+	clFinish(cpuQueue);
+	for (i = 0; i < nSubs; i++) {
+		offset = subs[i].lo * floatsPerBall;
+		size = (subs[i].hi - subs[i].lo) * floatsPerBall;
+		if (size == 0)
+			continue;
+		err = clEnqueueNDRangeKernel(subs[i].queue, copyFloatsKernel, 1, &offset, &size, NULL, 0, NULL, NULL);
+		if (err < 0)
+			sysfatal("Couldn't enqueue kernel.\n");
+	}
+	for (i = 0; i < nSubs; i++)
+		clFinish(subs[i].queue);
+	clReleaseMemObject(*buf);
+	*buf = placed;
+}
+
+/*
+ * Enqueue kernel on each sub-device over its slice of the balls, or of the
+ * pairs of the current cell if byPairs is set, after the previous phase has
+ * finished on all of them.
+ */
+static void
+phase(cl_kernel kernel, const char *name, int byPairs) {
+	size_t offset, size;
+	cl_event *t;
+	cl_uint i;
+	int err;
+
+	for (i = 0; i < nSubs; i++) {
+		if (byPairs) {
+			offset = collisionPartition.first + subs[i].pairLo;
+			size = subs[i].pairHi - subs[i].pairLo;
+		} else {
+			offset = subs[i].lo;
+			size = subs[i].hi - subs[i].lo;
+		}
+		/* Nothing to do, but the next phase still waits for it. */
+		if (size == 0) {
+			err = clEnqueueMarkerWithWaitList(subs[i].queue, nWaits, waits, &dones[i]);
+			if (err < 0)
+				sysfatal("Failed to enqueue marker.\n");
+			continue;
+		}
+		err = clEnqueueNDRangeKernel(subs[i].queue, kernel, 1, &offset, &size, NULL, nWaits, waits, &dones[i]);
+		if (err < 0)
+			sysfatal("Couldn't enqueue kernel '%s' on sub-device %u.\n", name, i);
+		if (clSetEventCallback(dones[i], CL_COMPLETE, addBusy, &subs[i]) < 0)
+			sysfatal("Failed to set event callback.\n");
+		profileRetain(name, STAGE_CPU, dones[i]);
+	}
+	for (i = 0; i < nWaits; i++)
+		clReleaseEvent(waits[i]);
+	t = waits;
+	waits = dones;
+	dones = t;
+	nWaits = nSubs;
+}
+
+/* Add the run time of a finished kernel to its sub-device. Runs on a runtime thread. */
+static void CL_CALLBACK
+addBusy(cl_event event, cl_int status, void *data) {
+	SubDevice *sub;
+	cl_ulong start, end;
+
+	sub = data;
+	if (status != CL_COMPLETE)
+		return;
+	if (clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL) < 0
+			|| clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL) < 0)
+		return;
+	pthread_mutex_lock(&busyLock);
+	sub->kernels++;
+	sub->busy += (end - start) / 1e9;
+	pthread_mutex_unlock(&busyLock);
+}
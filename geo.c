@@ -1,8 +1,19 @@
+#include "config.h"
+
 #include <stdlib.h>
+#include <math.h>
 
 #include "sysfatal.h"
 #include "balls.h"
 
+#define MAX_DENSITY 0.9069f /* Fraction of the plane covered by the densest packing of equal discs. */
+
+enum { PLACE_TRIES = 32 }; /* Random positions tried per ball before falling back to the lattice. */
+
+static int throwBalls(Vector *ps, int n, Rect bounds, const float *radii, float rmax);
+static int overlapsAny(Vector p, float r, const Vector *ps, const float *radii, const int *heads, const int *next, int gw, int gh, int cx, int cy);
+static int latticeBalls(Vector *ps, int n, Rect bounds, const float *radii, float rmax);
+
 int
 isCollision(Vector p1, float r1, Vector p2, float r2) {
 	float dx, dy, rhs;
@@ -18,32 +29,156 @@ insetRect(Rect r, float n) {
 	r.min.x += n;
 	r.min.y += n;
 
-	r.max.y -= n;
+	r.max.x -= n;
 	r.max.y -= n;
 
 	return r;
 }
 
-/* Generate n circle coordinates within bounds such that no circles overlap. */
+/*
+ * Generate positions for n balls with the given radii within bounds such
+ * that no balls overlap. Each ball is thrown at random points until it lands
+ * clear of the others (Poisson-disk sampling), testing only the balls in the
+ * neighbouring cells of a grid. If a ball can't be placed that way, the balls
+ * are instead put in the cells of a jittered lattice, one per cell. Both are
+ * O(n). Exits with an error if the balls can't fit.
+ */
 Vector *
-noOverlapPositions(int n, Rect bounds, float radius) {
+noOverlapPositions(int n, Rect bounds, const float *radii) {
 	Vector *ps;
-	int i, j;
+	float rmax, area, w, h;
+	int i;
 
 	if ((ps = malloc(n*sizeof(Vector))) == NULL)
 		sysfatal("Failed to allocate position array.\n");
 
-	bounds = insetRect(bounds, radius);
+	rmax = 0;
+	area = 0;
 	for (i = 0; i < n; i++) {
-		ps[i] = randPtInRect(bounds);
-		for (j = 0; j < i; j++)
-			if (isCollision(ps[j], radius, ps[i], radius))
+		if (radii[i] > rmax)
+			rmax = radii[i];
+		area += PI * radii[i]*radii[i];
+	}
+	w = bounds.max.x - bounds.min.x;
+	h = bounds.max.y - bounds.min.y;
+	if (2*rmax > w || 2*rmax > h)
+		sysfatal("A ball of radius %g doesn't fit in the bounds.\n", rmax);
+	if (area > MAX_DENSITY * w*h)
+		sysfatal("%d balls cover an area of %g, too much to fit in %g without overlapping.\n", n, area, w*h);
+
+	if (throwBalls(ps, n, bounds, radii, rmax) != 0 && latticeBalls(ps, n, bounds, radii, rmax) != 0)
+		sysfatal("Can't place %d balls of radius up to %g without overlapping; use fewer or smaller balls.\n", n, rmax);
+	return ps;
+}
+
+/*
+ * Place the balls by throwing each at up to PLACE_TRIES random points. The
+ * grid cells are at least as wide as the largest ball, so a ball can only
+ * overlap balls in its own and the 8 neighbouring cells. There are at most
+ * about n cells. Returns non-zero if a ball couldn't be placed.
+ */
+static int
+throwBalls(Vector *ps, int n, Rect bounds, const float *radii, float rmax) {
+	float w, h, cell;
+	int gw, gh, *heads, *next, i, t, cx, cy, c, failed;
+	Vector p;
+
+	w = bounds.max.x - bounds.min.x;
+	h = bounds.max.y - bounds.min.y;
+	cell = 2*rmax;
+	if (cell*cell*n < w*h)
+		cell = sqrtf(w*h / n);
+	gw = (w/cell >= 1) ? w/cell : 1;
+	gh = (h/cell >= 1) ? h/cell : 1;
+
+	heads = malloc(gw*gh*sizeof(int)); /* First ball in each cell, or -1. */
+	next = malloc(n*sizeof(int)); /* Next ball in the same cell, or -1. */
+	if (heads == NULL || next == NULL)
+		sysfatal("Failed to allocate placement grid.\n");
+	for (c = 0; c < gw*gh; c++)
+		heads[c] = -1;
+
+	failed = 0;
+	for (i = 0; i < n && !failed; i++) {
+		for (t = 0; t < PLACE_TRIES; t++) {
+			p = randPtInRect(insetRect(bounds, radii[i]));
+			cx = (p.x - bounds.min.x) / w * gw;
+			cy = (p.y - bounds.min.y) / h * gh;
+			cx = (cx < gw) ? cx : gw-1;
+			cy = (cy < gh) ? cy : gh-1;
+			if (!overlapsAny(p, radii[i], ps, radii, heads, next, gw, gh, cx, cy))
 				break;
-		if (j < i) { /* Overlapping. */
-			i--;
-			continue;
 		}
+		if (t == PLACE_TRIES) {
+			failed = 1;
+			break;
+		}
+		ps[i] = p;
+		next[i] = heads[cy*gw + cx];
+		heads[cy*gw + cx] = i;
 	}
 
-	return ps;
-}
\ No newline at end of file
+	free(heads);
+	free(next);
+	return failed;
+}
+
+/* Return true if a ball of radius r at p overlaps any ball in the cells around (cx, cy). */
+static int
+overlapsAny(Vector p, float r, const Vector *ps, const float *radii, const int *heads, const int *next, int gw, int gh, int cx, int cy) {
+	int x, y, j;
+
+	for (y = cy-1; y <= cy+1; y++) {
+		for (x = cx-1; x <= cx+1; x++) {
+			if (x < 0 || x >= gw || y < 0 || y >= gh)
+				continue;
+			for (j = heads[y*gw + x]; j >= 0; j = next[j])
+				if (isCollision(ps[j], radii[j], p, r))
+					return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Place the balls in randomly chosen cells of a lattice as wide as the
+ * largest ball, each at a random point where it stays inside its cell.
+ * Returns non-zero if there are more balls than cells.
+ */
+static int
+latticeBalls(Vector *ps, int n, Rect bounds, const float *radii, float rmax) {
+	int cols, rows, nCells, *cells, i, j, c;
+	float cw, ch;
+	Rect cell;
+
+	cols = (bounds.max.x - bounds.min.x) / (2*rmax);
+	rows = (bounds.max.y - bounds.min.y) / (2*rmax);
+	nCells = cols * rows;
+	if (nCells < n)
+		return 1;
+	cw = (bounds.max.x - bounds.min.x) / cols;
+	ch = (bounds.max.y - bounds.min.y) / rows;
+
+	/* Choose n cells with a partial Fisher-Yates shuffle. */
+	if ((cells = malloc(nCells*sizeof(int))) == NULL)
+		sysfatal("Failed to allocate placement lattice.\n");
+	for (c = 0; c < nCells; c++)
+		cells[c] = c;
+	for (i = 0; i < n; i++) {
+		j = i + randFloat(0, 1) * (nCells-i);
+		if (j >= nCells)
+			j = nCells-1;
+		c = cells[j];
+		cells[j] = cells[i];
+		cells[i] = c;
+
+		cell.min.x = bounds.min.x + (c % cols) * cw;
+		cell.min.y = bounds.min.y + (c / cols) * ch;
+		cell.max.x = cell.min.x + cw;
+		cell.max.y = cell.min.y + ch;
+		ps[i] = randPtInRect(insetRect(cell, radii[i]));
+	}
+
+	free(cells);
+	return 0;
+}
@@ -13,7 +13,12 @@
 static void initShaders(void);
 static void compileShader(GLint shader);
 static void genVertexBuffer(GLuint *vertexVBO, int nBalls);
-static void genColorBuffer(GLuint *colorVBO, int nBalls);
+static void genColorBuffer(GLuint *colorVBO, int nBalls, const float *colors);
+
+extern Options opts;
+
+static GLuint prog;
+static GLuint colorTex; /* Buffer texture over the colors. */
 
 void
 initGL(int argc, char *argv[]) {
@@ -31,25 +36,61 @@ initGL(int argc, char *argv[]) {
 	initShaders();
 }
 
-/* Create GL vertex and color buffers. */
+/*
+ * Create GL vertex and color buffers. Each ball is a triangle fan of
+ * opts.params.circlePoints vertices, and the shader looks up the color of
+ * vertex i's ball, i / circlePoints.
+ */
 void
-genBuffers(GLuint *vertexVAO, GLuint *vertexVBO, GLuint *colorVBO, int nBalls) {
+genBuffers(GLuint *vertexVAO, GLuint *vertexVBO, GLuint *colorVBO, int nBalls, const float *colors) {
 	glGenVertexArrays(1, vertexVAO);
 	glBindVertexArray(*vertexVAO);
 	genVertexBuffer(vertexVBO, nBalls);
-	genColorBuffer(colorVBO, nBalls);
+	genColorBuffer(colorVBO, nBalls, colors);
+	glUniform1i(glGetUniformLocation(prog, "circlePoints"), opts.params.circlePoints);
 }
 
+/*
+ * Create GL buffers for instanced drawing. Each ball is one instance: a quad
+ * around its centre, which the fragment shader cuts down to a circle. The
+ * centres are uploaded every frame; the radii and colors don't change.
+ */
 void
-freeGL(GLuint vertexVAO, GLuint vertexVBO, GLuint colorVBO) {
+genInstanceBuffers(GLuint *vertexVAO, GLuint *centerVBO, GLuint *radiusVBO, GLuint *colorVBO, int nBalls, const float *centers, const float *radii, const float *colors) {
+	glGenVertexArrays(1, vertexVAO);
+	glBindVertexArray(*vertexVAO);
+
+	glGenBuffers(1, centerVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, *centerVBO);
+	glBufferData(GL_ARRAY_BUFFER, nBalls*2*sizeof(GLfloat), centers, GL_STREAM_DRAW);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+	glVertexAttribDivisor(0, 1);
+	glEnableVertexAttribArray(0);
+
+	genColorBuffer(colorVBO, nBalls, colors);
+
+	glGenBuffers(1, radiusVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, *radiusVBO);
+	glBufferData(GL_ARRAY_BUFFER, nBalls*sizeof(GLfloat), radii, GL_STATIC_DRAW);
+	glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, 0, 0);
+	glVertexAttribDivisor(2, 1);
+	glEnableVertexAttribArray(2);
+
+	glUniform1i(glGetUniformLocation(prog, "instanced"), 1);
+}
+
+void
+freeGL(GLuint vertexVAO, GLuint vertexVBO, GLuint radiusVBO, GLuint colorVBO) {
 	glDeleteBuffers(1, &vertexVBO);
-	glDeleteBuffers(1, &vertexVAO);
+	glDeleteBuffers(1, &radiusVBO);
 	glDeleteBuffers(1, &colorVBO);
+	glDeleteTextures(1, &colorTex);
+	glDeleteVertexArrays(1, &vertexVAO);
 }
 
 static void
 initShaders(void) {
-	GLuint vs, fs, prog;
+	GLuint vs, fs;
 	int err;
 	char *vSrc, *fSrc;
 	size_t vLen, fLen;
@@ -76,13 +117,23 @@ initShaders(void) {
 	prog = glCreateProgram();
 
 	glBindAttribLocation(prog, 0, "in_coords");
-	glBindAttribLocation(prog, 1, "in_colors");
+	glBindAttribLocation(prog, 2, "in_radius");
 
 	glAttachShader(prog, vs);
 	glAttachShader(prog, fs);
 
 	glLinkProgram(prog);
 	glUseProgram(prog);
+
+	glUniform1i(glGetUniformLocation(prog, "colors"), 0);
+	if (opts.render == RENDER_FANS && opts.vertexFormat == VERTEX_SHORT) {
+		/* genVertices has already mapped the box to [-1, 1]. */
+		glUniform4f(glGetUniformLocation(prog, "bounds"), -1, -1, 1, 1);
+	} else {
+		glUniform4f(glGetUniformLocation(prog, "bounds"),
+			opts.params.bounds.min.x, opts.params.bounds.min.y,
+			opts.params.bounds.max.x, opts.params.bounds.max.y);
+	}
 }
 
 static void
@@ -107,37 +158,45 @@ compileShader(GLint shader) {
 
 static void
 genVertexBuffer(GLuint *vertexVBO, int nBalls) {
+	size_t n;
+
+	n = (size_t) nBalls * opts.params.circlePoints;
 	glGenBuffers(1, vertexVBO);
 	glBindBuffer(GL_ARRAY_BUFFER, *vertexVBO);
-	glBufferData(GL_ARRAY_BUFFER, nBalls*CIRCLE_POINTS*2*sizeof(GLfloat), NULL, GL_DYNAMIC_DRAW);
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+	if (opts.vertexFormat == VERTEX_SHORT) {
+		glBufferData(GL_ARRAY_BUFFER, n*2*sizeof(GLshort), NULL, GL_DYNAMIC_DRAW);
+		glVertexAttribPointer(0, 2, GL_SHORT, GL_TRUE, 0, 0);
+	} else {
+		glBufferData(GL_ARRAY_BUFFER, n*2*sizeof(GLfloat), NULL, GL_DYNAMIC_DRAW);
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+	}
 	glEnableVertexAttribArray(0);
 }
 
+/*
+ * Create a buffer with the color of each ball, once, as normalised 8-bit
+ * RGBA, and the buffer texture through which the shader reads it.
+ */
 static void
-genColorBuffer(GLuint *colorVBO, int nBalls) {
-	GLfloat (*colors)[3];
-	GLfloat color[3];
-	int i, j;
+genColorBuffer(GLuint *colorVBO, int nBalls, const float *colors) {
+	GLubyte (*rgba)[4];
+	int i, c;
 
-	if ((colors = malloc(nBalls*CIRCLE_POINTS*3*sizeof(GLfloat))) == NULL)
+	if ((rgba = malloc(nBalls*4*sizeof(GLubyte))) == NULL)
 		sysfatal("Failed to allocate color array.\n");
 	for (i = 0; i < nBalls; i++) {
-		color[0] = randFloat(0, 1);
-		color[1] = randFloat(0, 1);
-		color[2] = randFloat(0, 1);
-		for (j = 0; j < CIRCLE_POINTS; j++) {
-			colors[i*CIRCLE_POINTS + j][0] = color[0];
-			colors[i*CIRCLE_POINTS + j][1] = color[1];
-			colors[i*CIRCLE_POINTS + j][2] = color[2];
-		}
+		for (c = 0; c < 3; c++)
+			rgba[i][c] = colors[3*i+c] * 255.0f + 0.5f;
+		rgba[i][3] = 255;
 	}
 
 	glGenBuffers(1, colorVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, *colorVBO);
-	glBufferData(GL_ARRAY_BUFFER, nBalls*CIRCLE_POINTS*3*sizeof(GLfloat), colors, GL_STATIC_DRAW);
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
-	glEnableVertexAttribArray(1);
-
-	free(colors);
+	glBindBuffer(GL_TEXTURE_BUFFER, *colorVBO);
+	glBufferData(GL_TEXTURE_BUFFER, nBalls*4*sizeof(GLubyte), rgba, GL_STATIC_DRAW);
+	glGenTextures(1, &colorTex);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_BUFFER, colorTex);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA8, *colorVBO);
+
+	free(rgba);
 }
@@ -1,3 +1,9 @@
 void initGL(int argc, char *argv[]);
-void genBuffers(GLuint *vertexVAO, GLuint *vertexVBO, GLuint *colorVBO, int nBalls);
-void freeGL(GLuint vertexVAO, GLuint vertexVBO, GLuint colorVBO);
+void genBuffers(GLuint *vertexVAO, GLuint *vertexVBO, GLuint *colorVBO, int nBalls, const float *colors);
+void genInstanceBuffers(GLuint *vertexVAO, GLuint *centerVBO, GLuint *radiusVBO, GLuint *colorVBO, int nBalls, const float *centers, const float *radii, const float *colors);
+void initOffscreen(void);
+void beginOffscreenFrame(void);
+void endOffscreenFrame(void);
+void finishOffscreen(void);
+void offscreenDisplay(void);
+void freeGL(GLuint vertexVAO, GLuint vertexVBO, GLuint radiusVBO, GLuint colorVBO);
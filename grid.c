@@ -0,0 +1,125 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <CL/cl.h>
+
+#include "balls.h"
+#include "sysfatal.h"
+#include "profile.h"
+#include "cl.h"
+
+/*
+ * Uniform-grid broad phase. Every frame the balls are binned into square-ish
+ * cells at least as wide as the largest ball with a counting sort, and each ball is only
+ * tested against balls in its own and the eight neighbouring cells.
+ */
+
+static int gridDim(float width);
+
+extern Options opts;
+extern Rect bounds;
+extern int nBalls;
+extern cl_command_queue cpuQueue;
+extern cl_kernel gridClearKernel, gridCountKernel, gridScanKernel, gridScatterKernel, collideGridKernel;
+extern cl_mem positionsCpuBuf, velocitiesCpuBuf, radiiCpuBuf;
+
+static cl_mem cellCountsBuf; /* Number of balls in each cell. */
+static cl_mem cellStartsBuf; /* Index of each cell's first ball in cellBallsBuf. */
+static cl_mem cellBallsBuf; /* Ball indices sorted by cell. */
+static cl_mem ballCellsBuf; /* Cell index of each ball. */
+static cl_mem newPositionsBuf, newVelocitiesBuf;
+static cl_int nCells;
+
+/* Allocate the grid buffers and set the arguments of the grid kernels. */
+void
+initGrid(void) {
+	cl_float2 origin, cellSize;
+	cl_int2 dims;
+	int err;
+
+	dims.s[0] = gridDim(bounds.max.x - bounds.min.x);
+	dims.s[1] = gridDim(bounds.max.y - bounds.min.y);
+	cellSize.s[0] = (bounds.max.x - bounds.min.x) / dims.s[0];
+	cellSize.s[1] = (bounds.max.y - bounds.min.y) / dims.s[1];
+	origin.s[0] = bounds.min.x;
+	origin.s[1] = bounds.min.y;
+	nCells = dims.s[0] * dims.s[1];
+
+	cellCountsBuf = cpuBuffer(nCells*sizeof(cl_int));
+	cellStartsBuf = cpuBuffer((nCells+1)*sizeof(cl_int));
+	cellBallsBuf = cpuBuffer(nBalls*sizeof(cl_int));
+	ballCellsBuf = cpuBuffer(nBalls*sizeof(cl_int));
+	newPositionsBuf = cpuBuffer(nBalls*2*sizeof(float));
+	newVelocitiesBuf = cpuBuffer(nBalls*2*sizeof(float));
+
+	err = clSetKernelArg(gridClearKernel, 0, sizeof(cellCountsBuf), &cellCountsBuf);
+
+	err |= clSetKernelArg(gridCountKernel, 0, sizeof(positionsCpuBuf), &positionsCpuBuf);
+	err |= clSetKernelArg(gridCountKernel, 1, sizeof(ballCellsBuf), &ballCellsBuf);
+	err |= clSetKernelArg(gridCountKernel, 2, sizeof(cellCountsBuf), &cellCountsBuf);
+	err |= clSetKernelArg(gridCountKernel, 3, sizeof(origin), &origin);
+	err |= clSetKernelArg(gridCountKernel, 4, sizeof(cellSize), &cellSize);
+	err |= clSetKernelArg(gridCountKernel, 5, sizeof(dims), &dims);
+
+	err |= clSetKernelArg(gridScanKernel, 0, sizeof(cellCountsBuf), &cellCountsBuf);
+	err |= clSetKernelArg(gridScanKernel, 1, sizeof(cellStartsBuf), &cellStartsBuf);
+	err |= clSetKernelArg(gridScanKernel, 2, sizeof(nCells), &nCells);
+
+	err |= clSetKernelArg(gridScatterKernel, 0, sizeof(ballCellsBuf), &ballCellsBuf);
+	err |= clSetKernelArg(gridScatterKernel, 1, sizeof(cellStartsBuf), &cellStartsBuf);
+	err |= clSetKernelArg(gridScatterKernel, 2, sizeof(cellCountsBuf), &cellCountsBuf);
+	err |= clSetKernelArg(gridScatterKernel, 3, sizeof(cellBallsBuf), &cellBallsBuf);
+
+	err |= clSetKernelArg(collideGridKernel, 0, sizeof(positionsCpuBuf), &positionsCpuBuf);
+	err |= clSetKernelArg(collideGridKernel, 1, sizeof(velocitiesCpuBuf), &velocitiesCpuBuf);
+	err |= clSetKernelArg(collideGridKernel, 2, sizeof(radiiCpuBuf), &radiiCpuBuf);
+	err |= clSetKernelArg(collideGridKernel, 3, sizeof(ballCellsBuf), &ballCellsBuf);
+	err |= clSetKernelArg(collideGridKernel, 4, sizeof(cellStartsBuf), &cellStartsBuf);
+	err |= clSetKernelArg(collideGridKernel, 5, sizeof(cellBallsBuf), &cellBallsBuf);
+	err |= clSetKernelArg(collideGridKernel, 6, sizeof(newPositionsBuf), &newPositionsBuf);
+	err |= clSetKernelArg(collideGridKernel, 7, sizeof(newVelocitiesBuf), &newVelocitiesBuf);
+	err |= clSetKernelArg(collideGridKernel, 8, sizeof(dims), &dims);
+
+	if (err < 0)
+		sysfatal("Failed to set grid kernel arguments.\n");
+}
+
+/*
+ * Sort the balls into grid cells and collide each ball with its neighbours.
+ * The collision kernel reads the old state and writes the new state to
+ * separate buffers, which are then copied back.
+ */
+void
+collideGrid(void) {
+	int err;
+
+	runCpuKernel(gridClearKernel, nCells, "gridClear");
+	runCpuKernel(gridCountKernel, nBalls, "gridCount");
+	runCpuKernel(gridScanKernel, 1, "gridScan");
+	runCpuKernel(gridScatterKernel, nBalls, "gridScatter");
+	runCpuKernel(collideGridKernel, nBalls, "collideGrid");
+
+	err = clEnqueueCopyBuffer(cpuQueue, newPositionsBuf, positionsCpuBuf, 0, 0, nBalls*2*sizeof(float), 0, NULL, profileEvent("copyPositions", STAGE_CPU));
+	err |= clEnqueueCopyBuffer(cpuQueue, newVelocitiesBuf, velocitiesCpuBuf, 0, 0, nBalls*2*sizeof(float), 0, NULL, profileEvent("copyVelocities", STAGE_CPU));
+	if (err < 0)
+		sysfatal("Failed to copy back grid collision results.\n");
+}
+
+void
+freeGrid(void) {
+	clReleaseMemObject(cellCountsBuf);
+	clReleaseMemObject(cellStartsBuf);
+	clReleaseMemObject(cellBallsBuf);
+	clReleaseMemObject(ballCellsBuf);
+	clReleaseMemObject(newPositionsBuf);
+	clReleaseMemObject(newVelocitiesBuf);
+}
+
+/* Number of cells at least as wide as the largest ball that fit across width. */
+static int
+gridDim(float width) {
+	int n;
+
+	n = width / (2*opts.params.rMax);
+	return (n < 1) ? 1 : n;
+}
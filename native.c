@@ -0,0 +1,443 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define X86 1
+#include <immintrin.h>
+#endif
+
+#include "balls.h"
+#include "sysfatal.h"
+#include "physics.h"
+
+/*
+ * Native CPU backend: the physics of balls.cl (move, collideBalls and
+ * collideWalls) in plain C, for hosts whose OpenCL CPU runtime is slow or
+ * broken. It works on the host buffers directly, so after each call to
+ * simulateNative() positionsHostBuf holds the latest positions.
+ *
+ * Every step is run by a pool of threads together. Each thread takes a slice
+ * of the balls for move and collideWalls, and a slice of the pairs of every
+ * cell of the collision partition, with a barrier after move and after each
+ * cell. The loops have AVX2 and SSE versions, chosen at start-up from what the
+ * CPU supports, and a scalar fallback. The vector collision loops only test
+ * for overlap; the few pairs that do collide are resolved one at a time.
+ */
+
+typedef struct {
+	const char *name;
+	void (*move)(size_t lo, size_t hi, float dt);
+	void (*collideCell)(size_t cell, size_t lo, size_t hi);
+	void (*collideWalls)(size_t lo, size_t hi);
+} Kernels;
+
+static void *worker(void *arg);
+static void runSteps(int id, int n);
+static void slice(int id, size_t n, size_t *lo, size_t *hi);
+static Kernels pickKernels(Simd simd);
+static void moveScalar(size_t lo, size_t hi, float dt);
+static void collideScalar(size_t cell, size_t lo, size_t hi);
+static void wallsScalar(size_t lo, size_t hi);
+static void resolve(size_t i1, size_t i2);
+#ifdef X86
+static void moveSse(size_t lo, size_t hi, float dt);
+static void collideSse(size_t cell, size_t lo, size_t hi);
+static void wallsSse(size_t lo, size_t hi);
+static void moveAvx2(size_t lo, size_t hi, float dt);
+static void collideAvx2(size_t cell, size_t lo, size_t hi);
+static void wallsAvx2(size_t lo, size_t hi);
+#endif
+
+extern Options opts;
+extern int nBalls;
+extern float *positionsHostBuf, *velocitiesHostBuf, *radiiHostBuf;
+extern double stepTime;
+
+static float *pos, *vel, *radii; /* x, y pairs, x, y pairs, and one per ball. */
+static float *invMass;
+static float gravity; /* opts.params.gravity */
+static float wallMin[2], wallMax[2]; /* opts.params.bounds */
+static Partition part;
+static Kernels kernels;
+static pthread_t *threads;
+static int *threadIds;
+static int nThreads;
+static pthread_barrier_t barrier;
+static int jobSteps; /* Steps to run in the current job; 0 tells the workers to exit. */
+
+/* Start the thread pool and work out the inverse mass of each ball. */
+void
+initNative(void) {
+	int i;
+	long n;
+
+	pos = positionsHostBuf;
+	vel = velocitiesHostBuf;
+	radii = radiiHostBuf;
+	gravity = opts.params.gravity;
+	wallMin[0] = opts.params.bounds.min.x;
+	wallMin[1] = opts.params.bounds.min.y;
+	wallMax[0] = opts.params.bounds.max.x;
+	wallMax[1] = opts.params.bounds.max.y;
+	if ((invMass = malloc(nBalls*sizeof(float))) == NULL)
+		sysfatal("Failed to allocate inverse masses.\n");
+	for (i = 0; i < nBalls; i++)
+		invMass[i] = 1.0f / ballMass(&opts.params, radii[i]);
+	part = partitionCollisions(nBalls);
+	kernels = pickKernels(opts.simd);
+
+	nThreads = opts.threads;
+	if (nThreads == 0)
+		nThreads = ((n = sysconf(_SC_NPROCESSORS_ONLN)) > 0) ? n : 1;
+	printf("Native backend: %d threads, %s\n", nThreads, kernels.name);
+
+	if (pthread_barrier_init(&barrier, NULL, nThreads) != 0)
+		sysfatal("Failed to create thread barrier.\n");
+	threads = malloc(nThreads*sizeof(pthread_t));
+	threadIds = malloc(nThreads*sizeof(int));
+	if (threads == NULL || threadIds == NULL)
+		sysfatal("Failed to allocate thread pool.\n");
+	/* Thread 0 is the caller of simulateNative(). */
+	for (i = 1; i < nThreads; i++) {
+		threadIds[i] = i;
+		if (pthread_create(&threads[i], NULL, worker, &threadIds[i]) != 0)
+			sysfatal("Failed to start native worker thread.\n");
+	}
+}
+
+/* Run n physics steps, returning when they are finished. */
+void
+simulateNative(int n) {
+	if (n <= 0)
+		return;
+	jobSteps = n;
+	pthread_barrier_wait(&barrier);
+	runSteps(0, n);
+	pthread_barrier_wait(&barrier);
+}
+
+/*
+ * Run n steps with the chosen kernels, then again from the same state with
+ * the scalar ones, and exit unless they end bit for bit the same. The state
+ * is left as it was.
+ */
+void
+checkNative(int n) {
+	float *start, *chosen;
+	Kernels picked;
+	size_t size, i;
+
+	size = (size_t) nBalls*2*sizeof(float);
+	start = malloc(2*size);
+	chosen = malloc(2*size);
+	if (start == NULL || chosen == NULL)
+		sysfatal("Failed to allocate native check state.\n");
+	memcpy(start, pos, size);
+	memcpy(start + 2*nBalls, vel, size);
+
+	simulateNative(n);
+	memcpy(chosen, pos, size);
+	memcpy(chosen + 2*nBalls, vel, size);
+
+	memcpy(pos, start, size);
+	memcpy(vel, start + 2*nBalls, size);
+	picked = kernels;
+	kernels = pickKernels(SIMD_SCALAR);
+	simulateNative(n);
+	kernels = picked;
+
+	/* Compare the bits, so that NaNs and signed zeros count too. */
+	for (i = 0; i < (size_t) 2*nBalls; i++)
+		if (memcmp(&chosen[i], &pos[i], sizeof(float)) != 0 || memcmp(&chosen[2*nBalls + i], &vel[i], sizeof(float)) != 0)
+			break;
+	memcpy(pos, start, size);
+	memcpy(vel, start + 2*nBalls, size);
+	free(start);
+	free(chosen);
+	if (i < (size_t) 2*nBalls)
+		sysfatal("Native check: %s and scalar kernels differ at ball %lu after %d steps.\n", kernels.name, (unsigned long) i/2, n);
+	printf("Native check: %s and scalar kernels agree over %d steps\n", kernels.name, n);
+}
+
+void
+freeNative(void) {
+	int i;
+
+	jobSteps = 0;
+	pthread_barrier_wait(&barrier);
+	for (i = 1; i < nThreads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_barrier_destroy(&barrier);
+	free(threads);
+	free(threadIds);
+	free(invMass);
+}
+
+static void *
+worker(void *arg) {
+	int id;
+
+	id = *(int *) arg;
+	for (;;) {
+		pthread_barrier_wait(&barrier);
+		if (jobSteps == 0)
+			break;
+		runSteps(id, jobSteps);
+		pthread_barrier_wait(&barrier);
+	}
+	return NULL;
+}
+
+/*
+ * Thread id's share of n steps. The walls need no barrier after them: the
+ * next move only touches the same slice of balls.
+ */
+static void
+runSteps(int id, int n) {
+	size_t lo, hi, pairLo, pairHi, cell;
+
+	slice(id, nBalls, &lo, &hi);
+	slice(id, part.cellSize, &pairLo, &pairHi);
+	while (n-- > 0) {
+		kernels.move(lo, hi, stepTime);
+		pthread_barrier_wait(&barrier);
+		for (cell = 0; cell < part.size; cell++) {
+			kernels.collideCell(cell, part.first + pairLo, part.first + pairHi);
+			pthread_barrier_wait(&barrier);
+		}
+		kernels.collideWalls(lo, hi);
+	}
+}
+
+/* Set [*lo, *hi) to thread id's share of n items. */
+static void
+slice(int id, size_t n, size_t *lo, size_t *hi) {
+	*lo = n * id / nThreads;
+	*hi = n * (id+1) / nThreads;
+}
+
+/* Return the fastest kernels that simd allows and the CPU supports. */
+static Kernels
+pickKernels(Simd simd) {
+	Kernels scalar = { "scalar", moveScalar, collideScalar, wallsScalar };
+#ifdef X86
+	Kernels sse = { "SSE", moveSse, collideSse, wallsSse };
+	Kernels avx2 = { "AVX2", moveAvx2, collideAvx2, wallsAvx2 };
+
+	__builtin_cpu_init();
+	if (simd == SIMD_AUTO)
+		simd = __builtin_cpu_supports("avx2") ? SIMD_AVX2 : __builtin_cpu_supports("sse2") ? SIMD_SSE : SIMD_SCALAR;
+	if (simd == SIMD_AVX2 && !__builtin_cpu_supports("avx2"))
+		sysfatal("This CPU does not support AVX2.\n");
+	if (simd == SIMD_SSE && !__builtin_cpu_supports("sse2"))
+		sysfatal("This CPU does not support SSE2.\n");
+	if (simd == SIMD_AVX2)
+		return avx2;
+	if (simd == SIMD_SSE)
+		return sse;
+#else
+	if (simd == SIMD_AVX2 || simd == SIMD_SSE)
+		sysfatal("SIMD kernels are only available on x86.\n");
+#endif
+	return scalar;
+}
+
+static void
+moveScalar(size_t lo, size_t hi, float dt) {
+	size_t i;
+
+	for (i = lo; i < hi; i++) {
+		vel[2*i+1] -= gravity * dt;
+		pos[2*i] += vel[2*i] * dt;
+		pos[2*i+1] += vel[2*i+1] * dt;
+	}
+}
+
+/* Collide pairs lo to hi of a cell of the partition. */
+static void
+collideScalar(size_t cell, size_t lo, size_t hi) {
+	size_t k, pair[2];
+	float dx, dy, rs;
+
+	for (k = lo; k < hi; k++) {
+		partitionPair(part, cell, k, pair);
+		dx = pos[2*pair[0]] - pos[2*pair[1]];
+		dy = pos[2*pair[0]+1] - pos[2*pair[1]+1];
+		rs = radii[pair[0]] + radii[pair[1]];
+		if (dx*dx + dy*dy <= rs*rs)
+			resolve(pair[0], pair[1]);
+	}
+}
+
+static void
+wallsScalar(size_t lo, size_t hi) {
+	size_t i;
+
+	for (i = lo; i < hi; i++)
+		bounceBall(&pos[2*i], &vel[2*i], radii[i], wallMin, wallMax);
+}
+
+/* Resolve the collision of balls i1 and i2. */
+static void
+resolve(size_t i1, size_t i2) {
+	resolveBalls(&pos[2*i1], &vel[2*i1], radii[i1], invMass[i1], &pos[2*i2], &vel[2*i2], radii[i2], invMass[i2]);
+}
+
+#ifdef X86
+
+/* Two balls per vector. */
+__attribute__((target("sse2")))
+static void
+moveSse(size_t lo, size_t hi, float dt) {
+	__m128 g, t, p, v;
+	size_t i;
+
+	g = _mm_setr_ps(0, gravity*dt, 0, gravity*dt);
+	t = _mm_set1_ps(dt);
+	for (i = lo; i+2 <= hi; i += 2) {
+		v = _mm_sub_ps(_mm_loadu_ps(&vel[2*i]), g);
+		p = _mm_add_ps(_mm_loadu_ps(&pos[2*i]), _mm_mul_ps(v, t));
+		_mm_storeu_ps(&vel[2*i], v);
+		_mm_storeu_ps(&pos[2*i], p);
+	}
+	moveScalar(i, hi, dt);
+}
+
+/* Test four pairs per vector. */
+__attribute__((target("sse2")))
+static void
+collideSse(size_t cell, size_t lo, size_t hi) {
+	size_t k, pair[4][2];
+	int j, hits;
+	__m128 dx, dy, rs;
+
+	for (k = lo; k+4 <= hi; k += 4) {
+		for (j = 0; j < 4; j++)
+			partitionPair(part, cell, k+j, pair[j]);
+		dx = _mm_sub_ps(
+			_mm_setr_ps(pos[2*pair[0][0]], pos[2*pair[1][0]], pos[2*pair[2][0]], pos[2*pair[3][0]]),
+			_mm_setr_ps(pos[2*pair[0][1]], pos[2*pair[1][1]], pos[2*pair[2][1]], pos[2*pair[3][1]]));
+		dy = _mm_sub_ps(
+			_mm_setr_ps(pos[2*pair[0][0]+1], pos[2*pair[1][0]+1], pos[2*pair[2][0]+1], pos[2*pair[3][0]+1]),
+			_mm_setr_ps(pos[2*pair[0][1]+1], pos[2*pair[1][1]+1], pos[2*pair[2][1]+1], pos[2*pair[3][1]+1]));
+		rs = _mm_add_ps(
+			_mm_setr_ps(radii[pair[0][0]], radii[pair[1][0]], radii[pair[2][0]], radii[pair[3][0]]),
+			_mm_setr_ps(radii[pair[0][1]], radii[pair[1][1]], radii[pair[2][1]], radii[pair[3][1]]));
+		hits = _mm_movemask_ps(_mm_cmple_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(rs, rs)));
+		/* The pairs of a cell share no balls, so they can be resolved after testing. */
+		for (j = 0; j < 4; j++)
+			if (hits & (1 << j))
+				resolve(pair[j][0], pair[j][1]);
+	}
+	collideScalar(cell, k, hi);
+}
+
+/* Two balls per vector. */
+__attribute__((target("sse2")))
+static void
+wallsSse(size_t lo, size_t hi) {
+	__m128 lo2, hi2, sign, r, min, max, p, v, out;
+	size_t i;
+
+	lo2 = _mm_setr_ps(wallMin[0], wallMin[1], wallMin[0], wallMin[1]);
+	hi2 = _mm_setr_ps(wallMax[0], wallMax[1], wallMax[0], wallMax[1]);
+	sign = _mm_set1_ps(-0.0f);
+	for (i = lo; i+2 <= hi; i += 2) {
+		r = _mm_setr_ps(radii[i], radii[i], radii[i+1], radii[i+1]);
+		min = _mm_add_ps(lo2, r);
+		max = _mm_sub_ps(hi2, r);
+		p = _mm_loadu_ps(&pos[2*i]);
+		v = _mm_loadu_ps(&vel[2*i]);
+		out = _mm_or_ps(_mm_cmple_ps(p, min), _mm_cmpge_ps(p, max));
+		p = _mm_min_ps(_mm_max_ps(p, min), max);
+		v = _mm_xor_ps(v, _mm_and_ps(out, sign));
+		_mm_storeu_ps(&pos[2*i], p);
+		_mm_storeu_ps(&vel[2*i], v);
+	}
+	wallsScalar(i, hi);
+}
+
+/* Four balls per vector. */
+__attribute__((target("avx2")))
+static void
+moveAvx2(size_t lo, size_t hi, float dt) {
+	__m256 g, t, p, v;
+	size_t i;
+
+	g = _mm256_setr_ps(0, gravity*dt, 0, gravity*dt, 0, gravity*dt, 0, gravity*dt);
+	t = _mm256_set1_ps(dt);
+	for (i = lo; i+4 <= hi; i += 4) {
+		v = _mm256_sub_ps(_mm256_loadu_ps(&vel[2*i]), g);
+		p = _mm256_add_ps(_mm256_loadu_ps(&pos[2*i]), _mm256_mul_ps(v, t));
+		_mm256_storeu_ps(&vel[2*i], v);
+		_mm256_storeu_ps(&pos[2*i], p);
+	}
+	moveScalar(i, hi, dt);
+}
+
+/* Test eight pairs per vector, gathering the balls. */
+__attribute__((target("avx2")))
+static void
+collideAvx2(size_t cell, size_t lo, size_t hi) {
+	size_t k, pair[2];
+	int j, hits, i1[8], i2[8];
+	__m256i b1, b2, c1, c2;
+	__m256 dx, dy, rs;
+
+	for (k = lo; k+8 <= hi; k += 8) {
+		for (j = 0; j < 8; j++) {
+			partitionPair(part, cell, k+j, pair);
+			i1[j] = pair[0];
+			i2[j] = pair[1];
+		}
+		b1 = _mm256_loadu_si256((__m256i *) i1);
+		b2 = _mm256_loadu_si256((__m256i *) i2);
+		c1 = _mm256_slli_epi32(b1, 1);
+		c2 = _mm256_slli_epi32(b2, 1);
+		dx = _mm256_sub_ps(_mm256_i32gather_ps(pos, c1, 4), _mm256_i32gather_ps(pos, c2, 4));
+		dy = _mm256_sub_ps(_mm256_i32gather_ps(pos+1, c1, 4), _mm256_i32gather_ps(pos+1, c2, 4));
+		rs = _mm256_add_ps(_mm256_i32gather_ps(radii, b1, 4), _mm256_i32gather_ps(radii, b2, 4));
+		hits = _mm256_movemask_ps(_mm256_cmp_ps(
+			_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)),
+			_mm256_mul_ps(rs, rs), _CMP_LE_OQ));
+		/* The pairs of a cell share no balls, so they can be resolved after testing. */
+		for (j = 0; j < 8; j++)
+			if (hits & (1 << j))
+				resolve(i1[j], i2[j]);
+	}
+	collideScalar(cell, k, hi);
+}
+
+/* Four balls per vector. */
+__attribute__((target("avx2")))
+static void
+wallsAvx2(size_t lo, size_t hi) {
+	__m256 lo4, hi4, sign, r, min, max, p, v, out;
+	__m256i spread;
+	size_t i;
+
+	lo4 = _mm256_setr_ps(wallMin[0], wallMin[1], wallMin[0], wallMin[1], wallMin[0], wallMin[1], wallMin[0], wallMin[1]);
+	hi4 = _mm256_setr_ps(wallMax[0], wallMax[1], wallMax[0], wallMax[1], wallMax[0], wallMax[1], wallMax[0], wallMax[1]);
+	sign = _mm256_set1_ps(-0.0f);
+	spread = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+	for (i = lo; i+4 <= hi; i += 4) {
+		r = _mm256_permutevar8x32_ps(_mm256_castps128_ps256(_mm_loadu_ps(&radii[i])), spread);
+		min = _mm256_add_ps(lo4, r);
+		max = _mm256_sub_ps(hi4, r);
+		p = _mm256_loadu_ps(&pos[2*i]);
+		v = _mm256_loadu_ps(&vel[2*i]);
+		out = _mm256_or_ps(_mm256_cmp_ps(p, min, _CMP_LE_OQ), _mm256_cmp_ps(p, max, _CMP_GE_OQ));
+		p = _mm256_min_ps(_mm256_max_ps(p, min), max);
+		v = _mm256_xor_ps(v, _mm256_and_ps(out, sign));
+		_mm256_storeu_ps(&pos[2*i], p);
+		_mm256_storeu_ps(&vel[2*i], v);
+	}
+	wallsScalar(i, hi);
+}
+
+#endif /* X86 */
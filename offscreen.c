@@ -0,0 +1,369 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <GL/glew.h>
+#include <GL/glut.h>
+
+#include "balls.h"
+#include "sysfatal.h"
+#include "gl.h"
+
+/*
+ * Offscreen rendering to a sequence of images. The window is hidden and
+ * display() draws into a framebuffer object of opts.width by opts.height
+ * instead. Each frame is read into the next of a ring of OFFSCREEN_PBOS
+ * pixel buffer objects: glReadPixels() into a bound pixel pack buffer
+ * returns at once, and the buffer is only mapped OFFSCREEN_PBOS-1 frames
+ * later, by when the copy has long finished. The pixels are copied from the
+ * mapping into a queue of IMAGE_QUEUE images, which a worker thread flips,
+ * converts and writes to the files named by opts.offscreen. If the worker
+ * falls behind, the display waits for it rather than losing frames.
+ *
+ * Nothing is ever shown, so no GPU is needed: under Mesa's software
+ * rasteriser (LIBGL_ALWAYS_SOFTWARE=1) and a virtual X server such as Xvfb,
+ * the GL context of the hidden window is enough.
+ */
+
+enum { DEFLATE_BLOCK = 65535 }; /* Largest stored deflate block. */
+
+typedef struct {
+	unsigned char *pixels; /* RGBA, bottom row first, as read. */
+	int frame;
+} Image;
+
+static void queueFrame(int frame);
+static void *writeImages(void *arg);
+static void writeImage(const Image *img);
+static int writePPM(FILE *f, const unsigned char *rgba);
+static int writeRaw(FILE *f, const unsigned char *rgba);
+static int writePNG(FILE *f, const unsigned char *rgba);
+static int writeChunk(FILE *f, const char *type, const unsigned char *data, size_t size);
+static uint32_t crc(uint32_t c, const unsigned char *p, size_t n);
+static void put32(unsigned char *p, uint32_t x);
+
+extern Options opts;
+
+static GLuint fbo, colorRB;
+static GLuint pbos[OFFSCREEN_PBOS];
+static size_t imageSize; /* Of an RGBA frame in bytes. */
+static int nRead; /* Frames read into the PBOs. */
+
+static Image queue[IMAGE_QUEUE];
+static int head; /* Oldest image in the queue. */
+static int count; /* Images in the queue. */
+static int stopping; /* No more images will be queued. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static pthread_t worker;
+static int started;
+static int nWritten;
+
+/* Scratch of the worker. */
+static unsigned char *rows; /* Flipped rows, with a filter byte each for PNG. */
+static unsigned char *zbuf; /* zlib stream of a PNG. */
+static uint32_t crcTable[256];
+
+/* Hide the window and create the framebuffer, the PBOs and the worker. */
+void
+initOffscreen(void) {
+	size_t rawSize;
+	int i;
+	uint32_t c, k;
+
+	glutHideWindow();
+
+	glGenRenderbuffers(1, &colorRB);
+	glBindRenderbuffer(GL_RENDERBUFFER, colorRB);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, opts.width, opts.height);
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorRB);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		sysfatal("Offscreen framebuffer of %dx%d is incomplete.\n", opts.width, opts.height);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	imageSize = (size_t) opts.width * opts.height * 4;
+	glGenBuffers(OFFSCREEN_PBOS, pbos);
+	for (i = 0; i < OFFSCREEN_PBOS; i++) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[i]);
+		glBufferData(GL_PIXEL_PACK_BUFFER, imageSize, NULL, GL_STREAM_READ);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+	for (i = 0; i < IMAGE_QUEUE; i++)
+		if ((queue[i].pixels = malloc(imageSize)) == NULL)
+			sysfatal("Failed to allocate image queue.\n");
+	rawSize = (size_t) opts.height * (1 + 3*opts.width);
+	rows = malloc(rawSize);
+	zbuf = malloc(2 + rawSize + 5*(rawSize/DEFLATE_BLOCK + 1) + 4);
+	if (rows == NULL || zbuf == NULL)
+		sysfatal("Failed to allocate image buffers.\n");
+	for (k = 0; k < 256; k++) {
+		c = k;
+		for (i = 0; i < 8; i++)
+			c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+		crcTable[k] = c;
+	}
+
+	if (pthread_create(&worker, NULL, writeImages, NULL) != 0)
+		sysfatal("Failed to start image writer.\n");
+	started = 1;
+}
+
+/* Draw into the framebuffer from now on. */
+void
+beginOffscreenFrame(void) {
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glViewport(0, 0, opts.width, opts.height);
+}
+
+/* Start reading the frame just drawn, and queue the one read OFFSCREEN_PBOS-1 frames ago. */
+void
+endOffscreenFrame(void) {
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[nRead % OFFSCREEN_PBOS]);
+	glReadPixels(0, 0, opts.width, opts.height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	nRead++;
+	if (nRead >= OFFSCREEN_PBOS)
+		queueFrame(nRead - OFFSCREEN_PBOS);
+}
+
+/* Queue the frames still in the PBOs, wait for the worker to write them, and free everything. */
+void
+finishOffscreen(void) {
+	int i;
+
+	if (!started)
+		return;
+	started = 0;
+	for (i = (nRead >= OFFSCREEN_PBOS) ? nRead - OFFSCREEN_PBOS + 1 : 0; i < nRead; i++)
+		queueFrame(i);
+
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	pthread_cond_signal(&changed);
+	pthread_mutex_unlock(&lock);
+	pthread_join(worker, NULL);
+	printf("Wrote %d images to %s\n", nWritten, opts.offscreen);
+
+	glDeleteBuffers(OFFSCREEN_PBOS, pbos);
+	glDeleteFramebuffers(1, &fbo);
+	glDeleteRenderbuffers(1, &colorRB);
+	for (i = 0; i < IMAGE_QUEUE; i++)
+		free(queue[i].pixels);
+	free(rows);
+	free(zbuf);
+}
+
+/* GLUT needs a display callback, but the hidden window has nothing to redraw. */
+void
+offscreenDisplay(void) {
+}
+
+/* Copy frame's pixels from its PBO into the queue, waiting for room. */
+static void
+queueFrame(int frame) {
+	Image *img;
+	void *p;
+
+	pthread_mutex_lock(&lock);
+	while (count == IMAGE_QUEUE)
+		pthread_cond_wait(&changed, &lock);
+	img = &queue[(head + count) % IMAGE_QUEUE];
+	pthread_mutex_unlock(&lock);
+
+	/* The worker doesn't touch img until it is counted. */
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[frame % OFFSCREEN_PBOS]);
+	if ((p = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY)) == NULL)
+		sysfatal("Failed to map pixel buffer.\n");
+	memcpy(img->pixels, p, imageSize);
+	glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	img->frame = frame;
+
+	pthread_mutex_lock(&lock);
+	count++;
+	pthread_cond_signal(&changed);
+	pthread_mutex_unlock(&lock);
+}
+
+/* Write the queued images until stopped with the queue empty. */
+static void *
+writeImages(void *arg) {
+	Image *img;
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		while (count == 0 && !stopping)
+			pthread_cond_wait(&changed, &lock);
+		if (count == 0) {
+			pthread_mutex_unlock(&lock);
+			break;
+		}
+		img = &queue[head];
+		pthread_mutex_unlock(&lock);
+
+		writeImage(img);
+
+		pthread_mutex_lock(&lock);
+		head = (head + 1) % IMAGE_QUEUE;
+		count--;
+		pthread_cond_signal(&changed);
+		pthread_mutex_unlock(&lock);
+	}
+	return NULL;
+}
+
+static void
+writeImage(const Image *img) {
+	char path[1024];
+	FILE *f;
+	int ok;
+
+	snprintf(path, sizeof(path), opts.offscreen, img->frame);
+	if ((f = fopen(path, "wb")) == NULL) {
+		fprintf(stderr, "Failed to open image '%s'\n", path);
+		return;
+	}
+	switch (opts.imageFormat) {
+	case IMAGE_PPM:
+		ok = writePPM(f, img->pixels);
+		break;
+	case IMAGE_PNG:
+		ok = writePNG(f, img->pixels);
+		break;
+	default:
+		ok = writeRaw(f, img->pixels);
+		break;
+	}
+	ok = (fclose(f) == 0) && ok;
+	if (!ok)
+		fprintf(stderr, "Failed to write image '%s'\n", path);
+	else
+		nWritten++;
+}
+
+/* Binary PPM: RGB, top row first. Returns non-zero on success. */
+static int
+writePPM(FILE *f, const unsigned char *rgba) {
+	const unsigned char *src;
+	unsigned char *dst;
+	int x, y;
+
+	dst = rows;
+	for (y = opts.height-1; y >= 0; y--) {
+		src = rgba + (size_t) y*opts.width*4;
+		for (x = 0; x < opts.width; x++, src += 4, dst += 3)
+			memcpy(dst, src, 3);
+	}
+	return fprintf(f, "P6\n%d %d\n255\n", opts.width, opts.height) > 0
+		&& fwrite(rows, 3, (size_t) opts.width*opts.height, f) == (size_t) opts.width*opts.height;
+}
+
+/* The pixels as read, RGBA, but top row first. */
+static int
+writeRaw(FILE *f, const unsigned char *rgba) {
+	int y;
+
+	for (y = opts.height-1; y >= 0; y--)
+		if (fwrite(rgba + (size_t) y*opts.width*4, 4, opts.width, f) != (size_t) opts.width)
+			return 0;
+	return 1;
+}
+
+/*
+ * 8-bit RGB PNG. The image data is left uncompressed, in stored deflate
+ * blocks, so it costs little more than a PPM to write and needs no zlib.
+ */
+static int
+writePNG(FILE *f, const unsigned char *rgba) {
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	unsigned char ihdr[13];
+	const unsigned char *src;
+	unsigned char *dst;
+	size_t rawSize, len, i, n;
+	uint32_t a, b;
+	int x, y;
+
+	dst = rows;
+	for (y = opts.height-1; y >= 0; y--) {
+		*dst++ = 0; /* Filter: none. */
+		src = rgba + (size_t) y*opts.width*4;
+		for (x = 0; x < opts.width; x++, src += 4, dst += 3)
+			memcpy(dst, src, 3);
+	}
+	rawSize = dst - rows;
+
+	/* zlib stream of stored blocks, then the Adler-32 of the data. */
+	len = 0;
+	zbuf[len++] = 0x78;
+	zbuf[len++] = 0x01;
+	for (i = 0; i < rawSize; i += n) {
+		n = (rawSize-i < DEFLATE_BLOCK) ? rawSize-i : DEFLATE_BLOCK;
+		zbuf[len++] = (i+n == rawSize);
+		zbuf[len++] = n & 0xFF;
+		zbuf[len++] = n >> 8;
+		zbuf[len++] = ~n & 0xFF;
+		zbuf[len++] = (~n >> 8) & 0xFF;
+		memcpy(zbuf+len, rows+i, n);
+		len += n;
+	}
+	a = 1;
+	b = 0;
+	for (i = 0; i < rawSize; i++) {
+		a = (a + rows[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+	put32(zbuf+len, b << 16 | a);
+	len += 4;
+
+	put32(ihdr, opts.width);
+	put32(ihdr+4, opts.height);
+	ihdr[8] = 8; /* Bit depth. */
+	ihdr[9] = 2; /* Truecolour. */
+	ihdr[10] = ihdr[11] = ihdr[12] = 0; /* Deflate, adaptive filtering, no interlace. */
+	return fwrite(signature, 1, sizeof(signature), f) == sizeof(signature)
+		&& writeChunk(f, "IHDR", ihdr, sizeof(ihdr))
+		&& writeChunk(f, "IDAT", zbuf, len)
+		&& writeChunk(f, "IEND", NULL, 0);
+}
+
+/* Write a PNG chunk. Returns non-zero on success. */
+static int
+writeChunk(FILE *f, const char *type, const unsigned char *data, size_t size) {
+	unsigned char buf[4];
+	uint32_t c;
+
+	put32(buf, size);
+	if (fwrite(buf, 1, 4, f) != 4 || fwrite(type, 1, 4, f) != 4)
+		return 0;
+	if (size > 0 && fwrite(data, 1, size, f) != size)
+		return 0;
+	c = crc(0xFFFFFFFFu, (const unsigned char *) type, 4);
+	c = crc(c, data, size) ^ 0xFFFFFFFFu;
+	put32(buf, c);
+	return fwrite(buf, 1, 4, f) == 4;
+}
+
+/* Update the CRC-32 c with n bytes. */
+static uint32_t
+crc(uint32_t c, const unsigned char *p, size_t n) {
+	while (n-- > 0)
+		c = crcTable[(c ^ *p++) & 0xFF] ^ (c >> 8);
+	return c;
+}
+
+/* Store x big-endian. */
+static void
+put32(unsigned char *p, uint32_t x) {
+	p[0] = x >> 24;
+	p[1] = x >> 16;
+	p[2] = x >> 8;
+	p[3] = x;
+}
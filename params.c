@@ -0,0 +1,223 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "balls.h"
+
+/*
+ * Simulation parameters. They can be set in config files of "name = value"
+ * lines (# starts a comment) and with --name=value options. The files are
+ * read first, in order, and the options override them, later ones
+ * overriding earlier ones. The kernels get them as -D definitions when the
+ * program is built (paramDefines()), so they are still constants there.
+ */
+
+enum { LINE_MAX_LEN = 256 };
+
+/* How the value of a parameter is written. */
+typedef enum {
+	PARAM_FLOAT,
+	PARAM_INT,
+	PARAM_RECT, /* X0,Y0,X1,Y1 */
+} ParamKind;
+
+typedef struct {
+	const char *name;
+	ParamKind kind;
+	size_t offset; /* Of the value in Params. */
+} ParamInfo;
+
+static char *trim(char *s);
+static const char *parseFloat(const char *s, float *f, char sep);
+static int parseInt(const char *s, int *n);
+
+static const ParamInfo paramInfo[] = {
+	{ "gravity", PARAM_FLOAT, offsetof(Params, gravity) },
+	{ "density", PARAM_FLOAT, offsetof(Params, density) },
+	{ "fps", PARAM_INT, offsetof(Params, fps) },
+	{ "rmin", PARAM_FLOAT, offsetof(Params, rMin) },
+	{ "rmax", PARAM_FLOAT, offsetof(Params, rMax) },
+	{ "vmax", PARAM_FLOAT, offsetof(Params, vMaxInit) },
+	{ "circle-points", PARAM_INT, offsetof(Params, circlePoints) },
+	{ "bounds", PARAM_RECT, offsetof(Params, bounds) },
+};
+
+void
+defaultParams(Params *p) {
+	p->gravity = GRAVITY_DEFAULT;
+	p->density = DENSITY_DEFAULT;
+	p->fps = FPS_DEFAULT;
+	p->rMin = RMIN_DEFAULT;
+	p->rMax = RMAX_DEFAULT;
+	p->vMaxInit = VMAX_INIT_DEFAULT;
+	p->circlePoints = CIRCLE_POINTS_DEFAULT;
+	p->bounds.min.x = -1.0f;
+	p->bounds.min.y = -1.0f;
+	p->bounds.max.x = 1.0f;
+	p->bounds.max.y = 1.0f;
+}
+
+/* Set parameter name to value. Returns non-zero if there is no such parameter or value is invalid. */
+int
+setParam(Params *p, const char *name, const char *value) {
+	const ParamInfo *info;
+	char *field;
+	Rect *r;
+	int i;
+
+	for (i = 0; i < (int) (sizeof(paramInfo) / sizeof(paramInfo[0])); i++) {
+		info = &paramInfo[i];
+		if (strcmp(info->name, name) != 0)
+			continue;
+		field = (char *) p + info->offset;
+		switch (info->kind) {
+		case PARAM_FLOAT:
+			return parseFloat(value, (float *) field, '\0') == NULL;
+		case PARAM_INT:
+			return parseInt(value, (int *) field) != 0;
+		case PARAM_RECT:
+			r = (Rect *) field;
+			if ((value = parseFloat(value, &r->min.x, ',')) == NULL
+					|| (value = parseFloat(value, &r->min.y, ',')) == NULL
+					|| (value = parseFloat(value, &r->max.x, ',')) == NULL)
+				return 1;
+			return parseFloat(value, &r->max.y, '\0') == NULL;
+		}
+	}
+	return 1;
+}
+
+/* Set the parameters in the config file filename. Returns non-zero on error. */
+int
+loadParams(Params *p, const char *filename) {
+	FILE *f;
+	char line[LINE_MAX_LEN], *name, *value, *s;
+	int lineNo, err;
+
+	if ((f = fopen(filename, "r")) == NULL) {
+		fprintf(stderr, "Failed to open config file '%s'\n", filename);
+		return 1;
+	}
+	err = 0;
+	for (lineNo = 1; fgets(line, sizeof(line), f) != NULL; lineNo++) {
+		if ((s = strchr(line, '#')) != NULL)
+			*s = '\0';
+		name = trim(line);
+		if (*name == '\0')
+			continue;
+		if ((s = strchr(name, '=')) == NULL) {
+			fprintf(stderr, "%s:%d: expected name = value\n", filename, lineNo);
+			err = 1;
+			continue;
+		}
+		*s = '\0';
+		name = trim(name);
+		value = trim(s+1);
+		if (setParam(p, name, value) != 0) {
+			fprintf(stderr, "%s:%d: bad parameter '%s'\n", filename, lineNo, name);
+			err = 1;
+		}
+	}
+	fclose(f);
+	return err;
+}
+
+/* Return non-zero, with a message, if the parameters don't make sense. */
+int
+checkParams(const Params *p) {
+	float w, h;
+
+	w = p->bounds.max.x - p->bounds.min.x;
+	h = p->bounds.max.y - p->bounds.min.y;
+	if (p->fps < 1) {
+		fprintf(stderr, "fps must be positive.\n");
+		return 1;
+	}
+	if (p->rMin <= 0 || p->rMax < p->rMin) {
+		fprintf(stderr, "Radii must satisfy 0 < rmin <= rmax.\n");
+		return 1;
+	}
+	if (p->density <= 0 || p->vMaxInit < 0) {
+		fprintf(stderr, "density must be positive and vmax not negative.\n");
+		return 1;
+	}
+	if (p->circlePoints < 4 || p->circlePoints > CIRCLE_POINTS_MAX) {
+		fprintf(stderr, "circle-points must be from 4 to %d.\n", CIRCLE_POINTS_MAX);
+		return 1;
+	}
+	if (w < 2*p->rMax || h < 2*p->rMax) {
+		fprintf(stderr, "The bounds must be at least 2*rmax wide and high.\n");
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Write the -D options that give the kernels the parameters p and the step
+ * time dt to buf. The step's gravity and time are precomputed, and floats
+ * are printed with enough digits to be read back exactly.
+ */
+void
+paramDefines(const Params *p, double dt, char *buf, size_t size) {
+	snprintf(buf, size,
+		"-DGRAVITY=%.9ef -DDENSITY=%.9ef -DRMIN=%.9ef -DRMAX=%.9ef -DVMAX_INIT=%.9ef"
+		" -DSTEP_TIME=%.9ef -DGRAVITY_STEP=%.9ef"
+		" -DBOUNDS_MIN_X=%.9ef -DBOUNDS_MIN_Y=%.9ef -DBOUNDS_MAX_X=%.9ef -DBOUNDS_MAX_Y=%.9ef",
+		p->gravity, p->density, p->rMin, p->rMax, p->vMaxInit,
+		(float) dt, (float) (p->gravity * dt),
+		p->bounds.min.x, p->bounds.min.y, p->bounds.max.x, p->bounds.max.y);
+}
+
+/* Return the mass of a ball of radius r, as mass() in balls.cl. */
+float
+ballMass(const Params *p, float r) {
+	return 4.0f * PI * r*r*r / 3.0f * p->density;
+}
+
+/*
+ * Parse a float at the start of s that is followed by sep (or the end of s
+ * if sep is '\0'). Returns the rest of s after sep, or NULL on error.
+ */
+static const char *
+parseFloat(const char *s, float *f, char sep) {
+	char *end;
+
+	errno = 0;
+	*f = strtof(s, &end);
+	if (end == s || *end != sep || errno == ERANGE)
+		return NULL;
+	return (sep != '\0') ? end+1 : end;
+}
+
+/* Parse a whole integer. Returns non-zero on error. */
+static int
+parseInt(const char *s, int *n) {
+	char *end;
+	long l;
+
+	errno = 0;
+	l = strtol(s, &end, 10);
+	if (end == s || *end != '\0' || errno == ERANGE || l < INT_MIN || l > INT_MAX)
+		return 1;
+	*n = l;
+	return 0;
+}
+
+/* Strip leading and trailing white space from s, in place. */
+static char *
+trim(char *s) {
+	char *end;
+
+	while (*s == ' ' || *s == '\t')
+		s++;
+	end = s + strlen(s);
+	while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r'))
+		end--;
+	*end = '\0';
+	return s;
+}
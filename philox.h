@@ -0,0 +1,72 @@
+/*
+ * Philox4x32-10 counter-based random number generator (Salmon et al.,
+ * "Parallel random numbers: as easy as 1, 2, 3", SC 2011). Each block of
+ * four random words is a pure function of a 64-bit key (the seed) and a
+ * counter, so any number of threads or work-items can draw from it in any
+ * order and still get the same numbers. Shared by the host and balls.cl.
+ */
+
+#ifdef __OPENCL_VERSION__
+typedef uint philox_u32;
+#define PHILOX_FUNC
+#define PHILOX_MULHI(a, b) mul_hi((philox_u32) (a), (philox_u32) (b))
+#else
+#include <stdint.h>
+typedef uint32_t philox_u32;
+#define PHILOX_FUNC static inline
+#define PHILOX_MULHI(a, b) ((philox_u32) (((uint64_t) (a) * (b)) >> 32))
+#endif
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+/* Independent streams of random numbers, as the second counter word. */
+enum {
+	PHILOX_STREAM_HOST, /* Sequential draws on the host (randFloat()). */
+	PHILOX_STREAM_BALLS, /* The initial state of each ball, by index. */
+};
+
+typedef struct {
+	philox_u32 v[4];
+} Philox4;
+
+typedef struct {
+	philox_u32 k[2];
+} PhiloxKey;
+
+PHILOX_FUNC Philox4 philox(philox_u32 c0, philox_u32 c1, philox_u32 c2, PhiloxKey key);
+PHILOX_FUNC float philoxFloat(philox_u32 x);
+
+/* Return the four random words for counter (c0, c1, c2, 0). */
+PHILOX_FUNC Philox4
+philox(philox_u32 c0, philox_u32 c1, philox_u32 c2, PhiloxKey key) {
+	Philox4 c;
+	philox_u32 hi0, lo0, hi1, lo1;
+	int i;
+
+	c.v[0] = c0;
+	c.v[1] = c1;
+	c.v[2] = c2;
+	c.v[3] = 0;
+	for (i = 0; i < 10; i++) {
+		hi0 = PHILOX_MULHI(PHILOX_M0, c.v[0]);
+		lo0 = PHILOX_M0 * c.v[0];
+		hi1 = PHILOX_MULHI(PHILOX_M1, c.v[2]);
+		lo1 = PHILOX_M1 * c.v[2];
+		c.v[0] = hi1 ^ c.v[1] ^ key.k[0];
+		c.v[1] = lo1;
+		c.v[2] = hi0 ^ c.v[3] ^ key.k[1];
+		c.v[3] = lo0;
+		key.k[0] += PHILOX_W0;
+		key.k[1] += PHILOX_W1;
+	}
+	return c;
+}
+
+/* Map a random word to a float in [0, 1), exactly. */
+PHILOX_FUNC float
+philoxFloat(philox_u32 x) {
+	return (x >> 8) * (1.0f / 16777216.0f);
+}
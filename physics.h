@@ -0,0 +1,54 @@
+/*
+ * The wall bounce and collision response of balls.cl (collideWalls,
+ * setPosition() and applyImpulse()) for one ball or pair on the host. Shared
+ * by the native and strips backends, which keep their balls differently but
+ * must move them the same way.
+ */
+
+#include <math.h>
+
+static inline void bounceBall(float *p, float *v, float r, const float wallMin[2], const float wallMax[2]);
+static inline void resolveBalls(float *p1, float *v1, float r1, float invMass1, float *p2, float *v2, float r2, float invMass2);
+
+/* Keep a ball of radius r inside the bounds, reflecting it off the walls. */
+static inline void
+bounceBall(float *p, float *v, float r, const float wallMin[2], const float wallMax[2]) {
+	float min, max;
+	int c;
+
+	for (c = 0; c < 2; c++) {
+		min = wallMin[c] + r;
+		max = wallMax[c] - r;
+		if (p[c] <= min || p[c] >= max) {
+			p[c] = (p[c] < min) ? min : (p[c] > max) ? max : p[c];
+			v[c] = -v[c];
+		}
+	}
+}
+
+/* Separate two overlapping balls and exchange their momentum. */
+static inline void
+resolveBalls(float *p1, float *v1, float r1, float invMass1, float *p2, float *v2, float r2, float invMass2) {
+	float midx, midy, nx, ny, d, dpx, dpy, j;
+
+	midx = (p1[0] + p2[0]) / 2.0f;
+	midy = (p1[1] + p2[1]) / 2.0f;
+	nx = p2[0] - p1[0];
+	ny = p2[1] - p1[1];
+	d = sqrtf(nx*nx + ny*ny);
+	nx /= d;
+	ny /= d;
+	p1[0] = midx - nx*r1;
+	p1[1] = midy - ny*r1;
+	p2[0] = midx + nx*r2;
+	p2[1] = midy + ny*r2;
+
+	dpx = p2[0] - p1[0];
+	dpy = p2[1] - p1[1];
+	d = r1 + r2;
+	j = 2.0f * ((v2[0]-v1[0])*dpx + (v2[1]-v1[1])*dpy) / (d*d * (invMass1+invMass2));
+	v1[0] += dpx*j*invMass1;
+	v1[1] += dpy*j*invMass1;
+	v2[0] -= dpx*j*invMass2;
+	v2[1] -= dpy*j*invMass2;
+}
@@ -0,0 +1,256 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <GL/glew.h>
+#include <CL/cl_gl.h>
+
+#include "balls.h"
+#include "sysfatal.h"
+#include "profile.h"
+#include "pipeline.h"
+
+/*
+ * Ring of frames in flight between the CPU and GPU stages.
+ *
+ * When the CPU finishes a frame, its positions are read into a host buffer
+ * without blocking (pushFrame()). The frame is displayed opts.depth frames
+ * later (popFrame()): only then does the host wait for the read, and the
+ * positions are written to the GPU without blocking, with genVertices()
+ * chained to the write's event. So the CPU can be depth frames ahead of the
+ * frame being drawn. The ring has depth+1 slots because the next frame is
+ * pushed before the oldest is popped.
+ *
+ * If the CPU and GPU are in different contexts, which can't share events,
+ * the host still has to wait for each read. But by the time a frame is
+ * popped, its read has normally long finished. If they share a context, the
+ * positions are instead copied into the frame's GPU buffer on the device,
+ * and genVertices() waits for the copy's event without the host being
+ * involved. If they are the same device, there is no ring at all: the
+ * vertices are generated straight from the CPU's position buffer, on the same
+ * queue, so each frame is drawn as soon as it is computed.
+ */
+
+typedef struct {
+	float *positions; /* Host copy of the frame's positions, unless copied on the device. */
+	cl_mem gpuBuf; /* GPU copy, if gpuCL. */
+	cl_event read; /* Completes when positions or gpuBuf is filled; NULL if it is. */
+	double pushTime; /* Wall clock time when the frame was pushed. */
+} Frame;
+
+static void copyFrame(Frame *f, cl_event cpuEvent);
+
+extern Options opts;
+extern int gpuCL, nBalls;
+extern ContextMode contextMode;
+extern cl_context gpuContext;
+extern cl_command_queue cpuQueue, gpuQueue;
+extern cl_kernel genVerticesKernel;
+extern cl_mem positionsCpuBuf;
+extern GLuint vertexVBO;
+extern float *positionsHostBuf;
+
+static int deviceCopy; /* Frames are copied to the GPU on the device. */
+static int direct; /* The GPU reads the CPU's positions; there are no frames. */
+static Frame *ring;
+static int nSlots;
+static int head; /* Index of the oldest frame. */
+static int count; /* Number of frames in the ring. */
+static int displayed; /* A frame has been popped. */
+static int fresh; /* A frame has been pushed since the last pop, if direct. */
+static double lastPush; /* Wall clock time of the last push, if direct. */
+static double latencySum;
+static int latencyCount;
+
+/* Allocate the ring and put the initial positions in it as the first frame. */
+void
+initPipeline(void) {
+	int i, err;
+
+	/* The host backends' positions are only on the host. */
+	direct = gpuCL && opts.backend == BACKEND_OPENCL && contextMode == CONTEXT_SINGLE;
+	deviceCopy = gpuCL && opts.backend == BACKEND_OPENCL && contextMode == CONTEXT_SHARED;
+	if (direct) {
+		err = clSetKernelArg(genVerticesKernel, 0, sizeof(positionsCpuBuf), &positionsCpuBuf);
+		if (err < 0)
+			sysfatal("Failed to set argument of genVertices kernel.\n");
+		lastPush = wallClock();
+		fresh = 1;
+		return;
+	}
+
+	nSlots = opts.depth + 1;
+	if ((ring = calloc(nSlots, sizeof(Frame))) == NULL)
+		sysfatal("Failed to allocate frame ring.\n");
+	for (i = 0; i < nSlots; i++) {
+		if (!deviceCopy && (ring[i].positions = malloc(nBalls*2*sizeof(float))) == NULL)
+			sysfatal("Failed to allocate frame positions.\n");
+		if (!gpuCL)
+			continue;
+		ring[i].gpuBuf = clCreateBuffer(gpuContext, CL_MEM_READ_ONLY, nBalls*2*sizeof(float), NULL, &err);
+		if (err < 0)
+			sysfatal("Failed to allocate GPU position buffer.\n");
+	}
+
+	if (deviceCopy) {
+		copyFrame(&ring[0], NULL);
+	} else {
+		memcpy(ring[0].positions, positionsHostBuf, nBalls*2*sizeof(float));
+		ring[0].read = NULL;
+	}
+	ring[0].pushTime = wallClock();
+	head = 0;
+	count = 1;
+}
+
+/* Start copying the positions of a frame off the CPU once cpuEvent completes. */
+void
+pushFrame(cl_event cpuEvent) {
+	Frame *f;
+	int err;
+
+	if (direct) {
+		clReleaseEvent(cpuEvent);
+		lastPush = wallClock();
+		fresh = 1;
+		return;
+	}
+
+	if (count == nSlots) /* Full; can't happen if every push is followed by a pop. */
+		sysfatal("Frame ring overflow.\n");
+	f = &ring[(head + count) % nSlots];
+	if (deviceCopy) {
+		copyFrame(f, cpuEvent);
+	} else {
+		err = clEnqueueReadBuffer(cpuQueue, positionsCpuBuf, CL_FALSE, 0, nBalls*2*sizeof(float), f->positions, 1, &cpuEvent, &f->read);
+		if (err < 0)
+			sysfatal("Failed to read positions from CPU.\n");
+		profileRetain("readPositions", STAGE_CPU, f->read);
+	}
+	clReleaseEvent(cpuEvent);
+	clFlush(cpuQueue);
+	f->pushTime = wallClock();
+	count++;
+}
+
+/* Push a frame whose positions are already in positionsHostBuf. */
+void
+pushHostFrame(void) {
+	Frame *f;
+
+	if (count == nSlots)
+		sysfatal("Frame ring overflow.\n");
+	f = &ring[(head + count) % nSlots];
+	memcpy(f->positions, positionsHostBuf, nBalls*2*sizeof(float));
+	f->read = NULL;
+	f->pushTime = wallClock();
+	count++;
+}
+
+/*
+ * Copy the CPU's positions into the GPU buffer of f once cpuEvent (if not
+ * NULL) completes. The copy is enqueued on the CPU queue, so the next step
+ * can't overwrite the positions before they are copied.
+ */
+static void
+copyFrame(Frame *f, cl_event cpuEvent) {
+	int err;
+
+	err = clEnqueueCopyBuffer(cpuQueue, positionsCpuBuf, f->gpuBuf, 0, 0, nBalls*2*sizeof(float), (cpuEvent != NULL), (cpuEvent != NULL) ? &cpuEvent : NULL, &f->read);
+	if (err < 0)
+		sysfatal("Failed to copy positions to GPU buffer.\n");
+	profileRetain("copyFrame", STAGE_CPU, f->read);
+}
+
+/*
+ * If a frame is due, hand the oldest one to the GPU and return 1. With gpuCL,
+ * *written is set to an event that completes when the GPU has the positions
+ * (or NULL if it reads the CPU's directly), and genVertices() is pointed at
+ * them. Otherwise the positions are uploaded
+ * straight into the instance buffer and *written is NULL. Returns 0 if there
+ * is no frame to display.
+ */
+int
+popFrame(cl_event *written) {
+	Frame *f;
+	int err;
+
+	*written = NULL;
+	if (direct) {
+		if (!fresh)
+			return 0;
+		fresh = 0;
+		latencySum += wallClock() - lastPush;
+		latencyCount++;
+		return 1;
+	}
+	if (count == 0 || (count <= opts.depth && displayed))
+		return 0;
+	f = &ring[head];
+
+	if (deviceCopy) {
+		/* Same context, so the GPU can wait for the copy itself. */
+		*written = f->read;
+		f->read = NULL;
+	} else if (f->read != NULL) {
+		err = clWaitForEvents(1, &f->read);
+		if (err < 0)
+			sysfatal("Error waiting for positions from CPU.\n");
+		clReleaseEvent(f->read);
+		f->read = NULL;
+	}
+
+	if (gpuCL && !deviceCopy) {
+		err = clEnqueueWriteBuffer(gpuQueue, f->gpuBuf, CL_FALSE, 0, nBalls*2*sizeof(float), f->positions, 0, NULL, written);
+		if (err < 0)
+			sysfatal("Failed to copy positions from host to GPU.\n");
+		profileRetain("writePositions", STAGE_GPU, *written);
+	}
+	if (gpuCL) {
+		err = clSetKernelArg(genVerticesKernel, 0, sizeof(f->gpuBuf), &f->gpuBuf);
+		if (err < 0)
+			sysfatal("Failed to set argument of genVertices kernel.\n");
+	} else {
+		glBindBuffer(GL_ARRAY_BUFFER, vertexVBO);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, nBalls*2*sizeof(GLfloat), f->positions);
+	}
+
+	latencySum += wallClock() - f->pushTime;
+	latencyCount++;
+	head = (head + 1) % nSlots;
+	count--;
+	displayed = 1;
+	return 1;
+}
+
+/*
+ * Return the mean time in seconds from a frame being computed to it being
+ * displayed, over the frames popped since the last call.
+ */
+double
+frameLatency(void) {
+	double mean;
+
+	mean = (latencyCount > 0) ? latencySum / latencyCount : 0;
+	latencySum = 0;
+	latencyCount = 0;
+	return mean;
+}
+
+void
+freePipeline(void) {
+	int i;
+
+	if (direct)
+		return;
+	for (i = 0; i < nSlots; i++) {
+		if (ring[i].read != NULL) {
+			clWaitForEvents(1, &ring[i].read);
+			clReleaseEvent(ring[i].read);
+		}
+		if (ring[i].gpuBuf != NULL)
+			clReleaseMemObject(ring[i].gpuBuf);
+		free(ring[i].positions);
+	}
+	free(ring);
+}
@@ -0,0 +1,6 @@
+void initPipeline(void);
+void pushFrame(cl_event cpuEvent);
+void pushHostFrame(void);
+int popFrame(cl_event *written);
+double frameLatency(void);
+void freePipeline(void);
@@ -0,0 +1,255 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <CL/cl.h>
+
+#include "balls.h"
+#include "sysfatal.h"
+#include "profile.h"
+
+/*
+ * Device-side profiling. When enabled, every command enqueued on the CPU and
+ * GPU queues gets an event. The events are collected as they complete, and at
+ * exit their timestamps are written as a Chrome trace (load it in
+ * chrome://tracing or Perfetto) and summarised per command.
+ *
+ * Each device has its own clock, so the timestamps of each stage are shifted
+ * onto the host's wall clock using the first command of that stage: its
+ * QUEUED timestamp is taken to be the moment it was enqueued by the host.
+ */
+
+enum { NTIMES = 4 }; /* Number of timestamps per command. */
+
+typedef struct {
+	const char *name;
+	Stage stage;
+	double hostTime; /* Wall clock time when the command was enqueued. */
+	cl_event event;
+} Pending;
+
+typedef struct {
+	const char *name;
+	Stage stage;
+	double hostTime;
+	cl_ulong t[NTIMES]; /* Device timestamps in ns: queued, submit, start, end. */
+} Sample;
+
+static void collect(int wait);
+static void writeTrace(const char *filename);
+static void printSummary(void);
+static int cmpSample(const void *a, const void *b);
+static double duration(const Sample *s);
+static void *grow(void *arr, size_t *cap, size_t n, size_t size);
+
+static const cl_profiling_info timeParams[NTIMES] = {
+	CL_PROFILING_COMMAND_QUEUED,
+	CL_PROFILING_COMMAND_SUBMIT,
+	CL_PROFILING_COMMAND_START,
+	CL_PROFILING_COMMAND_END,
+};
+static const char *stageNames[NSTAGES] = { "CPU", "GPU" };
+
+static const char *traceFile; /* NULL if profiling is disabled. */
+static double t0; /* Wall clock time when profiling started. */
+static Pending *pending;
+static size_t nPending, pendingCap;
+static Sample *samples;
+static size_t nSamples, samplesCap;
+static int finished;
+
+/* Start profiling. The trace is written to filename at exit. */
+void
+profileInit(const char *filename) {
+	traceFile = filename;
+	t0 = wallClock();
+	atexit(profileFinish);
+}
+
+/*
+ * Return the event to pass to the enqueue call of a command with the given
+ * name, or NULL if profiling is disabled.
+ */
+cl_event *
+profileEvent(const char *name, Stage stage) {
+	Pending *p;
+
+	if (traceFile == NULL)
+		return NULL;
+	pending = grow(pending, &pendingCap, nPending+1, sizeof(Pending));
+	p = &pending[nPending++];
+	p->name = name;
+	p->stage = stage;
+	p->hostTime = wallClock();
+	p->event = NULL;
+	return &p->event;
+}
+
+/* Profile a command whose event is also needed by the caller. */
+void
+profileRetain(const char *name, Stage stage, cl_event event) {
+	cl_event *ev;
+
+	if ((ev = profileEvent(name, stage)) == NULL)
+		return;
+	clRetainEvent(event);
+	*ev = event;
+}
+
+/* Record the timestamps of the commands that have finished so far. */
+void
+profileCollect(void) {
+	if (traceFile != NULL)
+		collect(0);
+}
+
+/* Wait for all profiled commands, then write the trace and print the summary. */
+void
+profileFinish(void) {
+	if (traceFile == NULL || finished)
+		return;
+	finished = 1;
+	collect(1);
+	writeTrace(traceFile);
+	printSummary();
+}
+
+/*
+ * Move completed commands from pending to samples. If wait is set, wait for
+ * every pending command to complete first.
+ */
+static void
+collect(int wait) {
+	size_t i, j, k;
+	cl_int status;
+	Pending *p;
+	Sample *s;
+
+	for (i = j = 0; i < nPending; i++) {
+		p = &pending[i];
+		/* The enqueue failed, so there is nothing to time. */
+		if (p->event == NULL)
+			continue;
+		if (wait)
+			clWaitForEvents(1, &p->event);
+		if (clGetEventInfo(p->event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL) < 0)
+			status = CL_COMPLETE;
+		if (status > CL_COMPLETE) { /* Still queued or running. */
+			pending[j++] = *p;
+			continue;
+		}
+		if (status == CL_COMPLETE) {
+			samples = grow(samples, &samplesCap, nSamples+1, sizeof(Sample));
+			s = &samples[nSamples++];
+			s->name = p->name;
+			s->stage = p->stage;
+			s->hostTime = p->hostTime;
+			/* Dropped rather than fatal: this also runs at exit. */
+			for (k = 0; k < NTIMES; k++) {
+				if (clGetEventProfilingInfo(p->event, timeParams[k], sizeof(s->t[k]), &s->t[k], NULL) < 0) {
+					nSamples--;
+					break;
+				}
+			}
+		}
+		clReleaseEvent(p->event);
+	}
+	nPending = j;
+}
+
+static void
+writeTrace(const char *filename) {
+	FILE *f;
+	double offset[NSTAGES]; /* Device time to host time, in us. */
+	int haveOffset[NSTAGES] = {0};
+	size_t i;
+	int st;
+	Sample *s;
+	double ts[NTIMES];
+
+	if ((f = fopen(filename, "w")) == NULL) {
+		fprintf(stderr, "Failed to open trace file '%s'\n", filename);
+		return;
+	}
+
+	fprintf(f, "{\"traceEvents\":[\n");
+	for (st = 0; st < NSTAGES; st++)
+		fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+			st, stageNames[st]);
+	for (i = 0; i < nSamples; i++) {
+		s = &samples[i];
+		if (!haveOffset[s->stage]) {
+			offset[s->stage] = (s->hostTime-t0)*1e6 - s->t[0]/1e3;
+			haveOffset[s->stage] = 1;
+		}
+		for (st = 0; st < NTIMES; st++)
+			ts[st] = s->t[st]/1e3 + offset[s->stage];
+		fprintf(f, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,"
+			"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"queued\":%.3f,\"submit\":%.3f}}%s\n",
+			s->name, stageNames[s->stage], s->stage, ts[2], ts[3]-ts[2], ts[0], ts[1],
+			(i+1 < nSamples) ? "," : "");
+	}
+	fprintf(f, "]}\n");
+	fclose(f);
+	printf("Wrote %lu profiled commands to %s\n", (unsigned long) nSamples, filename);
+}
+
+/*
+ * Print the min, mean and 99th percentile run time of each command. Sorts the
+ * samples, so it must run after writeTrace().
+ */
+static void
+printSummary(void) {
+	size_t i, j, n;
+	double sum;
+	Sample *s;
+
+	qsort(samples, nSamples, sizeof(Sample), cmpSample);
+
+	printf("%-16s %-4s %8s %12s %12s %12s\n", "command", "dev", "count", "min (us)", "mean (us)", "p99 (us)");
+	for (i = 0; i < nSamples; i = j) {
+		s = &samples[i];
+		sum = 0;
+		for (j = i; j < nSamples && samples[j].stage == s->stage && strcmp(samples[j].name, s->name) == 0; j++)
+			sum += duration(&samples[j]);
+		n = j - i;
+		printf("%-16s %-4s %8lu %12.3f %12.3f %12.3f\n", s->name, stageNames[s->stage],
+			(unsigned long) n, duration(s), sum/n, duration(&samples[i + (99*n + 99)/100 - 1]));
+	}
+}
+
+/* Order samples by stage, then name, then run time. */
+static int
+cmpSample(const void *a, const void *b) {
+	const Sample *x, *y;
+	int c;
+	double dx, dy;
+
+	x = a;
+	y = b;
+	if (x->stage != y->stage)
+		return x->stage - y->stage;
+	if ((c = strcmp(x->name, y->name)) != 0)
+		return c;
+	dx = duration(x);
+	dy = duration(y);
+	return (dx > dy) - (dx < dy);
+}
+
+/* Run time of a command in us. */
+static double
+duration(const Sample *s) {
+	return (s->t[3] - s->t[2]) / 1e3;
+}
+
+/* Make sure arr has room for n elements of the given size, doubling its capacity as needed. */
+static void *
+grow(void *arr, size_t *cap, size_t n, size_t size) {
+	if (n <= *cap)
+		return arr;
+	*cap = (*cap == 0) ? 256 : 2 * *cap;
+	if ((arr = realloc(arr, *cap * size)) == NULL)
+		sysfatal("Failed to grow profile array.\n");
+	return arr;
+}
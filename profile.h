@@ -0,0 +1,12 @@
+/* Pipeline stage that a command runs on. */
+typedef enum {
+	STAGE_CPU,
+	STAGE_GPU,
+	NSTAGES
+} Stage;
+
+void profileInit(const char *filename);
+cl_event *profileEvent(const char *name, Stage stage);
+void profileRetain(const char *name, Stage stage, cl_event event);
+void profileCollect(void);
+void profileFinish(void);
@@ -0,0 +1,343 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <CL/cl.h>
+
+#include "balls.h"
+#include "sysfatal.h"
+#include "cl.h"
+
+/*
+ * Building the OpenCL programs. The CPU and GPU programs are built at the
+ * same time, each on its own thread. Compiled binaries are cached in
+ * opts.cache, one file per device, named by a hash of everything the
+ * compiler sees: the device name and version, the driver version, the build
+ * options, and the source with the headers it includes. A program whose
+ * devices all have a cached binary is created from the binaries; otherwise
+ * it is built from source and its binaries are saved for the next run. A
+ * stale or unreadable binary just means building from source.
+ */
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+typedef struct {
+	cl_context context;
+	const char *name; /* "CPU" or "GPU". */
+	cl_program prog;
+	int cached; /* prog was created from cached binaries. */
+	double seconds; /* Time taken to load or build prog. */
+	pthread_t thread;
+} Build;
+
+static void *build(void *arg);
+static cl_program loadBinaries(cl_context context, cl_uint n, cl_device_id *devices, char **paths);
+static cl_program buildSource(cl_context context, cl_device_id device, const char *name);
+static void saveBinaries(cl_program prog, cl_uint n, cl_device_id *devices, char **paths);
+static void writeCacheFile(const char *path, const unsigned char *bin, size_t size);
+static char *cachePath(cl_device_id device);
+static uint64_t hashDeviceInfo(uint64_t h, cl_device_id device, cl_device_info param);
+static uint64_t hash(uint64_t h, const void *data, size_t size);
+static void printBuildLog(cl_program prog, cl_device_id device);
+
+extern Options opts;
+
+/* Headers included by the program, which are part of its source. */
+static const char *headers[] = { "config.h", "philox.h" };
+
+static const char *source;
+static size_t sourceSize;
+static const char *buildOptions;
+static uint64_t sourceHash; /* Hash of the options, source and headers. */
+
+/*
+ * Build the program src with the given options for every device of
+ * cpuContext and of gpuContext, concurrently, skipping either if it is NULL.
+ * Sets *cpuProg and *gpuProg for the contexts built. Exits on failure.
+ */
+void
+buildPrograms(cl_context cpuContext, cl_context gpuContext, const char *src, size_t size, const char *options, cl_program *cpuProg, cl_program *gpuProg) {
+	Build builds[2];
+	int i, n;
+	char *header;
+	size_t headerSize;
+
+	source = src;
+	sourceSize = size;
+	buildOptions = options;
+	sourceHash = hash(FNV_OFFSET, options, strlen(options) + 1);
+	sourceHash = hash(sourceHash, src, size);
+	for (i = 0; i < (int) (sizeof(headers) / sizeof(headers[0])); i++) {
+		if (readFile(headers[i], &header, &headerSize) != 0)
+			continue;
+		sourceHash = hash(sourceHash, header, headerSize);
+		free(header);
+	}
+	if (opts.cache != NULL && mkdir(opts.cache, 0777) != 0 && access(opts.cache, W_OK) != 0) {
+		fprintf(stderr, "Can't use program cache '%s'\n", opts.cache);
+		opts.cache = NULL;
+	}
+
+	memset(builds, 0, sizeof(builds));
+	builds[0].context = cpuContext;
+	builds[0].name = "CPU";
+	builds[1].context = gpuContext;
+	builds[1].name = "GPU";
+	n = (int) (sizeof(builds) / sizeof(builds[0]));
+	for (i = 0; i < n; i++)
+		if (builds[i].context != NULL && pthread_create(&builds[i].thread, NULL, build, &builds[i]) != 0)
+			sysfatal("Failed to start %s program build.\n", builds[i].name);
+	for (i = 0; i < n; i++) {
+		if (builds[i].context == NULL)
+			continue;
+		pthread_join(builds[i].thread, NULL);
+		printf("%s program: %s in %.3f s\n", builds[i].name, builds[i].cached ? "loaded from cache" : "built", builds[i].seconds);
+	}
+
+	if (cpuContext != NULL)
+		*cpuProg = builds[0].prog;
+	if (gpuContext != NULL)
+		*gpuProg = builds[1].prog;
+}
+
+/* Thread that loads or builds the program of the Build arg. */
+static void *
+build(void *arg) {
+	Build *b;
+	cl_uint i, n;
+	cl_device_id *devices;
+	char **paths;
+	double start;
+
+	b = arg;
+	start = wallClock();
+	if (clGetContextInfo(b->context, CL_CONTEXT_NUM_DEVICES, sizeof(n), &n, NULL) < 0)
+		sysfatal("Failed to get devices of %s context.\n", b->name);
+	devices = malloc(n*sizeof(cl_device_id));
+	paths = malloc(n*sizeof(char *));
+	if (devices == NULL || paths == NULL)
+		sysfatal("Failed to allocate device list.\n");
+	if (clGetContextInfo(b->context, CL_CONTEXT_DEVICES, n*sizeof(cl_device_id), devices, NULL) < 0)
+		sysfatal("Failed to get devices of %s context.\n", b->name);
+	for (i = 0; i < n; i++)
+		paths[i] = cachePath(devices[i]);
+
+	if ((b->prog = loadBinaries(b->context, n, devices, paths)) != NULL) {
+		b->cached = 1;
+	} else {
+		b->prog = buildSource(b->context, devices[0], b->name);
+		saveBinaries(b->prog, n, devices, paths);
+	}
+	b->seconds = wallClock() - start;
+
+	for (i = 0; i < n; i++)
+		free(paths[i]);
+	free(paths);
+	free(devices);
+	return NULL;
+}
+
+/*
+ * Create a program from the binaries in the files paths[i] for devices[i].
+ * Returns NULL unless every binary is cached and loads.
+ */
+static cl_program
+loadBinaries(cl_context context, cl_uint n, cl_device_id *devices, char **paths) {
+	unsigned char **bins;
+	size_t *sizes;
+	cl_program prog;
+	cl_uint i, nRead;
+	cl_int err;
+	FILE *f;
+	long size;
+
+	bins = calloc(n, sizeof(unsigned char *));
+	sizes = calloc(n, sizeof(size_t));
+	if (bins == NULL || sizes == NULL)
+		sysfatal("Failed to allocate program binaries.\n");
+	for (nRead = 0; nRead < n; nRead++) {
+		if (paths[nRead] == NULL || (f = fopen(paths[nRead], "rb")) == NULL)
+			break;
+		fseek(f, 0, SEEK_END);
+		size = ftell(f);
+		rewind(f);
+		if (size > 0 && (bins[nRead] = malloc(size)) != NULL)
+			sizes[nRead] = fread(bins[nRead], 1, size, f);
+		fclose(f);
+		if (size <= 0 || sizes[nRead] != (size_t) size)
+			break;
+	}
+
+	prog = NULL;
+	if (nRead == n) {
+		prog = clCreateProgramWithBinary(context, n, devices, sizes, (const unsigned char **) bins, NULL, &err);
+		if (err < 0) {
+			prog = NULL;
+		} else if (clBuildProgram(prog, n, devices, buildOptions, NULL, NULL) < 0) {
+			clReleaseProgram(prog);
+			prog = NULL;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		free(bins[i]);
+	free(bins);
+	free(sizes);
+	return prog;
+}
+
+/* Create a program from source and build it for every device of context. Exits on failure. */
+static cl_program
+buildSource(cl_context context, cl_device_id device, const char *name) {
+	cl_program prog;
+	cl_int err;
+
+	prog = clCreateProgramWithSource(context, 1, &source, &sourceSize, &err);
+	if (err < 0)
+		sysfatal("Failed to create %s program.\n", name);
+	err = clBuildProgram(prog, 0, NULL, buildOptions, NULL, NULL);
+	if (err < 0) {
+		/* Print build log. */
+		fprintf(stderr, "Failed to build %s program.\n", name);
+		printBuildLog(prog, device);
+		exit(1);
+	}
+	return prog;
+}
+
+/* Write the binary of prog for each of the n devices to paths[i]. */
+static void
+saveBinaries(cl_program prog, cl_uint n, cl_device_id *devices, char **paths) {
+	cl_uint i, j, nProg;
+	cl_device_id *progDevices;
+	size_t *sizes;
+	unsigned char **bins;
+	int err;
+
+	if (opts.cache == NULL)
+		return;
+	if (clGetProgramInfo(prog, CL_PROGRAM_NUM_DEVICES, sizeof(nProg), &nProg, NULL) < 0)
+		sysfatal("Failed to get devices of program.\n");
+	progDevices = malloc(nProg*sizeof(cl_device_id));
+	sizes = malloc(nProg*sizeof(size_t));
+	bins = malloc(nProg*sizeof(unsigned char *));
+	if (progDevices == NULL || sizes == NULL || bins == NULL)
+		sysfatal("Failed to allocate program binaries.\n");
+	err = clGetProgramInfo(prog, CL_PROGRAM_DEVICES, nProg*sizeof(cl_device_id), progDevices, NULL);
+	err |= clGetProgramInfo(prog, CL_PROGRAM_BINARY_SIZES, nProg*sizeof(size_t), sizes, NULL);
+	if (err < 0)
+		sysfatal("Failed to get binary sizes of program.\n");
+	for (j = 0; j < nProg; j++)
+		if ((bins[j] = malloc(sizes[j])) == NULL)
+			sysfatal("Failed to allocate program binary.\n");
+	if (clGetProgramInfo(prog, CL_PROGRAM_BINARIES, nProg*sizeof(unsigned char *), bins, NULL) < 0)
+		sysfatal("Failed to get binaries of program.\n");
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < nProg && progDevices[j] != devices[i]; j++)
+			;
+		if (j < nProg && sizes[j] > 0)
+			writeCacheFile(paths[i], bins[j], sizes[j]);
+	}
+
+	for (j = 0; j < nProg; j++)
+		free(bins[j]);
+	free(bins);
+	free(sizes);
+	free(progDevices);
+}
+
+/*
+ * Write size bytes of bin to the file path, through a temporary file so
+ * that another process never reads half a binary.
+ */
+static void
+writeCacheFile(const char *path, const unsigned char *bin, size_t size) {
+	char *tmp;
+	FILE *f;
+	int ok;
+
+	if ((tmp = malloc(strlen(path) + 32)) == NULL)
+		sysfatal("Failed to allocate cache file name.\n");
+	sprintf(tmp, "%s.%ld.tmp", path, (long) getpid());
+	ok = 0;
+	if ((f = fopen(tmp, "wb")) != NULL) {
+		ok = fwrite(bin, 1, size, f) == size;
+		ok = (fclose(f) == 0) && ok;
+	}
+	if (ok && rename(tmp, path) != 0)
+		ok = 0;
+	if (!ok) {
+		fprintf(stderr, "Failed to write program cache '%s'\n", path);
+		remove(tmp);
+	}
+	free(tmp);
+}
+
+/* Return the malloc-allocated cache file of the program for device, or NULL if there is no cache. */
+static char *
+cachePath(cl_device_id device) {
+	uint64_t h;
+	char *path;
+
+	if (opts.cache == NULL)
+		return NULL;
+	h = hashDeviceInfo(sourceHash, device, CL_DEVICE_NAME);
+	h = hashDeviceInfo(h, device, CL_DEVICE_VERSION);
+	h = hashDeviceInfo(h, device, CL_DRIVER_VERSION);
+	if ((path = malloc(strlen(opts.cache) + 32)) == NULL)
+		sysfatal("Failed to allocate cache file name.\n");
+	sprintf(path, "%s/%016llx.bin", opts.cache, (unsigned long long) h);
+	return path;
+}
+
+/* Add the string device info param to the hash h. */
+static uint64_t
+hashDeviceInfo(uint64_t h, cl_device_id device, cl_device_info param) {
+	size_t size;
+	char *buf;
+
+	if (clGetDeviceInfo(device, param, 0, NULL, &size) < 0)
+		sysfatal("Failed to get device info.\n");
+	if ((buf = malloc(size)) == NULL)
+		sysfatal("Failed to allocate device info.\n");
+	if (clGetDeviceInfo(device, param, size, buf, NULL) < 0)
+		sysfatal("Failed to get device info.\n");
+	h = hash(h, buf, size);
+	free(buf);
+	return h;
+}
+
+/* Add size bytes of data to the FNV-1a hash h. */
+static uint64_t
+hash(uint64_t h, const void *data, size_t size) {
+	const unsigned char *p;
+	size_t i;
+
+	p = data;
+	for (i = 0; i < size; i++) {
+		h ^= p[i];
+		h *= FNV_PRIME;
+	}
+	return h;
+}
+
+static void
+printBuildLog(cl_program prog, cl_device_id device) {
+	size_t size;
+	char *log;
+
+	clGetProgramBuildInfo(prog, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &size);
+	if ((log = malloc(size + 1)) == NULL)
+		sysfatal("Failed to allocate program build log buffer.\n");
+	log[size] = '\0';
+	clGetProgramBuildInfo(prog, device, CL_PROGRAM_BUILD_LOG, size+1, log, NULL);
+	fprintf(stderr, "%s\n", log);
+	free(log);
+}
@@ -1,28 +1,69 @@
 #include <stdlib.h>
-#include <time.h>
 
 #include "balls.h"
+#include "philox.h"
 
+/*
+ * Sequential random numbers on the host, from the PHILOX_STREAM_HOST stream
+ * of the Philox generator: one block of four numbers per counter value.
+ */
+
+static PhiloxKey key;
+static philox_u32 counter; /* Counter of the next block. */
+static Philox4 block;
+static int used = 4; /* Numbers of block already returned. */
+
+/* Restart the sequence from the given seed. */
+void
+seedRand(unsigned long seed) {
+	key.k[0] = seed & 0xFFFFFFFF;
+	key.k[1] = (seed >> 16) >> 16;
+	counter = 0;
+	used = 4;
+}
+
+/* Return a random number in [lo, hi). */
 float
 randFloat(float lo, float hi) {
-	float r, diff;
-	static int isInitialized = 0;
-
-	if (!isInitialized) { /* First call. */
-		srand(time(0));
-		isInitialized = 1;
+	if (used == 4) {
+		block = philox(counter++, PHILOX_STREAM_HOST, 0, key);
+		used = 0;
 	}
-
-	r = (float) rand() / RAND_MAX;
-	diff = hi - lo;
-	return lo + r*diff;
+	return lo + philoxFloat(block.v[used++]) * (hi - lo);
 }
 
 Vector
 randPtInRect(Rect r) {
-	Vector pt = {
-		randFloat(r.min.x, r.max.x),
-		randFloat(r.min.y, r.max.y)
-	};
+	Vector pt;
+
+	/* In order; an initializer list may evaluate them in any order. */
+	pt.x = randFloat(r.min.x, r.max.x);
+	pt.y = randFloat(r.min.y, r.max.y);
 	return pt;
 }
+
+/*
+ * Draw the radius, velocity and color of each of n balls from the
+ * PHILOX_STREAM_BALLS stream keyed by seed, as the initBalls kernel does.
+ * gcc doesn't fuse multiply-adds under -std=c99, and initBalls turns them
+ * off too, so the floats are the same.
+ */
+void
+randBalls(unsigned long seed, const Params *p, int n, float *radii, float *velocities, float *colors) {
+	PhiloxKey k;
+	Philox4 a, b;
+	int i;
+
+	k.k[0] = seed & 0xFFFFFFFF;
+	k.k[1] = (seed >> 16) >> 16;
+	for (i = 0; i < n; i++) {
+		a = philox(i, PHILOX_STREAM_BALLS, 0, k);
+		b = philox(i, PHILOX_STREAM_BALLS, 1, k);
+		radii[i] = p->rMin + philoxFloat(a.v[0]) * (p->rMax - p->rMin);
+		velocities[2*i] = -p->vMaxInit + philoxFloat(a.v[1]) * (2*p->vMaxInit);
+		velocities[2*i+1] = -p->vMaxInit + philoxFloat(a.v[2]) * (2*p->vMaxInit);
+		colors[3*i] = philoxFloat(b.v[0]);
+		colors[3*i+1] = philoxFloat(b.v[1]);
+		colors[3*i+2] = philoxFloat(b.v[2]);
+	}
+}
@@ -0,0 +1,309 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <CL/cl.h>
+
+#include "balls.h"
+#include "sysfatal.h"
+
+/*
+ * Snapshots of the simulation state. A snapshot file is a SnapshotHeader
+ * followed by the positions (x, y), velocities (x, y), radii and colors
+ * (r, g, b) of the balls as contiguous float arrays, in host byte order.
+ * Each array starts at an offset recorded in the header, aligned to
+ * SNAPSHOT_ALIGN, so that a file mapped with mmap() can back the
+ * CL_MEM_USE_HOST_PTR position buffer directly.
+ *
+ * While running, the state is captured every opts.snapshotInterval steps
+ * into a staging copy of the file: the OpenCL backend enqueues non-blocking
+ * reads behind the step, and the host backends copy their host buffers.
+ * A writer thread then waits for the reads and writes the staging copy to
+ * a temporary file, which is renamed over the snapshot so that a crash never
+ * leaves a half-written one. If the previous snapshot is still being written
+ * when the next is due, the next is skipped.
+ */
+
+#define SNAPSHOT_MAGIC "BALLSNAP"
+#define TMP_SUFFIX ".tmp"
+#define ALIGN(x) (((x) + SNAPSHOT_ALIGN-1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN)
+
+enum { SNAPSHOT_VERSION = 1 };
+enum { SNAPSHOT_ALIGN = 4096 }; /* Alignment of the arrays in the file. */
+
+typedef struct {
+	char magic[8]; /* SNAPSHOT_MAGIC, without the '\0'. */
+	uint32_t version;
+	uint32_t nBalls;
+	double stepTime; /* Seconds of simulated time per step. */
+	uint64_t steps; /* Steps simulated before the snapshot was taken. */
+	float bounds[4]; /* min.x, min.y, max.x, max.y */
+	uint64_t positions, velocities, radii, colors; /* Offsets of the arrays. */
+} SnapshotHeader;
+
+static void layout(SnapshotHeader *h, int n, size_t *size);
+static void capture(void);
+static void *writer(void *arg);
+static void doneWriting(void);
+
+extern Options opts;
+extern int nBalls;
+extern Rect bounds;
+extern double stepTime;
+extern float *positionsHostBuf, *velocitiesHostBuf, *radiiHostBuf, *colorsHostBuf;
+extern cl_command_queue cpuQueue;
+extern cl_mem positionsCpuBuf, velocitiesCpuBuf, stateCpuBuf;
+
+static void *mapping; /* Loaded snapshot, or NULL. */
+static size_t mappingSize;
+
+static char *staging; /* Snapshot being written, laid out as in the file. */
+static size_t stagingSize;
+static float *packed; /* Packed state read from the CPU, if opts.layout is LAYOUT_PACKED. */
+static cl_event reads[2];
+static int nReads;
+static uint64_t steps; /* Steps simulated so far. */
+static uint64_t nextSnapshot; /* Step count at which the next snapshot is due. */
+static pthread_t writerThread;
+static pthread_mutex_t writingLock = PTHREAD_MUTEX_INITIALIZER;
+static int writing; /* The writer thread is running. */
+static int started; /* The writer thread has been started at least once. */
+
+/*
+ * Map the snapshot file filename and point the host buffers at its arrays.
+ * Sets nBalls and stepTime to those of the snapshot.
+ */
+void
+loadSnapshot(const char *filename) {
+	int fd;
+	struct stat st;
+	SnapshotHeader *h, expect;
+	size_t size;
+
+	if ((fd = open(filename, O_RDONLY)) < 0)
+		sysfatal("Failed to open snapshot '%s'.\n", filename);
+	if (fstat(fd, &st) < 0)
+		sysfatal("Failed to stat snapshot '%s'.\n", filename);
+	if ((size_t) st.st_size < sizeof(SnapshotHeader))
+		sysfatal("Snapshot '%s' is truncated.\n", filename);
+
+	/* Private, so that the simulation can write to the mapped positions. */
+	mappingSize = st.st_size;
+	mapping = mmap(NULL, mappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+		sysfatal("Failed to map snapshot '%s'.\n", filename);
+
+	h = mapping;
+	if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0)
+		sysfatal("'%s' is not a snapshot.\n", filename);
+	if (h->version != SNAPSHOT_VERSION)
+		sysfatal("Snapshot '%s' has version %lu; expected %d.\n", filename, (unsigned long) h->version, SNAPSHOT_VERSION);
+	layout(&expect, h->nBalls, &size);
+	if (h->positions != expect.positions || h->velocities != expect.velocities
+			|| h->radii != expect.radii || h->colors != expect.colors || mappingSize < size)
+		sysfatal("Snapshot '%s' is corrupt.\n", filename);
+	if (h->bounds[0] != bounds.min.x || h->bounds[1] != bounds.min.y
+			|| h->bounds[2] != bounds.max.x || h->bounds[3] != bounds.max.y)
+		sysfatal("Snapshot '%s' has different bounds.\n", filename);
+
+	nBalls = h->nBalls;
+	stepTime = h->stepTime;
+	steps = h->steps;
+	positionsHostBuf = (float *) ((char *) mapping + h->positions);
+	velocitiesHostBuf = (float *) ((char *) mapping + h->velocities);
+	radiiHostBuf = (float *) ((char *) mapping + h->radii);
+	colorsHostBuf = (float *) ((char *) mapping + h->colors);
+	printf("Loaded %d balls at step %lu from %s\n", nBalls, (unsigned long) steps, filename);
+}
+
+void
+unloadSnapshot(void) {
+	munmap(mapping, mappingSize);
+}
+
+/* Prepare to write snapshots to opts.snapshot. Call once the state is set. */
+void
+initSnapshots(void) {
+	SnapshotHeader h;
+
+	if (opts.snapshot == NULL)
+		return;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+	h.version = SNAPSHOT_VERSION;
+	h.nBalls = nBalls;
+	h.stepTime = stepTime;
+	h.bounds[0] = bounds.min.x;
+	h.bounds[1] = bounds.min.y;
+	h.bounds[2] = bounds.max.x;
+	h.bounds[3] = bounds.max.y;
+	layout(&h, nBalls, &stagingSize);
+
+	/* The radii and colors never change. */
+	if ((staging = calloc(stagingSize, 1)) == NULL)
+		sysfatal("Failed to allocate snapshot buffer.\n");
+	memcpy(staging, &h, sizeof(h));
+	memcpy(staging + h.radii, radiiHostBuf, nBalls*sizeof(float));
+	memcpy(staging + h.colors, colorsHostBuf, nBalls*3*sizeof(float));
+	if (opts.layout == LAYOUT_PACKED && (packed = malloc(nBalls*4*sizeof(float))) == NULL)
+		sysfatal("Failed to allocate snapshot buffer.\n");
+
+	nextSnapshot = steps + opts.snapshotInterval;
+	atexit(finishSnapshots);
+}
+
+/*
+ * Count n more steps, which must have been enqueued (or run) already, and
+ * start a snapshot if one is due.
+ */
+void
+snapshotSteps(int n) {
+	int busy;
+
+	if (opts.snapshot == NULL)
+		return;
+	steps += n;
+	if (steps < nextSnapshot)
+		return;
+	nextSnapshot = steps + opts.snapshotInterval;
+
+	pthread_mutex_lock(&writingLock);
+	busy = writing;
+	writing = !busy;
+	pthread_mutex_unlock(&writingLock);
+	if (busy) {
+		fprintf(stderr, "Skipping snapshot at step %lu: still writing the last one.\n", (unsigned long) steps);
+		return;
+	}
+	if (started)
+		pthread_join(writerThread, NULL);
+
+	capture();
+	if (pthread_create(&writerThread, NULL, writer, NULL) != 0)
+		sysfatal("Failed to start snapshot writer.\n");
+	started = 1;
+}
+
+/* Wait for the snapshot being written, if any. */
+void
+finishSnapshots(void) {
+	if (started) {
+		pthread_join(writerThread, NULL);
+		started = 0;
+	}
+	free(staging);
+	free(packed);
+	staging = NULL;
+	packed = NULL;
+}
+
+/* Fill in the array offsets of h for n balls, and set *size to the file size. */
+static void
+layout(SnapshotHeader *h, int n, size_t *size) {
+	size_t off;
+
+	off = ALIGN(sizeof(SnapshotHeader));
+	h->positions = off;
+	off = ALIGN(off + n*2*sizeof(float));
+	h->velocities = off;
+	off = ALIGN(off + n*2*sizeof(float));
+	h->radii = off;
+	off = ALIGN(off + n*sizeof(float));
+	h->colors = off;
+	*size = off + n*3*sizeof(float);
+}
+
+/* Start copying the current state into the staging buffer. */
+static void
+capture(void) {
+	SnapshotHeader *h;
+	int err;
+
+	h = (SnapshotHeader *) staging;
+	h->steps = steps;
+	nReads = 0;
+	if (opts.backend != BACKEND_OPENCL) {
+		memcpy(staging + h->positions, positionsHostBuf, nBalls*2*sizeof(float));
+		memcpy(staging + h->velocities, velocitiesHostBuf, nBalls*2*sizeof(float));
+		return;
+	}
+
+	err = clEnqueueReadBuffer(cpuQueue, positionsCpuBuf, CL_FALSE, 0, nBalls*2*sizeof(float), staging + h->positions, 0, NULL, &reads[nReads++]);
+	if (opts.layout == LAYOUT_PACKED)
+		err |= clEnqueueReadBuffer(cpuQueue, stateCpuBuf, CL_FALSE, 0, nBalls*4*sizeof(float), packed, 0, NULL, &reads[nReads++]);
+	else
+		err |= clEnqueueReadBuffer(cpuQueue, velocitiesCpuBuf, CL_FALSE, 0, nBalls*2*sizeof(float), staging + h->velocities, 0, NULL, &reads[nReads++]);
+	if (err < 0)
+		sysfatal("Failed to read state for snapshot.\n");
+	clFlush(cpuQueue);
+}
+
+/*
+ * Wait for the state to be captured, then write it to the snapshot file.
+ * Errors only drop the snapshot: sysfatal() here would run
+ * finishSnapshots() at exit on this thread, which would join itself.
+ */
+static void *
+writer(void *arg) {
+	SnapshotHeader *h;
+	float *vel;
+	char *tmp;
+	FILE *f;
+	int i, ok;
+
+	h = (SnapshotHeader *) staging;
+	if (nReads > 0) {
+		ok = clWaitForEvents(nReads, reads) >= 0;
+		for (i = 0; i < nReads; i++)
+			clReleaseEvent(reads[i]);
+		if (!ok) {
+			fprintf(stderr, "Error reading state for snapshot at step %lu.\n", (unsigned long) h->steps);
+			doneWriting();
+			return NULL;
+		}
+	}
+	if (opts.layout == LAYOUT_PACKED && opts.backend == BACKEND_OPENCL) {
+		vel = (float *) (staging + h->velocities);
+		for (i = 0; i < nBalls; i++) {
+			vel[2*i] = packed[4*i+2];
+			vel[2*i+1] = packed[4*i+3];
+		}
+	}
+
+	if ((tmp = malloc(strlen(opts.snapshot) + sizeof(TMP_SUFFIX))) == NULL) {
+		fprintf(stderr, "Failed to allocate snapshot file name.\n");
+		doneWriting();
+		return NULL;
+	}
+	sprintf(tmp, "%s%s", opts.snapshot, TMP_SUFFIX);
+	ok = 0;
+	if ((f = fopen(tmp, "wb")) != NULL) {
+		ok = fwrite(staging, 1, stagingSize, f) == stagingSize;
+		ok = (fclose(f) == 0) && ok;
+	}
+	if (ok && rename(tmp, opts.snapshot) != 0)
+		ok = 0;
+	if (!ok)
+		fprintf(stderr, "Failed to write snapshot '%s'\n", opts.snapshot);
+	free(tmp);
+
+	doneWriting();
+	return NULL;
+}
+
+/* Mark the writer as finished. */
+static void
+doneWriting(void) {
+	pthread_mutex_lock(&writingLock);
+	writing = 0;
+	pthread_mutex_unlock(&writingLock);
+}
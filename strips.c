@@ -0,0 +1,484 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <math.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include "balls.h"
+#include "sysfatal.h"
+#include "physics.h"
+
+/*
+ * Strips backend: the box is cut into vertical strips of equal width, each
+ * simulated by its own worker process.
+ *
+ * The workers do not run the move, collideBalls and collideWalls kernels of
+ * balls.cl. They run a C version of them instead: native.c's integration and
+ * the collision response of physics.h, with a uniform grid over each strip in
+ * place of the collision partition. OpenCL runtimes are not safe to use in a
+ * child forked from a process that has already set one up (their threads and
+ * driver state are not copied), and setting up a runtime in every worker
+ * would cost a context, a queue and a program build each. Since pairs are
+ * resolved in a different order, the results are not bit for bit those of
+ * the OpenCL backend.
+ *
+ * A worker owns the balls whose centres are in its strip. Every step it moves
+ * them, hands those that left the strip to the neighbour they moved into,
+ * and publishes copies of those within a ball's diameter of either edge as a
+ * halo. After a barrier it takes in the balls handed to it and collides its
+ * own balls against each other, its neighbours' halos and the balls it has
+ * just handed over, with a uniform grid over the strip. Balls it doesn't own
+ * are copies; their owners collide them from their side of the edge.
+ *
+ * Everything the processes share is in one POSIX shared memory object mapped
+ * before the workers are forked: the barriers, the balls of each strip and
+ * the mailboxes between neighbours. A strip has room for HEADROOM times its
+ * share of the balls, and its mailboxes and halos for HEADROOM times the
+ * share that lies within a halo's width of an edge, each plus MIN_ROOM. A
+ * worker that runs out of room flags it, and the coordinator gives up at the
+ * end of the job. At the end of each job the workers scatter their
+ * balls' state into shared arrays by index, and the coordinator copies those
+ * into the host buffers for drawing.
+ */
+
+enum { LEFT, RIGHT };
+enum { HEADROOM = 2 }; /* Room for this many times a strip's share of the balls. */
+enum { MIN_ROOM = 64 }; /* Extra room, for small shares. */
+
+typedef struct {
+	float p[2], v[2];
+	float r, invMass;
+	int id; /* Index of the ball, or -1 for a copy of another strip's ball. */
+} Body;
+
+typedef struct {
+	float lo, hi; /* Left and right edges. */
+	int nOwned;
+	int nOut[2]; /* Balls handed to the left and right neighbours this step. */
+	int nHalo[2]; /* Copies of the balls near the left and right edges. */
+	Body *owned, *out[2], *halo[2];
+} Strip;
+
+typedef struct {
+	pthread_barrier_t job; /* The coordinator and the workers, at each end of a job. */
+	pthread_barrier_t step; /* The workers, twice a step. */
+	int steps; /* Steps of the current job; 0 tells the workers to exit. */
+	int overflow; /* Set by a worker that ran out of room for its balls. */
+} Control;
+
+static void work(int s);
+static void handOver(int s);
+static void takeIn(int s);
+static void collideStrip(int s);
+static int cellOf(const Body *b, float left);
+static void collideCells(Body *b, int c1, int c2);
+static void post(Body *box, int *n, const Body *b);
+static void copyBodies(Body *dst, const Body *src, int n, int copy);
+
+extern Options opts;
+extern int nBalls;
+extern float *positionsHostBuf, *velocitiesHostBuf, *radiiHostBuf;
+extern double stepTime;
+
+static void *shared; /* The whole shared memory object. */
+static size_t sharedSize;
+static Control *control;
+static Strip *strips;
+static float *sharedPositions, *sharedVelocities; /* Gathered by index at the end of each job. */
+static pid_t *workers;
+static int nStrips;
+static float haloWidth; /* Diameter of the largest ball. */
+static int ownedRoom; /* Bodies each strip has room for. */
+static int edgeRoom; /* Bodies each mailbox and halo has room for. */
+static float gravity; /* opts.params.gravity */
+static float wallMin[2], wallMax[2]; /* opts.params.bounds */
+static float cellSize; /* Of the collision grid, at least haloWidth. */
+static int cols, rows, nCells; /* Of the grid over a strip and its halos. */
+
+/* Private to each worker, from its copy of the coordinator's memory. */
+static Body *local; /* Owned balls, then the copies. */
+static Body *sorted; /* local sorted by grid cell. */
+static int *cells; /* Cell of each ball of local. */
+static int nLocal; /* Balls in local. */
+static int *cellStarts; /* Index of each cell's first ball in sorted. */
+
+/* Map the shared memory, deal the balls out to the strips and fork the workers. */
+void
+initStrips(void) {
+	char name[64];
+	unsigned char *p;
+	Body *b;
+	pthread_barrierattr_t attr;
+	float width;
+	long n;
+	int share;
+	int fd, i, s;
+
+	gravity = opts.params.gravity;
+	wallMin[0] = opts.params.bounds.min.x;
+	wallMin[1] = opts.params.bounds.min.y;
+	wallMax[0] = opts.params.bounds.max.x;
+	wallMax[1] = opts.params.bounds.max.y;
+	haloWidth = 0;
+	for (i = 0; i < nBalls; i++)
+		if (2*radiiHostBuf[i] > haloWidth)
+			haloWidth = 2*radiiHostBuf[i];
+
+	/* A halo must not reach past the neighbouring strip. */
+	width = wallMax[0] - wallMin[0];
+	nStrips = opts.procs;
+	if (nStrips == 0)
+		nStrips = ((n = sysconf(_SC_NPROCESSORS_ONLN)) > 0) ? n : 1;
+	if (nStrips > width / haloWidth)
+		nStrips = width / haloWidth;
+	if (nStrips < 1)
+		nStrips = 1;
+	printf("Strips backend: %d processes, strips %.3g wide\n", nStrips, width / nStrips);
+
+	share = (nBalls + nStrips-1) / nStrips;
+	ownedRoom = HEADROOM*share + MIN_ROOM;
+	edgeRoom = ceilf(HEADROOM*share * haloWidth / (width / nStrips)) + MIN_ROOM;
+	ownedRoom = (ownedRoom < nBalls) ? ownedRoom : nBalls;
+	edgeRoom = (edgeRoom < ownedRoom) ? edgeRoom : ownedRoom;
+
+	sharedSize = sizeof(Control) + nStrips*sizeof(Strip) + (size_t) nBalls*4*sizeof(float)
+		+ (size_t) nStrips*(ownedRoom + 4*edgeRoom)*sizeof(Body);
+	snprintf(name, sizeof(name), "/balls-%ld", (long) getpid());
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0)
+		sysfatal("Failed to create shared memory %s.\n", name);
+	shm_unlink(name); /* Freed once every process has unmapped it. */
+	if (ftruncate(fd, sharedSize) != 0)
+		sysfatal("Failed to size shared memory.\n");
+	shared = mmap(NULL, sharedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shared == MAP_FAILED)
+		sysfatal("Failed to map shared memory.\n");
+
+	p = shared;
+	control = (Control *) p;
+	p += sizeof(Control);
+	strips = (Strip *) p;
+	p += nStrips*sizeof(Strip);
+	sharedPositions = (float *) p;
+	p += nBalls*2*sizeof(float);
+	sharedVelocities = (float *) p;
+	p += nBalls*2*sizeof(float);
+	for (s = 0; s < nStrips; s++) {
+		strips[s].lo = wallMin[0] + width * s / nStrips;
+		strips[s].hi = wallMin[0] + width * (s+1) / nStrips;
+		strips[s].owned = (Body *) p;
+		strips[s].out[LEFT] = strips[s].owned + ownedRoom;
+		strips[s].out[RIGHT] = strips[s].out[LEFT] + edgeRoom;
+		strips[s].halo[LEFT] = strips[s].out[RIGHT] + edgeRoom;
+		strips[s].halo[RIGHT] = strips[s].halo[LEFT] + edgeRoom;
+		p += (size_t) (ownedRoom + 4*edgeRoom)*sizeof(Body);
+	}
+
+	for (i = 0; i < nBalls; i++) {
+		s = (positionsHostBuf[2*i] - wallMin[0]) / width * nStrips;
+		s = (s < 0) ? 0 : (s >= nStrips) ? nStrips-1 : s;
+		if (strips[s].nOwned == ownedRoom)
+			sysfatal("More than %d balls in strip %d.\n", ownedRoom, s);
+		b = &strips[s].owned[strips[s].nOwned++];
+		b->p[0] = positionsHostBuf[2*i];
+		b->p[1] = positionsHostBuf[2*i+1];
+		b->v[0] = velocitiesHostBuf[2*i];
+		b->v[1] = velocitiesHostBuf[2*i+1];
+		b->r = radiiHostBuf[i];
+		b->invMass = 1.0f / ballMass(&opts.params, b->r);
+		b->id = i;
+	}
+
+	/* Every strip's grid covers the widest strip and both its halos. */
+	cellSize = haloWidth;
+	cols = (width / nStrips + 2*haloWidth) / cellSize + 2;
+	rows = (wallMax[1] - wallMin[1]) / cellSize + 1;
+	nCells = cols * rows;
+	local = malloc(nBalls*sizeof(Body));
+	sorted = malloc(nBalls*sizeof(Body));
+	cells = malloc(nBalls*sizeof(int));
+	cellStarts = malloc((nCells+1)*sizeof(int));
+	workers = malloc(nStrips*sizeof(pid_t));
+	if (local == NULL || sorted == NULL || cells == NULL || cellStarts == NULL || workers == NULL)
+		sysfatal("Failed to allocate strips.\n");
+
+	if (pthread_barrierattr_init(&attr) != 0
+			|| pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0
+			|| pthread_barrier_init(&control->job, &attr, nStrips+1) != 0
+			|| pthread_barrier_init(&control->step, &attr, nStrips) != 0)
+		sysfatal("Failed to create process-shared barriers.\n");
+	pthread_barrierattr_destroy(&attr);
+
+	for (s = 0; s < nStrips; s++) {
+		if ((workers[s] = fork()) < 0)
+			sysfatal("Failed to fork strip worker.\n");
+		if (workers[s] == 0)
+			work(s);
+	}
+	atexit(freeStrips);
+}
+
+/* Run n physics steps, then copy the state of every ball into the host buffers. */
+void
+simulateStrips(int n) {
+	if (n <= 0)
+		return;
+	control->steps = n;
+	pthread_barrier_wait(&control->job);
+	pthread_barrier_wait(&control->job);
+	if (control->overflow)
+		sysfatal("Too many balls crowded into one strip (room for %d, %d near an edge); use fewer processes.\n", ownedRoom, edgeRoom);
+	memcpy(positionsHostBuf, sharedPositions, nBalls*2*sizeof(float));
+	memcpy(velocitiesHostBuf, sharedVelocities, nBalls*2*sizeof(float));
+}
+
+/* Stop the workers and unmap the shared memory. Also called at exit. */
+void
+freeStrips(void) {
+	int s;
+
+	if (workers == NULL)
+		return;
+	control->steps = 0;
+	pthread_barrier_wait(&control->job);
+	for (s = 0; s < nStrips; s++)
+		waitpid(workers[s], NULL, 0);
+	pthread_barrier_destroy(&control->job);
+	pthread_barrier_destroy(&control->step);
+	munmap(shared, sharedSize);
+	free(workers);
+	workers = NULL;
+	free(local);
+	free(sorted);
+	free(cells);
+	free(cellStarts);
+}
+
+/*
+ * Body of worker s. It only touches memory that was allocated before the
+ * fork, so it is safe in a child of the multithreaded coordinator.
+ */
+static void
+work(int s) {
+	Strip *st;
+	Body *b;
+	int n, i;
+
+#ifdef __linux__
+	prctl(PR_SET_PDEATHSIG, SIGKILL); /* Don't outlive the coordinator. */
+#endif
+	st = &strips[s];
+	for (;;) {
+		pthread_barrier_wait(&control->job);
+		if ((n = control->steps) == 0)
+			_exit(0);
+		while (n-- > 0) {
+			handOver(s);
+			pthread_barrier_wait(&control->step);
+			takeIn(s);
+			collideStrip(s);
+			pthread_barrier_wait(&control->step);
+		}
+		for (i = 0; i < st->nOwned; i++) {
+			b = &st->owned[i];
+			memcpy(&sharedPositions[2*b->id], b->p, sizeof(b->p));
+			memcpy(&sharedVelocities[2*b->id], b->v, sizeof(b->v));
+		}
+		pthread_barrier_wait(&control->job);
+	}
+}
+
+/*
+ * Move strip s's balls, put those that left it in the mailbox of the
+ * neighbour they moved towards and copy those near an edge into the halos.
+ */
+static void
+handOver(int s) {
+	Strip *st;
+	Body *b;
+	int i, n;
+
+	st = &strips[s];
+	st->nOut[LEFT] = st->nOut[RIGHT] = 0;
+	st->nHalo[LEFT] = st->nHalo[RIGHT] = 0;
+	n = 0;
+	for (i = 0; i < st->nOwned; i++) {
+		b = &st->owned[i];
+		b->v[1] -= gravity * stepTime;
+		b->p[0] += b->v[0] * stepTime;
+		b->p[1] += b->v[1] * stepTime;
+
+		if (s > 0 && b->p[0] < st->lo) {
+			post(st->out[LEFT], &st->nOut[LEFT], b);
+			continue;
+		}
+		if (s < nStrips-1 && b->p[0] >= st->hi) {
+			post(st->out[RIGHT], &st->nOut[RIGHT], b);
+			continue;
+		}
+		if (s > 0 && b->p[0] < st->lo + haloWidth)
+			post(st->halo[LEFT], &st->nHalo[LEFT], b);
+		if (s < nStrips-1 && b->p[0] >= st->hi - haloWidth)
+			post(st->halo[RIGHT], &st->nHalo[RIGHT], b);
+		st->owned[n++] = *b;
+	}
+	st->nOwned = n;
+}
+
+/*
+ * Add the balls the neighbours handed to strip s to its own, and gather them
+ * with copies of every other ball they might touch into local.
+ */
+static void
+takeIn(int s) {
+	Strip *st, *left, *right;
+	int n, nLeft, nRight;
+
+	st = &strips[s];
+	left = (s > 0) ? &strips[s-1] : NULL;
+	right = (s < nStrips-1) ? &strips[s+1] : NULL;
+	nLeft = (left != NULL) ? left->nOut[RIGHT] : 0;
+	nRight = (right != NULL) ? right->nOut[LEFT] : 0;
+	if (st->nOwned + nLeft + nRight > ownedRoom) {
+		/* The coordinator gives up at the end of the job. */
+		control->overflow = 1;
+		nLeft = nRight = 0;
+	}
+	if (nLeft > 0) {
+		copyBodies(st->owned + st->nOwned, left->out[RIGHT], nLeft, 0);
+		st->nOwned += nLeft;
+	}
+	if (nRight > 0) {
+		copyBodies(st->owned + st->nOwned, right->out[LEFT], nRight, 0);
+		st->nOwned += nRight;
+	}
+
+	copyBodies(local, st->owned, st->nOwned, 0);
+	n = st->nOwned;
+	copyBodies(local + n, st->out[LEFT], st->nOut[LEFT], 1);
+	n += st->nOut[LEFT];
+	copyBodies(local + n, st->out[RIGHT], st->nOut[RIGHT], 1);
+	n += st->nOut[RIGHT];
+	if (left != NULL) {
+		copyBodies(local + n, left->halo[RIGHT], left->nHalo[RIGHT], 1);
+		n += left->nHalo[RIGHT];
+	}
+	if (right != NULL) {
+		copyBodies(local + n, right->halo[LEFT], right->nHalo[LEFT], 1);
+		n += right->nHalo[LEFT];
+	}
+	nLocal = n;
+}
+
+/*
+ * Sort local into grid cells with a counting sort, collide each cell with
+ * itself and the four neighbours after it, bounce the strip's own balls off
+ * the walls and store them back, in cell order.
+ */
+static void
+collideStrip(int s) {
+	Strip *st;
+	float left;
+	int i, c, x, y, next;
+
+	st = &strips[s];
+	left = st->lo - haloWidth;
+	memset(cellStarts, 0, (nCells+1)*sizeof(int));
+	for (i = 0; i < nLocal; i++) {
+		cells[i] = cellOf(&local[i], left);
+		cellStarts[cells[i]+1]++;
+	}
+	for (c = 0; c < nCells; c++)
+		cellStarts[c+1] += cellStarts[c];
+	for (i = 0; i < nLocal; i++)
+		sorted[cellStarts[cells[i]]++] = local[i];
+	for (c = nCells; c > 0; c--)
+		cellStarts[c] = cellStarts[c-1];
+	cellStarts[0] = 0;
+
+	for (y = 0; y < rows; y++) {
+		for (x = 0; x < cols; x++) {
+			c = y*cols + x;
+			collideCells(sorted, c, c);
+			if (x+1 < cols)
+				collideCells(sorted, c, c+1);
+			if (y+1 < rows) {
+				if (x > 0)
+					collideCells(sorted, c, c+cols-1);
+				collideCells(sorted, c, c+cols);
+				if (x+1 < cols)
+					collideCells(sorted, c, c+cols+1);
+			}
+		}
+	}
+
+	next = 0;
+	for (i = 0; i < nLocal; i++) {
+		if (sorted[i].id < 0)
+			continue;
+		bounceBall(sorted[i].p, sorted[i].v, sorted[i].r, wallMin, wallMax);
+		st->owned[next++] = sorted[i];
+	}
+}
+
+/* Grid cell of b in a strip whose grid starts at left; balls off the grid go to its edge. */
+static int
+cellOf(const Body *b, float left) {
+	int x, y;
+
+	x = (b->p[0] - left) / cellSize;
+	y = (b->p[1] - wallMin[1]) / cellSize;
+	x = (x < 0) ? 0 : (x >= cols) ? cols-1 : x;
+	y = (y < 0) ? 0 : (y >= rows) ? rows-1 : y;
+	return y*cols + x;
+}
+
+/* Collide the balls of cell c1 with those of c2, or with each other if c1 is c2. */
+static void
+collideCells(Body *b, int c1, int c2) {
+	int i, j;
+	float dx, dy, rs;
+
+	for (i = cellStarts[c1]; i < cellStarts[c1+1]; i++) {
+		for (j = (c1 == c2) ? i+1 : cellStarts[c2]; j < cellStarts[c2+1]; j++) {
+			if (b[i].id < 0 && b[j].id < 0)
+				continue;
+			dx = b[i].p[0] - b[j].p[0];
+			dy = b[i].p[1] - b[j].p[1];
+			rs = b[i].r + b[j].r;
+			if (dx*dx + dy*dy <= rs*rs)
+				resolveBalls(b[i].p, b[i].v, b[i].r, b[i].invMass, b[j].p, b[j].v, b[j].r, b[j].invMass);
+		}
+	}
+}
+
+/* Add b to the n bodies of a mailbox or halo, or flag an overflow if it is full. */
+static void
+post(Body *box, int *n, const Body *b) {
+	if (*n == edgeRoom) {
+		control->overflow = 1;
+		return;
+	}
+	box[(*n)++] = *b;
+}
+
+/* Copy n bodies, marking them as copies of another strip's balls if copy is set. */
+static void
+copyBodies(Body *dst, const Body *src, int n, int copy) {
+	int i;
+
+	memcpy(dst, src, n*sizeof(Body));
+	if (copy)
+		for (i = 0; i < n; i++)
+			dst[i].id = -1;
+}
@@ -0,0 +1,239 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <CL/cl.h>
+
+#include "balls.h"
+#include "sysfatal.h"
+#include "profile.h"
+#include "cl.h"
+
+/*
+ * Sort-and-sweep broad phase. Every frame the balls are sorted by the left
+ * edge of their bounding boxes with a parallel LSD radix sort, and each ball
+ * is swept against the balls after it until their left edges pass its right
+ * edge. Pairs whose boxes also overlap vertically are added to both balls'
+ * candidate lists, which the collision kernel then resolves. Unlike the grid,
+ * the cost does not depend on how densely the balls are packed.
+ *
+ * The radix sort splits the keys into blocks handled by one work-item each.
+ * Each pass counts the digits of every block, scans the counts in
+ * digit-major order and scatters the blocks in order, so it is stable.
+ *
+ * The candidate lists are sized from the radii (see candidateCapacity()).
+ * Candidates that still don't fit are counted, and the count is checked a
+ * few steps later so that the sweep never waits for it.
+ */
+
+enum { SORT_BLOCK = 1024 }; /* Keys per radix sort work-item. */
+
+static cl_uint candidateCapacity(void);
+static void checkDropped(int wait);
+
+extern int nBalls;
+extern float *radiiHostBuf;
+extern cl_command_queue cpuQueue;
+extern cl_kernel sweepKeysKernel, radixCountKernel, radixScanKernel, radixScatterKernel;
+extern cl_kernel sweepPairsKernel, collideCandidatesKernel;
+extern cl_mem positionsCpuBuf, velocitiesCpuBuf, radiiCpuBuf;
+
+static cl_mem keysBufs[2]; /* Sort keys, ping-ponged between passes. */
+static cl_mem ballsBufs[2]; /* Ball indices, sorted along with the keys. */
+static cl_mem digitCountsBuf; /* Digit counts of each block, then their scan. */
+static cl_mem candidatesBuf; /* capacity potential colliders per ball. */
+static cl_mem candidateCountsBuf;
+static cl_mem droppedBuf; /* Candidates that didn't fit, since the start. */
+static cl_mem newPositionsBuf, newVelocitiesBuf;
+static size_t nBlocks;
+static cl_uint capacity;
+static cl_uint dropped; /* Read back from droppedBuf. */
+static cl_event droppedRead; /* The read of dropped in flight, if any. */
+static int warned;
+
+/* Allocate the sweep buffers and set the kernel arguments that never change. */
+void
+initSweep(void) {
+	cl_uint n, blockSize, nCounts, zero;
+	int err;
+
+	n = nBalls;
+	capacity = candidateCapacity();
+	printf("Sweep: %u candidates per ball\n", capacity);
+	nBlocks = (nBalls + SORT_BLOCK-1) / SORT_BLOCK;
+	blockSize = SORT_BLOCK;
+	nCounts = nBlocks * RADIX;
+
+	keysBufs[0] = cpuBuffer(nBalls*sizeof(cl_uint));
+	keysBufs[1] = cpuBuffer(nBalls*sizeof(cl_uint));
+	ballsBufs[0] = cpuBuffer(nBalls*sizeof(cl_int));
+	ballsBufs[1] = cpuBuffer(nBalls*sizeof(cl_int));
+	digitCountsBuf = cpuBuffer(nCounts*sizeof(cl_uint));
+	candidatesBuf = cpuBuffer((size_t) nBalls*capacity*sizeof(cl_int));
+	candidateCountsBuf = cpuBuffer(nBalls*sizeof(cl_int));
+	droppedBuf = cpuBuffer(sizeof(cl_uint));
+	zero = 0;
+	if (clEnqueueWriteBuffer(cpuQueue, droppedBuf, CL_TRUE, 0, sizeof(zero), &zero, 0, NULL, NULL) < 0)
+		sysfatal("Failed to clear dropped candidate count.\n");
+	newPositionsBuf = cpuBuffer(nBalls*2*sizeof(float));
+	newVelocitiesBuf = cpuBuffer(nBalls*2*sizeof(float));
+
+	err = clSetKernelArg(sweepKeysKernel, 0, sizeof(positionsCpuBuf), &positionsCpuBuf);
+	err |= clSetKernelArg(sweepKeysKernel, 1, sizeof(radiiCpuBuf), &radiiCpuBuf);
+	err |= clSetKernelArg(sweepKeysKernel, 2, sizeof(keysBufs[0]), &keysBufs[0]);
+	err |= clSetKernelArg(sweepKeysKernel, 3, sizeof(ballsBufs[0]), &ballsBufs[0]);
+	err |= clSetKernelArg(sweepKeysKernel, 4, sizeof(candidateCountsBuf), &candidateCountsBuf);
+
+	err |= clSetKernelArg(radixCountKernel, 1, sizeof(digitCountsBuf), &digitCountsBuf);
+	err |= clSetKernelArg(radixCountKernel, 3, sizeof(blockSize), &blockSize);
+	err |= clSetKernelArg(radixCountKernel, 4, sizeof(n), &n);
+
+	err |= clSetKernelArg(radixScanKernel, 0, sizeof(digitCountsBuf), &digitCountsBuf);
+	err |= clSetKernelArg(radixScanKernel, 1, sizeof(nCounts), &nCounts);
+
+	err |= clSetKernelArg(radixScatterKernel, 4, sizeof(digitCountsBuf), &digitCountsBuf);
+	err |= clSetKernelArg(radixScatterKernel, 6, sizeof(blockSize), &blockSize);
+	err |= clSetKernelArg(radixScatterKernel, 7, sizeof(n), &n);
+
+	/* RADIX_PASSES is even, so the sorted result ends up back in buffer 0. */
+	err |= clSetKernelArg(sweepPairsKernel, 0, sizeof(positionsCpuBuf), &positionsCpuBuf);
+	err |= clSetKernelArg(sweepPairsKernel, 1, sizeof(radiiCpuBuf), &radiiCpuBuf);
+	err |= clSetKernelArg(sweepPairsKernel, 2, sizeof(ballsBufs[0]), &ballsBufs[0]);
+	err |= clSetKernelArg(sweepPairsKernel, 3, sizeof(candidatesBuf), &candidatesBuf);
+	err |= clSetKernelArg(sweepPairsKernel, 4, sizeof(candidateCountsBuf), &candidateCountsBuf);
+	err |= clSetKernelArg(sweepPairsKernel, 5, sizeof(droppedBuf), &droppedBuf);
+	err |= clSetKernelArg(sweepPairsKernel, 6, sizeof(capacity), &capacity);
+	err |= clSetKernelArg(sweepPairsKernel, 7, sizeof(n), &n);
+
+	err |= clSetKernelArg(collideCandidatesKernel, 0, sizeof(positionsCpuBuf), &positionsCpuBuf);
+	err |= clSetKernelArg(collideCandidatesKernel, 1, sizeof(velocitiesCpuBuf), &velocitiesCpuBuf);
+	err |= clSetKernelArg(collideCandidatesKernel, 2, sizeof(radiiCpuBuf), &radiiCpuBuf);
+	err |= clSetKernelArg(collideCandidatesKernel, 3, sizeof(candidatesBuf), &candidatesBuf);
+	err |= clSetKernelArg(collideCandidatesKernel, 4, sizeof(candidateCountsBuf), &candidateCountsBuf);
+	err |= clSetKernelArg(collideCandidatesKernel, 5, sizeof(newPositionsBuf), &newPositionsBuf);
+	err |= clSetKernelArg(collideCandidatesKernel, 6, sizeof(newVelocitiesBuf), &newVelocitiesBuf);
+	err |= clSetKernelArg(collideCandidatesKernel, 7, sizeof(capacity), &capacity);
+
+	if (err < 0)
+		sysfatal("Failed to set sweep kernel arguments.\n");
+}
+
+/*
+ * Longest candidate list a ball can need: as many of the smallest balls as
+ * fit, without overlapping, in the square that the largest ball's bounding
+ * box can overlap. Balls only overlap a little before they are separated,
+ * and hexagonal packing only covers 91% of the plane, which leaves room for
+ * that. Clamped to [SWEEP_CANDIDATES, SWEEP_CANDIDATES_MAX].
+ */
+static cl_uint
+candidateCapacity(void) {
+	float rMin, rMax;
+	double side, limit;
+	int i;
+
+	rMin = rMax = radiiHostBuf[0];
+	for (i = 1; i < nBalls; i++) {
+		if (radiiHostBuf[i] < rMin)
+			rMin = radiiHostBuf[i];
+		if (radiiHostBuf[i] > rMax)
+			rMax = radiiHostBuf[i];
+	}
+	/* Centers within rMax+rMax of the center, plus the balls' own radius. */
+	side = 4*rMax + 2*rMin;
+	limit = (rMin > 0) ? ceil(side*side / (PI*rMin*rMin)) : SWEEP_CANDIDATES_MAX;
+	if (limit < SWEEP_CANDIDATES)
+		return SWEEP_CANDIDATES;
+	if (limit > SWEEP_CANDIDATES_MAX)
+		return SWEEP_CANDIDATES_MAX;
+	return limit;
+}
+
+/*
+ * Warn, once, if candidates have been dropped. Unless wait is set, this
+ * only looks at a count whose read has already finished, and otherwise
+ * starts a read for a later call.
+ */
+static void
+checkDropped(int wait) {
+	cl_int status;
+
+	if (warned)
+		return;
+	if (droppedRead == NULL) {
+		if (clEnqueueReadBuffer(cpuQueue, droppedBuf, CL_FALSE, 0, sizeof(dropped), &dropped, 0, NULL, &droppedRead) < 0)
+			sysfatal("Failed to read dropped candidate count.\n");
+		if (!wait)
+			return;
+	}
+	if (wait)
+		clWaitForEvents(1, &droppedRead);
+	if (clGetEventInfo(droppedRead, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL) < 0)
+		sysfatal("Failed to get status of dropped candidate count.\n");
+	if (status != CL_COMPLETE)
+		return;
+	clReleaseEvent(droppedRead);
+	droppedRead = NULL;
+	if (dropped > 0) {
+		fprintf(stderr, "Sweep: %u candidates didn't fit in lists of %u; their collisions were missed.\n", dropped, capacity);
+		warned = 1;
+	}
+}
+
+/* Sort the balls along x, sweep for candidate pairs and collide them. */
+void
+collideSweep(void) {
+	cl_uint pass, shift;
+	int src, err;
+
+	runCpuKernel(sweepKeysKernel, nBalls, "sweepKeys");
+
+	for (pass = 0; pass < RADIX_PASSES; pass++) {
+		src = pass % 2;
+		shift = pass * RADIX_BITS;
+
+		err = clSetKernelArg(radixCountKernel, 0, sizeof(keysBufs[src]), &keysBufs[src]);
+		err |= clSetKernelArg(radixCountKernel, 2, sizeof(shift), &shift);
+		err |= clSetKernelArg(radixScatterKernel, 0, sizeof(keysBufs[src]), &keysBufs[src]);
+		err |= clSetKernelArg(radixScatterKernel, 1, sizeof(ballsBufs[src]), &ballsBufs[src]);
+		err |= clSetKernelArg(radixScatterKernel, 2, sizeof(keysBufs[!src]), &keysBufs[!src]);
+		err |= clSetKernelArg(radixScatterKernel, 3, sizeof(ballsBufs[!src]), &ballsBufs[!src]);
+		err |= clSetKernelArg(radixScatterKernel, 5, sizeof(shift), &shift);
+		if (err < 0)
+			sysfatal("Failed to set radix sort kernel arguments.\n");
+
+		runCpuKernel(radixCountKernel, nBlocks, "radixCount");
+		runCpuKernel(radixScanKernel, 1, "radixScan");
+		runCpuKernel(radixScatterKernel, nBlocks, "radixScatter");
+	}
+
+	runCpuKernel(sweepPairsKernel, nBalls, "sweepPairs");
+	runCpuKernel(collideCandidatesKernel, nBalls, "collideCandidates");
+	checkDropped(0);
+
+	err = clEnqueueCopyBuffer(cpuQueue, newPositionsBuf, positionsCpuBuf, 0, 0, nBalls*2*sizeof(float), 0, NULL, profileEvent("copyPositions", STAGE_CPU));
+	err |= clEnqueueCopyBuffer(cpuQueue, newVelocitiesBuf, velocitiesCpuBuf, 0, 0, nBalls*2*sizeof(float), 0, NULL, profileEvent("copyVelocities", STAGE_CPU));
+	if (err < 0)
+		sysfatal("Failed to copy back sweep collision results.\n");
+}
+
+void
+freeSweep(void) {
+	/* Drop a read from before the last steps and check the final count. */
+	if (droppedRead != NULL) {
+		clWaitForEvents(1, &droppedRead);
+		clReleaseEvent(droppedRead);
+		droppedRead = NULL;
+	}
+	checkDropped(1);
+	clReleaseMemObject(keysBufs[0]);
+	clReleaseMemObject(keysBufs[1]);
+	clReleaseMemObject(ballsBufs[0]);
+	clReleaseMemObject(ballsBufs[1]);
+	clReleaseMemObject(digitCountsBuf);
+	clReleaseMemObject(candidatesBuf);
+	clReleaseMemObject(candidateCountsBuf);
+	clReleaseMemObject(droppedBuf);
+	clReleaseMemObject(newPositionsBuf);
+	clReleaseMemObject(newVelocitiesBuf);
+}
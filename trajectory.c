@@ -0,0 +1,364 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <CL/cl.h>
+
+#include "balls.h"
+#include "sysfatal.h"
+
+/*
+ * Trajectory output: the positions, and optionally the velocities, of the
+ * balls at every frame, streamed to opts.trajectory by a writer thread.
+ *
+ * Frames pass to the writer through a ring of TRAJ_RING slots with a single
+ * producer (the thread running the simulation) and a single consumer, which
+ * synchronise only through the atomic counts of frames filled and frames
+ * written; a semaphore lets the writer sleep while the ring is empty. The
+ * producer enqueues non-blocking reads of the state into a free slot and
+ * never waits: if the ring is full, the frame is dropped and counted. The
+ * writer waits for the reads, encodes the frame and appends it to the file.
+ *
+ * The file is a TrajHeader, the frames, and then the index: a TrajIndex for
+ * each frame, at offset header.index. A frame is a TrajFrameHeader followed
+ * by its payload, the positions (x, y) and then the velocities (x, y) of the
+ * balls as float words in host byte order. With TRAJ_DELTA the words are
+ * XORed with those of the previous frame and compressed by encode(). Frames
+ * come in chunks of TRAJ_CHUNK, and the first of each chunk (a key frame) is
+ * XORed with zero instead, so any frame can be decoded starting from the key
+ * frame of its chunk. The index and the frame counts are written when the
+ * file is closed; until then the frames can still be read in sequence.
+ */
+
+#define TRAJ_MAGIC "BALLTRAJ"
+
+enum { TRAJ_VERSION = 1 };
+
+/* Flags of a trajectory file. */
+enum {
+	TRAJ_VELOCITIES = 1 << 0, /* Frames have velocities. */
+	TRAJ_DELTA = 1 << 1, /* Frames are delta-encoded and compressed. */
+};
+
+typedef struct {
+	char magic[8]; /* TRAJ_MAGIC, without the '\0'. */
+	uint32_t version;
+	uint32_t nBalls;
+	uint32_t flags;
+	uint32_t chunk; /* Frames per chunk. */
+	double stepTime; /* Seconds of simulated time per step. */
+	float bounds[4]; /* min.x, min.y, max.x, max.y */
+	uint64_t nFrames;
+	uint64_t dropped; /* Frames dropped because the writer fell behind. */
+	uint64_t index; /* Offset of the index, or 0 if the file wasn't closed. */
+} TrajHeader;
+
+typedef struct {
+	uint64_t step; /* Steps simulated before the frame. */
+	uint32_t size; /* Of the payload, in bytes. */
+	uint32_t key; /* Non-zero for the first frame of a chunk. */
+} TrajFrameHeader;
+
+typedef struct {
+	uint64_t step;
+	uint64_t offset; /* Of the frame's TrajFrameHeader. */
+} TrajIndex;
+
+/* A slot of the ring. */
+typedef struct {
+	uint32_t *words; /* Positions, then velocities; as in the file. */
+	float *packed; /* Packed state read from the CPU, if needed for the velocities. */
+	cl_event reads[2];
+	int nReads;
+	uint64_t step;
+} Slot;
+
+static void *writer(void *arg);
+static void writeFrame(Slot *s);
+static size_t encode(const uint32_t *words, const uint32_t *prev, size_t n, unsigned char *out);
+
+extern Options opts;
+extern int nBalls;
+extern Rect bounds;
+extern double stepTime;
+extern float *positionsHostBuf, *velocitiesHostBuf;
+extern cl_command_queue cpuQueue;
+extern cl_mem positionsCpuBuf, velocitiesCpuBuf, stateCpuBuf;
+
+static Slot ring[TRAJ_RING];
+static unsigned long filled; /* Frames put in the ring; written by the producer only. */
+static unsigned long taken; /* Frames taken out of the ring; written by the writer only. */
+static sem_t ready; /* Posted for each frame filled, and once more to stop. */
+static pthread_t writerThread;
+static int started;
+static int readPacked; /* Velocities come from the packed state. */
+
+/* Producer only. */
+static uint64_t steps; /* Steps simulated so far. */
+static uint64_t dropped;
+
+/* Writer only, until it has been joined. */
+static FILE *file;
+static TrajHeader header; /* As written at the start of the file. */
+static size_t nWords; /* Words per frame. */
+static uint32_t *prev; /* Words of the previous frame, with TRAJ_DELTA. */
+static unsigned char *planes, *encoded; /* Scratch of encode(). */
+static TrajIndex *frameIndex;
+static size_t indexCap;
+static uint64_t nFrames;
+static uint64_t offset; /* Of the end of the file. */
+static int failed; /* A write failed; later frames are discarded. */
+
+/* Open opts.trajectory and start the writer. Call once the state is set. */
+void
+initTrajectory(void) {
+	TrajHeader *h;
+	int i;
+
+	if (opts.trajectory == NULL)
+		return;
+
+	nWords = (size_t) nBalls * (opts.trajectoryVelocities ? 4 : 2);
+	readPacked = opts.trajectoryVelocities && opts.layout == LAYOUT_PACKED && opts.backend == BACKEND_OPENCL;
+	for (i = 0; i < TRAJ_RING; i++) {
+		if ((ring[i].words = malloc(nWords*sizeof(uint32_t))) == NULL)
+			sysfatal("Failed to allocate trajectory ring.\n");
+		if (readPacked && (ring[i].packed = malloc(nBalls*4*sizeof(float))) == NULL)
+			sysfatal("Failed to allocate trajectory ring.\n");
+	}
+	if (opts.trajectoryDelta) {
+		prev = malloc(nWords*sizeof(uint32_t));
+		planes = malloc(nWords*sizeof(uint32_t));
+		encoded = malloc(nWords*sizeof(uint32_t) + nWords*sizeof(uint32_t)/128 + 1);
+		if (prev == NULL || planes == NULL || encoded == NULL)
+			sysfatal("Failed to allocate trajectory buffers.\n");
+	}
+
+	h = &header;
+	memcpy(h->magic, TRAJ_MAGIC, sizeof(h->magic));
+	h->version = TRAJ_VERSION;
+	h->nBalls = nBalls;
+	h->flags = (opts.trajectoryVelocities ? TRAJ_VELOCITIES : 0) | (opts.trajectoryDelta ? TRAJ_DELTA : 0);
+	h->chunk = TRAJ_CHUNK;
+	h->stepTime = stepTime;
+	h->bounds[0] = bounds.min.x;
+	h->bounds[1] = bounds.min.y;
+	h->bounds[2] = bounds.max.x;
+	h->bounds[3] = bounds.max.y;
+	if ((file = fopen(opts.trajectory, "wb")) == NULL)
+		sysfatal("Failed to open trajectory '%s'.\n", opts.trajectory);
+	if (fwrite(h, sizeof(*h), 1, file) != 1)
+		sysfatal("Failed to write trajectory '%s'.\n", opts.trajectory);
+	offset = sizeof(*h);
+
+	if (sem_init(&ready, 0, 0) != 0)
+		sysfatal("Failed to create trajectory semaphore.\n");
+	if (pthread_create(&writerThread, NULL, writer, NULL) != 0)
+		sysfatal("Failed to start trajectory writer.\n");
+	started = 1;
+	atexit(finishTrajectory);
+}
+
+/*
+ * Count a frame of n steps, which must have been enqueued (or run) already,
+ * and hand its state to the writer, or drop it if the ring is full.
+ */
+void
+trajectoryFrame(int n) {
+	Slot *s;
+	int err;
+
+	if (!started || n == 0)
+		return;
+	steps += n;
+	if (filled - __atomic_load_n(&taken, __ATOMIC_ACQUIRE) == TRAJ_RING) {
+		dropped++;
+		return;
+	}
+
+	s = &ring[filled % TRAJ_RING];
+	s->step = steps;
+	s->nReads = 0;
+	if (opts.backend != BACKEND_OPENCL) {
+		memcpy(s->words, positionsHostBuf, nBalls*2*sizeof(float));
+		if (opts.trajectoryVelocities)
+			memcpy(s->words + 2*nBalls, velocitiesHostBuf, nBalls*2*sizeof(float));
+	} else {
+		err = clEnqueueReadBuffer(cpuQueue, positionsCpuBuf, CL_FALSE, 0, nBalls*2*sizeof(float), s->words, 0, NULL, &s->reads[s->nReads++]);
+		if (readPacked)
+			err |= clEnqueueReadBuffer(cpuQueue, stateCpuBuf, CL_FALSE, 0, nBalls*4*sizeof(float), s->packed, 0, NULL, &s->reads[s->nReads++]);
+		else if (opts.trajectoryVelocities)
+			err |= clEnqueueReadBuffer(cpuQueue, velocitiesCpuBuf, CL_FALSE, 0, nBalls*2*sizeof(float), s->words + 2*nBalls, 0, NULL, &s->reads[s->nReads++]);
+		if (err < 0)
+			sysfatal("Failed to read state for trajectory.\n");
+		clFlush(cpuQueue);
+	}
+	__atomic_store_n(&filled, filled+1, __ATOMIC_RELEASE);
+	sem_post(&ready);
+}
+
+/* Write the frames still in the ring and the index, and close the file. */
+void
+finishTrajectory(void) {
+	int i;
+
+	if (!started)
+		return;
+	started = 0;
+	sem_post(&ready);
+	pthread_join(writerThread, NULL);
+	sem_destroy(&ready);
+
+	if (!failed && fwrite(frameIndex, sizeof(TrajIndex), nFrames, file) != nFrames)
+		failed = 1;
+	if (!failed) {
+		header.nFrames = nFrames;
+		header.dropped = dropped;
+		header.index = offset;
+		rewind(file);
+		failed = fwrite(&header, sizeof(header), 1, file) != 1;
+	}
+	if (fclose(file) != 0 || failed)
+		fprintf(stderr, "Failed to write trajectory '%s'\n", opts.trajectory);
+	else
+		printf("Wrote %lu frames (%.1f MB) to %s; dropped %lu\n", (unsigned long) nFrames,
+			(offset + nFrames*sizeof(TrajIndex)) / 1e6, opts.trajectory, (unsigned long) dropped);
+
+	for (i = 0; i < TRAJ_RING; i++) {
+		free(ring[i].words);
+		free(ring[i].packed);
+	}
+	free(prev);
+	free(planes);
+	free(encoded);
+	free(frameIndex);
+}
+
+/*
+ * Write frames as they are filled until posted with the ring empty. Errors
+ * set failed rather than calling sysfatal(), which would run
+ * finishTrajectory() at exit on this thread, and it joins this thread.
+ */
+static void *
+writer(void *arg) {
+	for (;;) {
+		while (sem_wait(&ready) != 0) {
+			if (errno != EINTR) {
+				fprintf(stderr, "Failed to wait for trajectory frames; discarding the rest.\n");
+				failed = 1;
+				return NULL;
+			}
+		}
+		if (taken == __atomic_load_n(&filled, __ATOMIC_ACQUIRE))
+			break;
+		writeFrame(&ring[taken % TRAJ_RING]);
+		__atomic_store_n(&taken, taken+1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/* Wait for the state of slot s to be read, then append it to the file. */
+static void
+writeFrame(Slot *s) {
+	TrajFrameHeader fh;
+	TrajIndex *grown;
+	const void *payload;
+	float *vel;
+	int i, ok;
+
+	if (s->nReads > 0) {
+		ok = clWaitForEvents(s->nReads, s->reads) >= 0;
+		for (i = 0; i < s->nReads; i++)
+			clReleaseEvent(s->reads[i]);
+		if (!ok && !failed) {
+			fprintf(stderr, "Error reading state for trajectory; discarding the rest.\n");
+			failed = 1;
+		}
+	}
+	if (failed)
+		return;
+	if (readPacked) {
+		vel = (float *) (s->words + 2*nBalls);
+		for (i = 0; i < nBalls; i++) {
+			vel[2*i] = s->packed[4*i+2];
+			vel[2*i+1] = s->packed[4*i+3];
+		}
+	}
+
+	fh.step = s->step;
+	fh.key = (nFrames % TRAJ_CHUNK == 0);
+	if (opts.trajectoryDelta) {
+		if (fh.key)
+			memset(prev, 0, nWords*sizeof(uint32_t));
+		fh.size = encode(s->words, prev, nWords, encoded);
+		memcpy(prev, s->words, nWords*sizeof(uint32_t));
+		payload = encoded;
+	} else {
+		fh.size = nWords*sizeof(uint32_t);
+		payload = s->words;
+	}
+
+	if (nFrames == indexCap) {
+		if ((grown = realloc(frameIndex, ((indexCap == 0) ? 256 : 2*indexCap)*sizeof(TrajIndex))) == NULL) {
+			fprintf(stderr, "Failed to grow trajectory index; discarding the rest.\n");
+			failed = 1;
+			return;
+		}
+		frameIndex = grown;
+		indexCap = (indexCap == 0) ? 256 : 2*indexCap;
+	}
+	frameIndex[nFrames].step = fh.step;
+	frameIndex[nFrames].offset = offset;
+	if (fwrite(&fh, sizeof(fh), 1, file) != 1 || fwrite(payload, 1, fh.size, file) != fh.size) {
+		fprintf(stderr, "Failed to write trajectory '%s'; discarding the rest.\n", opts.trajectory);
+		failed = 1;
+		return;
+	}
+	offset += sizeof(fh) + fh.size;
+	nFrames++;
+}
+
+/*
+ * Encode n words XORed with prev into out, which must have room for
+ * 4n + 4n/128 + 1 bytes, and return the size. The XORed words are split
+ * into byte planes, the most significant bytes of every word first, and the
+ * planes are run-length encoded: a control byte c < 128 is followed by c+1
+ * literal bytes, and c >= 128 stands for c-127 zero bytes. Balls move
+ * little between frames, so the high planes are mostly zero.
+ */
+static size_t
+encode(const uint32_t *words, const uint32_t *prev, size_t n, unsigned char *out) {
+	size_t i, size, len, run;
+	uint32_t x;
+	int b;
+
+	for (i = 0; i < n; i++) {
+		x = words[i] ^ prev[i];
+		for (b = 0; b < 4; b++)
+			planes[b*n + i] = x >> (24 - 8*b);
+	}
+
+	size = 4*n;
+	len = 0;
+	for (i = 0; i < size; i += run) {
+		for (run = 0; i+run < size && run < 128 && planes[i+run] == 0; run++)
+			;
+		if (run > 0) {
+			out[len++] = 127 + run;
+			continue;
+		}
+		/* Up to the next pair of zeros; a lone zero is cheaper as a literal. */
+		for (run = 1; i+run < size && run < 128; run++)
+			if (planes[i+run] == 0 && i+run+1 < size && planes[i+run+1] == 0)
+				break;
+		out[len++] = run - 1;
+		memcpy(out+len, planes+i, run);
+		len += run;
+	}
+	return len;
+}